@@ -26,9 +26,13 @@ import_array();
 %include "primitives.i"
 %include "bounding_box.i"
 %include "light.i"
+%include "instance.i"
+%include "triangle_mesh.i"
 %include "simple_scene.i"
 %include "raytracer.i"
 
 %include "kdtree.i"
+%include "bvh.i"
+%include "scene_file.i"
 
 #endif /* SWIGPYTHON */
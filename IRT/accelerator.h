@@ -0,0 +1,152 @@
+/**
+ * \file accelerator.h
+ * The common interface of the structures accelerating the ray/primitive lookup
+ */
+
+#ifndef ACCELERATOR
+#define ACCELERATOR
+
+#include <vector>
+
+#include "common.h"
+#include "bounding_box.h"
+#include "ray.h"
+#include "ray_packet.h"
+#include "primitives.h"
+
+namespace IRT
+{
+  /// Work done by the traversal of one or several rays
+  struct TraversalStatistics
+  {
+    /// Number of inner nodes visited
+    long inner_nodes;
+    /// Number of leaves visited
+    long leaves;
+    /// Number of primitive intersection tests
+    long intersection_tests;
+    /// Number of far nodes pushed on the stack
+    long pushes;
+
+    TraversalStatistics()
+    :inner_nodes(0), leaves(0), intersection_tests(0), pushes(0)
+    {
+    }
+
+    TraversalStatistics& operator+=(const TraversalStatistics& other)
+    {
+      inner_nodes += other.inner_nodes;
+      leaves += other.leaves;
+      intersection_tests += other.intersection_tests;
+      pushes += other.pushes;
+      return *this;
+    }
+  };
+
+  /// The interface the scene uses to find the primitives hit by rays
+  template<class Primitive>
+  class Accelerator
+  {
+  public:
+    /// Virtual destructor
+    virtual ~Accelerator()
+    {
+    }
+
+    /**
+     * Resets the structure to one node containing all the primitives
+     * @param primitives is the primitives container
+     */
+    virtual void setPrimitives(const std::vector<Primitive*>& primitives) = 0;
+
+    /**
+     * Adds a primitive to a structure that was not subdivided
+     * @param primitive is the new primitive
+     * @return false if the structure was subdivided and must be reset
+     */
+    virtual bool appendPrimitive(Primitive* primitive) = 0;
+
+    /**
+     * Adds a primitive to a structure that may be subdivided, without rebuilding it
+     * @param primitive is the new primitive
+     * @param primitive_bb is the bounding box of the primitive
+     * @param bb is the bounding box of the scene, including the new primitive
+     */
+    virtual void insertPrimitive(Primitive* primitive, const BoundingBox& primitive_bb, const BoundingBox& bb) = 0;
+
+    /**
+     * Removes a primitive from a structure that may be subdivided, without rebuilding it
+     * @param primitive is the primitive to remove
+     * @param primitive_bb is the bounding box the primitive had when it was added
+     * @param bb is the bounding box of the scene
+     */
+    virtual void removePrimitive(Primitive* primitive, const BoundingBox& primitive_bb, const BoundingBox& bb) = 0;
+
+    /**
+     * Returns how much the incremental updates degraded the structure
+     * @return the estimated cost of the structure relative to its cost when it was built
+     */
+    virtual DataType getDegradation() const = 0;
+
+    /**
+     * Returns the first collision of a ray
+     * @param ray is the ray to test
+     * @param dist is the distance to the primitive
+     * @param tnear is the entry distance of the ray
+     * @param tfar is the exit distance of the ray
+     * @return the hit primitive, else NULL
+     */
+    virtual Primitive* getFirstCollision(const Ray& ray, float& dist, float tnear, float tfar) const = 0;
+
+    /**
+     * Returns the first collision of a ray with the data that the intersection test computed
+     * @param ray is the ray to test
+     * @param hit is filled with the primitive, the distance and the data of the hit
+     * @param tnear is the entry distance of the ray
+     * @param tfar is the exit distance of the ray
+     * @return the hit primitive, else NULL
+     */
+    virtual Primitive* getFirstCollision(const Ray& ray, HitRecord& hit, float tnear, float tfar) const = 0;
+
+    /**
+     * Tests if a ray hits any primitive
+     * @param ray is the ray to test
+     * @param tnear is the distance where the test starts
+     * @param tfar is the distance where the test stops
+     * @return true if a primitive is hit between tnear and tfar
+     */
+    virtual bool testCollision(const Ray& ray, float tnear, float tfar) const = 0;
+
+    /**
+     * Returns the first collisions of a packet of rays
+     * @param packet is the packet to test
+     * @param tnear is the entry distance of each ray
+     * @param tfar is the exit distance of each ray
+     * @param active indicates the rays to trace
+     * @param hits is filled with the record of the hit of each ray, its primitive being NULL if there is none
+     */
+    virtual void getFirstCollisions(const RayPacket& packet, const RayPacket::Array& tnear, const RayPacket::Array& tfar, const RayPacket::Mask& active, HitRecord* hits) const = 0;
+
+    /**
+     * Returns the level in the structure where the ray hits a primitive
+     * @param ray is the ray to test
+     * @return the hit level
+     */
+    virtual int getHitLevel(const Ray& ray, float tnear, float tfar) const = 0;
+
+    /**
+     * Returns the work done in the structure to find the first collision
+     * @param ray is the ray to test
+     * @return the traversal statistics of the ray
+     */
+    virtual TraversalStatistics getTraversalStatistics(const Ray& ray, float tnear, float tfar) const = 0;
+
+    /// Returns the number of intersection tests skipped because the primitive was already tested by the same ray
+    virtual unsigned long getAvoidedTests() const = 0;
+
+    /// Resets the number of skipped intersection tests
+    virtual void resetAvoidedTests() = 0;
+  };
+}
+
+#endif
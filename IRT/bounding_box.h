@@ -6,7 +6,11 @@
 #ifndef BOUNDINGBOX
 #define BOUNDINGBOX
 
+#include <algorithm>
+#include <limits>
+
 #include "common.h"
+#include "ray.h"
 
 namespace IRT
 {
@@ -24,62 +28,59 @@ namespace IRT
     }
 
     /**
-     * Computes the entry and exit distances of the ray for this bounding box
+     * Computes the entry and exit distances of the ray for the box between two corners
+     * The slabs are selected by the signs of the ray instead of by branches.
      */
-    bool getEntryExitDistances(const Ray& ray, DataType& tnear, DataType& tfar) const
+    static bool getEntryExitDistances(const Point3df& corner1, const Point3df& corner2, const Ray& ray, DataType& tnear, DataType& tfar)
     {
-      tfar = std::numeric_limits<float>::max();
+      const Point3df* corners[2] = {&corner1, &corner2};
       tnear = std::numeric_limits<float>::epsilon();
+      tfar = std::numeric_limits<float>::max();
       for(int i = 0; i < 3; ++i)
       {
-        float pos = ray.origin()(i) + tfar * ray.direction()(i);
-        float pos_near = ray.origin()(i) + tnear * ray.direction()(i);
-        if(ray.direction()(i) < 0)
-        {
-          if(pos < corner1(i))
-          {
-            tfar = (corner1(i) - ray.origin()(i)) / ray.direction()(i);
-          }
-          else if(pos > corner2(i))
-          {
-            tfar = std::numeric_limits<float>::epsilon();
-          }
-          if(pos_near > corner2(i))
-          {
-            tnear = (corner2(i) - ray.origin()(i)) / ray.direction()(i);
-          }
-          else if(pos_near < corner1(i))
-          {
-            tnear = std::numeric_limits<float>::max();
-          }
-        }
-        else if (ray.direction()(i) > 0)
-        {
-          if(pos > corner2(i))
-          {
-            tfar = (corner2(i) - ray.origin()(i)) / ray.direction()(i);
-          }
-          else if(pos < corner1(i))
-          {
-            tfar = std::numeric_limits<float>::epsilon();
-          }
-          if(pos_near < corner1(i))
-          {
-            tnear = (corner1(i) - ray.origin()(i)) / ray.direction()(i);
-          }
-          else if(pos_near > corner2(i))
-          {
-            tnear = std::numeric_limits<float>::max();
-          }
-        }
-
-        if (tnear > tfar)
-        {
-          return false;
-        }
+        DataType entry = ((*corners[ray.sign(i)])(i) - ray.origin()(i)) * ray.invDirection()(i);
+        DataType exit = ((*corners[1 - ray.sign(i)])(i) - ray.origin()(i)) * ray.invDirection()(i);
+        // A NaN (origin on a slab of a parallel ray) is the second argument, so it is ignored
+        tnear = std::max(tnear, entry);
+        tfar = std::min(tfar, exit);
       }
 
-      return true;
+      return tnear <= tfar;
+    }
+
+    /**
+     * Computes the entry and exit distances of the ray for this bounding box
+     */
+    bool getEntryExitDistances(const Ray& ray, DataType& tnear, DataType& tfar) const
+    {
+      return getEntryExitDistances(corner1, corner2, ray, tnear, tfar);
+    }
+
+    /// Returns a box that contains no point, the neutral element of the union of boxes
+    static BoundingBox empty()
+    {
+      BoundingBox bb;
+      bb.corner1 = Point3df::Constant(std::numeric_limits<DataType>::max());
+      bb.corner2 = Point3df::Constant(-std::numeric_limits<DataType>::max());
+      return bb;
+    }
+
+    /// Returns true if the box contains no point
+    bool isEmpty() const
+    {
+      return !(corner1.array() <= corner2.array()).all();
+    }
+
+    /**
+     * Returns the intersection of this box with another one
+     * @return the common part of the boxes, empty if they do not overlap
+     */
+    BoundingBox clip(const BoundingBox& box) const
+    {
+      BoundingBox bb;
+      bb.corner1 = corner1.cwiseMax(box.corner1);
+      bb.corner2 = corner2.cwiseMin(box.corner2);
+      return bb;
     }
 
     DataType SAH() const
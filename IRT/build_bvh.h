@@ -0,0 +1,201 @@
+/**
+ * \file build_bvh.h
+ * The SAH construction of the bounding volume hierarchy
+ */
+
+#ifndef BUILDBVH
+#define BUILDBVH
+
+#include <algorithm>
+#include <vector>
+
+#include "simple_scene.h"
+#include "bvh.h"
+
+#ifdef max
+#undef max
+#endif
+
+namespace IRT
+{
+  struct BuildBVH
+  {
+    /// A primitive with its bounds, as seen by the builder
+    struct Reference
+    {
+      Primitive* primitive;
+      BoundingBox bb;
+      Point3df centroid;
+    };
+
+    /// Orders references along an axis
+    struct CentroidLess
+    {
+      int axis;
+
+      CentroidLess(int axis)
+      :axis(axis)
+      {
+      }
+
+      bool operator()(const Reference& reference1, const Reference& reference2) const
+      {
+        return reference1.centroid(axis) < reference2.centroid(axis);
+      }
+    };
+
+    /// Cost of visiting an inner node relative to one intersection test
+    static DataType traversalCost()
+    {
+      return .125;
+    }
+
+    /// Maximum depth, bounded by the traversal stack
+    static int maxDepth()
+    {
+      return 60;
+    }
+
+    /**
+     * Builds a hierarchy over a set of primitives
+     * @param primitives is the primitives container
+     * @param bounds are the cached bounds of the primitives
+     * @param max_leaf_size is the number of primitives under which a leaf is always created
+     * @param bvh is the hierarchy to build
+     */
+    static void build(const std::vector<Primitive*>& primitives, const PrimitiveBounds& bounds, unsigned int max_leaf_size, BVH<Primitive>& bvh)
+    {
+      std::vector<Reference> references(primitives.size());
+      for(unsigned long i = 0; i < primitives.size(); ++i)
+      {
+        references[i].primitive = primitives[i];
+        references[i].bb = bounds.getBoundingBox(i);
+        references[i].centroid = bounds.getCentroid(i);
+      }
+
+      if(references.empty())
+      {
+        bvh.setPrimitives(primitives);
+        return;
+      }
+
+      std::vector<BVH<Primitive>::BVHNode> nodes;
+      std::vector<Primitive*> leaf_primitives;
+      nodes.reserve(2 * primitives.size() + 1);
+      leaf_primitives.reserve(primitives.size());
+
+      subdivide(references, 0, references.size(), max_leaf_size, 0, nodes, leaf_primitives);
+      bvh.setNodes(nodes, leaf_primitives);
+    }
+
+    static void custom_build(IRT::SimpleScene* scene, unsigned int max_leaf_size)
+    {
+      build(scene->getPrimitives(), scene->getPrimitiveBounds(), max_leaf_size, scene->getBVH());
+      scene->setAccelerator(SimpleScene::BoundingVolumeHierarchy, true);
+    }
+
+    static void automatic_build(IRT::SimpleScene* scene)
+    {
+      custom_build(scene, 4);
+    }
+
+    static BoundingBox merge(const BoundingBox& bb1, const BoundingBox& bb2)
+    {
+      BoundingBox bb;
+      bb.corner1 = bb1.corner1.cwiseMin(bb2.corner1);
+      bb.corner2 = bb1.corner2.cwiseMax(bb2.corner2);
+      return bb;
+    }
+
+    /**
+     * Builds the node of the references between begin and end, and then its children
+     * @return the index of the node
+     */
+    static unsigned int subdivide(std::vector<Reference>& references, unsigned long begin, unsigned long end, unsigned int max_leaf_size, int depth, std::vector<BVH<Primitive>::BVHNode>& nodes, std::vector<Primitive*>& leaf_primitives)
+    {
+      unsigned int index = nodes.size();
+      nodes.push_back(BVH<Primitive>::BVHNode());
+
+      BoundingBox bb = references[begin].bb;
+      BoundingBox centroids;
+      centroids.corner1 = centroids.corner2 = references[begin].centroid;
+      for(unsigned long i = begin + 1; i < end; ++i)
+      {
+        bb = merge(bb, references[i].bb);
+        centroids.corner1 = centroids.corner1.cwiseMin(references[i].centroid);
+        centroids.corner2 = centroids.corner2.cwiseMax(references[i].centroid);
+      }
+      nodes[index].setBoundingBox(bb);
+
+      unsigned long count = end - begin;
+      int best_axis = -1;
+      unsigned long best_split = 0;
+      DataType best_cost = count;
+      int sorted_axis = -1;
+
+      if(count > max_leaf_size && depth < maxDepth())
+      {
+        std::vector<DataType> right_areas(count);
+        for(int axis = 0; axis < 3; ++axis)
+        {
+          if(centroids.corner1(axis) == centroids.corner2(axis))
+          {
+            continue;
+          }
+          std::sort(references.begin() + begin, references.begin() + end, CentroidLess(axis));
+          sorted_axis = axis;
+
+          BoundingBox right_bb = references[end - 1].bb;
+          for(unsigned long i = count - 1; i > 0; --i)
+          {
+            right_bb = merge(right_bb, references[begin + i].bb);
+            right_areas[i] = right_bb.SAH();
+          }
+
+          BoundingBox left_bb = references[begin].bb;
+          for(unsigned long i = 1; i < count; ++i)
+          {
+            DataType cost = traversalCost() + (left_bb.SAH() * i + right_areas[i] * (count - i)) / bb.SAH();
+            if(cost < best_cost)
+            {
+              best_cost = cost;
+              best_axis = axis;
+              best_split = i;
+            }
+            left_bb = merge(left_bb, references[begin + i].bb);
+          }
+        }
+      }
+
+      if(best_axis == -1)
+      {
+        if(count <= max_leaf_size || depth >= maxDepth() || centroids.corner1 == centroids.corner2)
+        {
+          nodes[index].setLeaf(leaf_primitives.size(), count);
+          for(unsigned long i = begin; i < end; ++i)
+          {
+            leaf_primitives.push_back(references[i].primitive);
+          }
+          return index;
+        }
+        // No split is cheaper than a leaf, but the leaf would be too big: median split on the widest axis
+        Vector3df extent = centroids.corner2 - centroids.corner1;
+        extent.maxCoeff(&best_axis);
+        best_split = count / 2;
+        std::nth_element(references.begin() + begin, references.begin() + begin + best_split, references.begin() + end, CentroidLess(best_axis));
+      }
+      else if(best_axis != sorted_axis)
+      {
+        std::sort(references.begin() + begin, references.begin() + end, CentroidLess(best_axis));
+      }
+
+      subdivide(references, begin, begin + best_split, max_leaf_size, depth + 1, nodes, leaf_primitives);
+      unsigned int second_child = subdivide(references, begin + best_split, end, max_leaf_size, depth + 1, nodes, leaf_primitives);
+      nodes[index].setInner(best_axis, second_child);
+
+      return index;
+    }
+  };
+}
+
+#endif
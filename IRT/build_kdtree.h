@@ -6,7 +6,13 @@
 #ifndef BUILDKDTREE
 #define BUILDKDTREE
 
-#include <set>
+#include <algorithm>
+#include <vector>
+
+#ifdef USE_TBB
+#include <tbb/enumerable_thread_specific.h>
+#include <tbb/task_group.h>
+#endif
 
 #include "simple_scene.h"
 #include "kdtree.h"
@@ -19,133 +25,671 @@ namespace IRT
 {
   struct BuildKDTree
   {
-    static void custom_build(IRT::SimpleScene* scene, int remaining_depth, int remaining_failures, DataType enhancement_ratio_failure)
+    /// Start or end of the bounds of a primitive along an axis
+    struct Event
     {
-      KDTree<Primitive>& tree = scene->getKDTree();
-      tree.setPrimitives(scene->getPrimitives());
-      subdivide(tree, &tree.getNodes()[0], scene->getBoundingBox(), remaining_depth, remaining_failures, enhancement_ratio_failure);
+      /// Kind of bound, a primitive flat along the axis having only one planar event
+      enum Type
+      {
+        End,
+        Planar,
+        Start
+      };
+
+      /// Position of the bound
+      DataType position;
+      /// Index of the primitive in the scene
+      unsigned int primitive;
+      /// Kind of bound
+      Type type;
+
+      bool operator<(const Event& other) const
+      {
+        return position < other.position;
+      }
+    };
+
+    /// Events of a node along an axis, sorted by position
+    typedef std::vector<Event> Events;
+
+    /// Side of the split plane where a primitive goes
+    enum Side
+    {
+      Left = 1,
+      Right = 2,
+      /// The primitive crossed the plane and its bounds were clipped, so its events are computed again
+      Clipped = 4
+    };
+
+    /// Data shared by all the nodes during the build
+    struct Context
+    {
+      /// The tree to build
+      KDTree<Primitive>& tree;
+      /// The primitives of the scene
+      const std::vector<Primitive*>& primitives;
+#ifdef USE_TBB
+      /// Side of each primitive for the last split done by each thread
+      tbb::enumerable_thread_specific<std::vector<unsigned char> > sides;
+#else
+      /// Side of each primitive for the last split
+      std::vector<unsigned char> sides;
+#endif
+      DataType enhancement_ratio_failure;
+      /// Costs used to compare the splits
+      KDTreeCostModel cost_model;
+      /// Number of bins per axis, 0 for the exact sweep over the events
+      unsigned int bins;
+      /// Remaining depth from which the nodes are deferred until a ray reaches them, negative to build everything
+      int lazy_depth;
+      /// Allows to split the work in tasks, false when building a deferred subtree inside a rendering task
+      bool parallel;
+
+      Context(KDTree<Primitive>& tree, const std::vector<Primitive*>& primitives, DataType enhancement_ratio_failure, const KDTreeCostModel& cost_model, unsigned int bins, int lazy_depth, bool parallel)
+      :tree(tree), primitives(primitives), enhancement_ratio_failure(enhancement_ratio_failure), cost_model(cost_model), bins(bins), lazy_depth(lazy_depth), parallel(parallel)
+      {
+      }
+
+      /// Returns the sides of the current thread, a node being classified and its events split by one thread without waiting in between
+      std::vector<unsigned char>& getSides()
+      {
+#ifdef USE_TBB
+        std::vector<unsigned char>& local_sides = sides.local();
+#else
+        std::vector<unsigned char>& local_sides = sides;
+#endif
+        local_sides.resize(primitives.size());
+        return local_sides;
+      }
+    };
+
+    /// Number of primitives from which a node evaluates its axes and builds its children in parallel
+    static unsigned long parallelThreshold()
+    {
+      return 1024;
+    }
+
+#ifdef USE_TBB
+    /// Builds a subtree in its own task
+    struct SubdivideTask
+    {
+      Context* context;
+      unsigned int node;
+      BoundingBox bb;
+      const std::vector<unsigned int>* indices;
+      const std::vector<BoundingBox>* bbs;
+      Events* events;
+      int remaining_depth;
+      int remaining_failures;
+
+      SubdivideTask(Context* context, unsigned int node, const BoundingBox& bb, const std::vector<unsigned int>* indices, const std::vector<BoundingBox>* bbs, Events* events, int remaining_depth, int remaining_failures)
+      :context(context), node(node), bb(bb), indices(indices), bbs(bbs), events(events), remaining_depth(remaining_depth), remaining_failures(remaining_failures)
+      {
+      }
+
+      void operator()() const
+      {
+        subdivide(*context, node, bb, *indices, *bbs, events, remaining_depth, remaining_failures);
+      }
+    };
+
+    /// Finds the cheapest plane of one axis in its own task
+    struct AxisSplitTask
+    {
+      const Context* context;
+      int axis;
+      const BoundingBox* bb;
+      const std::vector<BoundingBox>* bbs;
+      const Events* events;
+      std::pair<int, DataType>* lowest_split;
+      DataType* lowest_cost;
+
+      AxisSplitTask(const Context* context, int axis, const BoundingBox* bb, const std::vector<BoundingBox>* bbs, const Events* events, std::pair<int, DataType>* lowest_split, DataType* lowest_cost)
+      :context(context), axis(axis), bb(bb), bbs(bbs), events(events), lowest_split(lowest_split), lowest_cost(lowest_cost)
+      {
+      }
+
+      void operator()() const
+      {
+        findAxisSplit(*context, axis, *bb, *bbs, *events, *lowest_split, *lowest_cost);
+      }
+    };
+#endif
+
+    /// Builds the deferred subtrees with the parameters of the lazy build
+    class LazyRefiner: public KDTree<Primitive>::Refiner
+    {
+    private:
+      DataType enhancement_ratio_failure;
+      KDTreeCostModel cost_model;
+      unsigned int bins;
+
+    public:
+      LazyRefiner(DataType enhancement_ratio_failure, const KDTreeCostModel& cost_model, unsigned int bins)
+      :enhancement_ratio_failure(enhancement_ratio_failure), cost_model(cost_model), bins(bins)
+      {
+      }
+
+      /**
+       * Builds the whole subtree in the calling thread
+       * No task is created, as a thread waiting for them could take a rendering task reaching the same leaf.
+       */
+      void refine(KDTree<Primitive>& subtree, const std::vector<Primitive*>& primitives, const BoundingBox& bb, int remaining_depth, int remaining_failures) const
+      {
+        std::vector<BoundingBox> bbs(primitives.size());
+        for(unsigned int i = 0; i < primitives.size(); ++i)
+        {
+          bbs[i] = primitives[i]->getClippedBoundingBox(bb);
+          if(bbs[i].isEmpty())
+          {
+            bbs[i] = primitives[i]->getBoundingBox().clip(bb);
+          }
+        }
+        build(subtree, primitives, bbs, bb, remaining_depth, remaining_failures, enhancement_ratio_failure, cost_model, bins, -1, false);
+      }
+    };
+
+    /**
+     * Builds a tree over some primitives
+     * @param bbs are the bounds of the primitives, clipped to the bounding box of the tree
+     * @param bb is the bounding box of the tree
+     * @param bins is the number of bins per axis, 0 for the exact build
+     * @param lazy_depth is the remaining depth from which the nodes are deferred, negative to build everything
+     * @param parallel allows to build the subtrees in parallel with TBB
+     */
+    static void build(KDTree<Primitive>& tree, const std::vector<Primitive*>& primitives, const std::vector<BoundingBox>& bbs, const BoundingBox& bb, int remaining_depth, int remaining_failures, DataType enhancement_ratio_failure, const KDTreeCostModel& cost_model, unsigned int bins, int lazy_depth, bool parallel)
+    {
+      tree.setPrimitives(primitives);
+      unsigned int store = tree.getNewPrimitivesStore();
+      tree.getPrimitivesStore(store) = primitives;
+      tree.setNodePrimitives(0, store);
+
+      Context context(tree, primitives, enhancement_ratio_failure, cost_model, bins, lazy_depth, parallel);
+      std::vector<unsigned int> indices(primitives.size());
+      for(unsigned int i = 0; i < primitives.size(); ++i)
+      {
+        indices[i] = i;
+      }
+      Events events[3];
+      if(bins == 0)
+      {
+        // The events are sorted once, the children keeping the order of their parent
+        for(int axis = 0; axis < 3; ++axis)
+        {
+          events[axis].reserve(2 * primitives.size());
+          for(unsigned int i = 0; i < primitives.size(); ++i)
+          {
+            addEvents(axis, i, bbs[i], events[axis]);
+          }
+          std::sort(events[axis].begin(), events[axis].end());
+        }
+      }
+
+      subdivide(context, 0, bb, indices, bbs, events, remaining_depth, remaining_failures);
+      tree.compact();
+      tree.resetDegradation(bb);
     }
 
-    static void automatic_build(IRT::SimpleScene* scene)
+    /**
+     * Builds the tree with the exact surface area heuristic
+     * @param remaining_depth is the maximum depth of the tree
+     * @param remaining_failures is the number of splits allowed on a branch when they do not enhance the cost enough
+     * @param enhancement_ratio_failure is the relative cost under which a split is an enhancement
+     * @param cost_model are the constants of the heuristic
+     */
+    static void custom_build(IRT::SimpleScene* scene, int remaining_depth, int remaining_failures, DataType enhancement_ratio_failure, const KDTreeCostModel& cost_model = KDTreeCostModel())
+    {
+      std::vector<unsigned int> indices;
+      std::vector<BoundingBox> bbs;
+      getRootPrimitives(scene->getPrimitiveBounds(), indices, bbs);
+
+      build(scene->getKDTree(), scene->getPrimitives(), bbs, scene->getBoundingBox(), remaining_depth, remaining_failures, enhancement_ratio_failure, cost_model, 0, -1, true);
+      scene->setAccelerator(SimpleScene::KDTreeAccelerator, true);
+    }
+
+    /// Computes the build parameters from the number of primitives, using Havran's values
+    static void getAutomaticParameters(IRT::SimpleScene* scene, int& remaining_depth, int& remaining_failures, DataType& enhancement_ratio_failure)
     {
-      // Using Havran's values
       DataType k1 = 1.2;
       DataType k2 = 2.0;
       DataType K1 = 1.;
       DataType K2 = .2;
 
-      int remaining_depth = static_cast<int>(std::ceil(k1 * std::log(static_cast<DataType>(scene->getPrimitives().size())) + k2));
-      int remaining_failures = static_cast<int>(std::ceil(K1 + remaining_depth * K2));
-      DataType enhancement_ratio_failure = .75;
+      remaining_depth = static_cast<int>(std::ceil(k1 * std::log(static_cast<DataType>(scene->getPrimitives().size())) + k2));
+      remaining_failures = static_cast<int>(std::ceil(K1 + remaining_depth * K2));
+      enhancement_ratio_failure = .75;
+    }
 
-      custom_build(scene, remaining_depth, remaining_failures, enhancement_ratio_failure);
+    static void automatic_build(IRT::SimpleScene* scene, const KDTreeCostModel& cost_model = KDTreeCostModel())
+    {
+      int remaining_depth, remaining_failures;
+      DataType enhancement_ratio_failure;
+      getAutomaticParameters(scene, remaining_depth, remaining_failures, enhancement_ratio_failure);
+
+      custom_build(scene, remaining_depth, remaining_failures, enhancement_ratio_failure, cost_model);
+    }
+
+    /**
+     * Builds the tree by evaluating the cost only at regularly spaced planes, faster than the exact build but giving a slightly worse tree
+     * @param bins is the number of bins per axis, more bins giving a better tree
+     */
+    static void binned_build(IRT::SimpleScene* scene, unsigned int bins, int remaining_depth, int remaining_failures, DataType enhancement_ratio_failure, const KDTreeCostModel& cost_model = KDTreeCostModel())
+    {
+      std::vector<unsigned int> indices;
+      std::vector<BoundingBox> bbs;
+      getRootPrimitives(scene->getPrimitiveBounds(), indices, bbs);
+
+      build(scene->getKDTree(), scene->getPrimitives(), bbs, scene->getBoundingBox(), remaining_depth, remaining_failures, enhancement_ratio_failure, cost_model, std::max(bins, 2U), -1, true);
+      scene->setAccelerator(SimpleScene::KDTreeAccelerator, true);
+    }
+
+    static void automatic_binned_build(IRT::SimpleScene* scene, unsigned int bins, const KDTreeCostModel& cost_model = KDTreeCostModel())
+    {
+      int remaining_depth, remaining_failures;
+      DataType enhancement_ratio_failure;
+      getAutomaticParameters(scene, remaining_depth, remaining_failures, enhancement_ratio_failure);
+
+      binned_build(scene, bins, remaining_depth, remaining_failures, enhancement_ratio_failure, cost_model);
     }
 
-    static void subdivide(KDTree<Primitive>& tree, KDTree<Primitive>::KDTreeNode* node, const BoundingBox& bb, int remaining_depth, int remaining_failures, DataType enhancement_ratio_failure)
+    /**
+     * Builds only the top of the tree with the automatic parameters, the deeper subtrees being built the first time a ray reaches them
+     * The parts of the scene that are never seen are never built, so that the first image comes sooner.
+     * @param eager_depth is the number of levels built immediately
+     */
+    static void lazy_build(IRT::SimpleScene* scene, int eager_depth, const KDTreeCostModel& cost_model = KDTreeCostModel())
     {
-      const std::set<std::pair<int, DataType> >& split_positions = getSplitPositions(node, bb);
+      int remaining_depth, remaining_failures;
+      DataType enhancement_ratio_failure;
+      getAutomaticParameters(scene, remaining_depth, remaining_failures, enhancement_ratio_failure);
+
+      std::vector<unsigned int> indices;
+      std::vector<BoundingBox> bbs;
+      getRootPrimitives(scene->getPrimitiveBounds(), indices, bbs);
+
+      KDTree<Primitive>& tree = scene->getKDTree();
+      build(tree, scene->getPrimitives(), bbs, scene->getBoundingBox(), remaining_depth, remaining_failures, enhancement_ratio_failure, cost_model, 0, remaining_depth - eager_depth, true);
+      tree.setRefiner(new LazyRefiner(enhancement_ratio_failure, cost_model, 0));
+      scene->setAccelerator(SimpleScene::KDTreeAccelerator, true);
+    }
+
+    /// Returns the indices and the cached bounds of all the primitives of the scene
+    static void getRootPrimitives(const PrimitiveBounds& bounds, std::vector<unsigned int>& indices, std::vector<BoundingBox>& bbs)
+    {
+      indices.resize(bounds.size());
+      bbs.resize(bounds.size());
+      for(unsigned int i = 0; i < bounds.size(); ++i)
+      {
+        indices[i] = i;
+        bbs[i] = bounds.getBoundingBox(i);
+      }
+    }
+
+    /**
+     * Subdivides a node and its children
+     * The candidate planes are the bounds of the primitives inside the node, or the bin boundaries for a binned build. A primitive goes to the left if its lower bound is strictly before the plane and to the right if its upper bound is strictly after it, so that a child can be empty. A primitive lying in the plane goes to both sides.
+     * The bounds of a primitive crossing the plane are clipped to each child, and the primitive is not added to a child where nothing of it remains.
+     * @param indices are the indices of the primitives of the node, in the scene order
+     * @param bbs are the bounds of the primitives of the node clipped to the node, in the same order
+     * @param events are the events of the primitives of the node for each axis, emptied once the children have their own, unused for a binned build
+     */
+    static void subdivide(Context& context, unsigned int node, const BoundingBox& bb, const std::vector<unsigned int>& indices, const std::vector<BoundingBox>& bbs, Events* events, int remaining_depth, int remaining_failures)
+    {
+      if(remaining_depth <= context.lazy_depth)
+      {
+        context.tree.setDeferredNode(node, bb, remaining_depth, remaining_failures);
+        return;
+      }
 
       DataType lowest_cost = std::numeric_limits<DataType>::max();
       std::pair<int, DataType> lowest_split = std::make_pair(-1, 0.);
-      std::vector<Primitive*> right_primitives, left_primitives;
+      findSplit(context, bb, bbs, events, lowest_split, lowest_cost);
 
-      for(std::set<std::pair<int, DataType> >::const_iterator it = split_positions.begin(); it != split_positions.end(); ++it)
+      bool cheaper_leaf = context.cost_model.leaf_termination && lowest_cost >= 1;
+      if(lowest_split.first != -1 && !cheaper_leaf && (lowest_cost < context.enhancement_ratio_failure || --remaining_failures >= 0))
       {
-        std::vector<Primitive*> right_primitives_test, left_primitives_test;
+        int axis = lowest_split.first;
+        DataType position = lowest_split.second;
 
-        DataType new_cost = computeCost(it->first, it->second, bb, node->getPrimitives(), right_primitives_test, left_primitives_test);
-        new_cost = (new_cost + 0.3) / (bb.SAH() * node->getPrimitives()->size());
+        BoundingBox bb_left, bb_right;
+        bb_left = bb_right = bb;
+        bb_left.corner2(axis) = position;
+        bb_right.corner1(axis) = position;
 
-        if(new_cost < lowest_cost)
+        std::vector<unsigned int> left_indices, right_indices;
+        std::vector<BoundingBox> left_bbs, right_bbs;
+        // Positions in the children of the primitives whose bounds were clipped
+        std::vector<unsigned int> left_clipped, right_clipped;
+        unsigned int left_node = context.tree.getPairEmptyNodes();
+        unsigned int right_node = left_node + 1;
+
+        unsigned int left_store = context.tree.getNewPrimitivesStore();
+        unsigned int right_store = context.tree.getNewPrimitivesStore();
+        std::vector<Primitive*>& left_primitives = context.tree.getPrimitivesStore(left_store);
+        std::vector<Primitive*>& right_primitives = context.tree.getPrimitivesStore(right_store);
+
+        std::vector<unsigned char>& sides = context.getSides();
+        for(unsigned long i = 0; i < indices.size(); ++i)
         {
-          right_primitives_test.swap(right_primitives);
-          left_primitives_test.swap(left_primitives);
-          lowest_split = *it;
-          lowest_cost = new_cost;
+          unsigned int index = indices[i];
+          const BoundingBox& primitive_bb = bbs[i];
+          unsigned char side = 0;
+          if(primitive_bb.corner1(axis) == position && primitive_bb.corner2(axis) == position)
+          {
+            side = Left | Right;
+          }
+          if(primitive_bb.corner1(axis) < position)
+          {
+            side |= Left;
+          }
+          if(primitive_bb.corner2(axis) > position)
+          {
+            side |= Right;
+          }
+
+          BoundingBox left_bb = primitive_bb;
+          BoundingBox right_bb = primitive_bb;
+          if(primitive_bb.corner1(axis) < position && primitive_bb.corner2(axis) > position)
+          {
+            left_bb = context.primitives[index]->getClippedBoundingBox(bb_left).clip(primitive_bb);
+            right_bb = context.primitives[index]->getClippedBoundingBox(bb_right).clip(primitive_bb);
+            if(left_bb.isEmpty() && right_bb.isEmpty())
+            {
+              // Only rounding errors can lose the whole primitive, it is then kept on both sides
+              left_bb = primitive_bb.clip(bb_left);
+              right_bb = primitive_bb.clip(bb_right);
+            }
+            else if(left_bb.isEmpty())
+            {
+              side = Right;
+            }
+            else if(right_bb.isEmpty())
+            {
+              side = Left;
+            }
+            side |= Clipped;
+          }
+
+          if(side & Left)
+          {
+            if(side & Clipped)
+            {
+              left_clipped.push_back(left_indices.size());
+            }
+            left_indices.push_back(index);
+            left_bbs.push_back(left_bb);
+            left_primitives.push_back(context.primitives[index]);
+          }
+          if(side & Right)
+          {
+            if(side & Clipped)
+            {
+              right_clipped.push_back(right_indices.size());
+            }
+            right_indices.push_back(index);
+            right_bbs.push_back(right_bb);
+            right_primitives.push_back(context.primitives[index]);
+          }
+          sides[index] = side;
         }
-      }
 
-      if(lowest_split.first != -1 && (lowest_cost < enhancement_ratio_failure || --remaining_failures >= 0))
-      {
-        KDTree<Primitive>::KDTreeNode* left_node = tree.getPairEmptyNodes();
-        KDTree<Primitive>::KDTreeNode* right_node = left_node + 1;
+        context.tree.setNodePrimitives(left_node, left_store);
+        context.tree.setNodePrimitives(right_node, right_store);
+        context.tree.setInnerNode(node, axis, position, left_node);
 
-        std::vector<Primitive*>* left_store = tree.getNewPrimitivesStore();
-        left_store->swap(left_primitives);
-        left_node->setPrimitives(left_store);
+        bool subdivide_left = remaining_depth > 0 && left_indices.size() > 1;
+        bool subdivide_right = remaining_depth > 0 && right_indices.size() > 1;
 
-        std::vector<Primitive*>* right_store = tree.getNewPrimitivesStore();
-        right_store->swap(right_primitives);
-        right_node->setPrimitives(right_store);
+        Events left_events[3], right_events[3];
+        for(int i = 0; i < 3; ++i)
+        {
+          if(context.bins == 0 && (subdivide_left || subdivide_right))
+          {
+            splitEvents(sides, events[i], subdivide_left ? &left_events[i] : NULL, subdivide_right ? &right_events[i] : NULL);
+            if(subdivide_left)
+            {
+              mergeClippedEvents(i, left_indices, left_bbs, left_clipped, left_events[i]);
+            }
+            if(subdivide_right)
+            {
+              mergeClippedEvents(i, right_indices, right_bbs, right_clipped, right_events[i]);
+            }
+          }
+          Events().swap(events[i]);
+        }
 
-        node->setAxis(lowest_split.first);
-        node->setSplitPosition(lowest_split.second);
-        node->setLeftNode(left_node);
-        node->setLeaf(false);
-        tree.removeNewPrimitivesStore(node->getPrimitives());
+#ifdef USE_TBB
+        if(context.parallel && subdivide_left && subdivide_right && indices.size() >= parallelThreshold())
+        {
+          tbb::task_group group;
+          group.run(SubdivideTask(&context, left_node, bb_left, &left_indices, &left_bbs, left_events, remaining_depth - 1, remaining_failures));
+          subdivide(context, right_node, bb_right, right_indices, right_bbs, right_events, remaining_depth - 1, remaining_failures);
+          group.wait();
+          return;
+        }
+#endif
+        if(subdivide_left)
+        {
+          subdivide(context, left_node, bb_left, left_indices, left_bbs, left_events, remaining_depth - 1, remaining_failures);
+        }
+        if(subdivide_right)
+        {
+          subdivide(context, right_node, bb_right, right_indices, right_bbs, right_events, remaining_depth - 1, remaining_failures);
+        }
+      }
+    }
 
-        if(remaining_depth > 0 && left_store->size() > 1)
+    /**
+     * Finds the cheapest plane of the node, the axes of big nodes being evaluated in parallel
+     * The axes are compared in order so that the plane does not depend on the parallelism.
+     */
+    static void findSplit(const Context& context, const BoundingBox& bb, const std::vector<BoundingBox>& bbs, const Events* events, std::pair<int, DataType>& lowest_split, DataType& lowest_cost)
+    {
+      std::pair<int, DataType> axis_splits[3];
+      DataType axis_costs[3];
+      for(int axis = 0; axis < 3; ++axis)
+      {
+        axis_splits[axis] = std::make_pair(-1, 0.);
+        axis_costs[axis] = std::numeric_limits<DataType>::max();
+      }
+
+#ifdef USE_TBB
+      if(context.parallel && bbs.size() >= parallelThreshold())
+      {
+        tbb::task_group group;
+        group.run(AxisSplitTask(&context, 0, &bb, &bbs, &events[0], &axis_splits[0], &axis_costs[0]));
+        group.run(AxisSplitTask(&context, 1, &bb, &bbs, &events[1], &axis_splits[1], &axis_costs[1]));
+        findAxisSplit(context, 2, bb, bbs, events[2], axis_splits[2], axis_costs[2]);
+        group.wait();
+      }
+      else
+#endif
+      {
+        for(int axis = 0; axis < 3; ++axis)
         {
-          BoundingBox bb_left;
-          bb_left = bb;
-          bb_left.corner2(lowest_split.first) = lowest_split.second;
-          subdivide(tree, left_node, bb_left, remaining_depth - 1, remaining_failures, enhancement_ratio_failure);
+          findAxisSplit(context, axis, bb, bbs, events[axis], axis_splits[axis], axis_costs[axis]);
         }
-        if(remaining_depth > 0 && right_store->size() > 1)
+      }
+
+      for(int axis = 0; axis < 3; ++axis)
+      {
+        if(axis_costs[axis] < lowest_cost)
         {
-          BoundingBox bb_right;
-          bb_right = bb;
-          bb_right.corner1(lowest_split.first) = lowest_split.second;
-          subdivide(tree, right_node, bb_right, remaining_depth - 1, remaining_failures, enhancement_ratio_failure);
+          lowest_split = axis_splits[axis];
+          lowest_cost = axis_costs[axis];
         }
       }
     }
 
-    static std::set<std::pair<int, DataType> > getSplitPositions(const KDTree<Primitive>::KDTreeNode* node, const BoundingBox& bb)
+    /// Finds the cheapest plane of one axis
+    static void findAxisSplit(const Context& context, int axis, const BoundingBox& bb, const std::vector<BoundingBox>& bbs, const Events& events, std::pair<int, DataType>& lowest_split, DataType& lowest_cost)
     {
-      std::set<std::pair<int, DataType> > split_positions;
+      if(context.bins == 0)
+      {
+        findSweepSplit(context, axis, bb, bbs.size(), events, lowest_split, lowest_cost);
+      }
+      else
+      {
+        findBinnedSplit(context, axis, bb, bbs, lowest_split, lowest_cost);
+      }
+    }
+
+    /**
+     * Finds the cheapest plane of an axis among the bounds of the primitives by sweeping the events
+     * @param count is the number of primitives of the node
+     */
+    static void findSweepSplit(const Context& context, int axis, const BoundingBox& bb, unsigned long count, const Events& events, std::pair<int, DataType>& lowest_split, DataType& lowest_cost)
+    {
+      // Number of primitives starting and ending strictly before the current position, planar ones counting for both
+      unsigned long starts = 0;
+      unsigned long ends = 0;
 
-      for(std::vector<Primitive*>::const_iterator primitive = node->getPrimitives()->begin(); primitive != node->getPrimitives()->end(); ++primitive)
+      Events::const_iterator it = events.begin();
+      while(it != events.end())
       {
-        const BoundingBox& bb_primitive = (*primitive)->getBoundingBox();
-        for(int i = 0; i < 3; ++i)
+        DataType position = it->position;
+        unsigned long position_starts = 0;
+        unsigned long position_ends = 0;
+        unsigned long position_planars = 0;
+        for(; it != events.end() && it->position == position; ++it)
         {
-          if (bb_primitive.corner1(i) >= bb.corner1(i) && bb_primitive.corner1(i) <= bb.corner2(i))
+          if(it->type == Event::Start)
+          {
+            ++position_starts;
+          }
+          else if(it->type == Event::End)
           {
-            split_positions.insert(std::make_pair(i, bb_primitive.corner1(i)));
+            ++position_ends;
           }
-          if (bb_primitive.corner2(i) >= bb.corner1(i) && bb_primitive.corner2(i) <= bb.corner2(i))
+          else
           {
-            split_positions.insert(std::make_pair(i, bb_primitive.corner2(i)));
+            ++position_planars;
           }
         }
+
+        if(position >= bb.corner1(axis) && position <= bb.corner2(axis))
+        {
+          DataType new_cost = context.cost_model.computeRelativeCost(axis, position, bb, count, count - ends - position_ends, starts + position_planars);
+
+          if(new_cost < lowest_cost)
+          {
+            lowest_split = std::make_pair(axis, position);
+            lowest_cost = new_cost;
+          }
+        }
+
+        starts += position_starts + position_planars;
+        ends += position_ends + position_planars;
+      }
+    }
+
+    /**
+     * Finds the cheapest plane of an axis among the bin boundaries
+     * A primitive is counted on a side of a plane if the bin of its bound is on this side.
+     */
+    static void findBinnedSplit(const Context& context, int axis, const BoundingBox& bb, const std::vector<BoundingBox>& bbs, std::pair<int, DataType>& lowest_split, DataType& lowest_cost)
+    {
+      unsigned long count = bbs.size();
+      int last_bin = context.bins - 1;
+
+      DataType extent = bb.corner2(axis) - bb.corner1(axis);
+      if(!(extent > 0))
+      {
+        return;
+      }
+      DataType scale = context.bins / extent;
+
+      std::vector<unsigned long> bin_starts(context.bins);
+      std::vector<unsigned long> bin_ends(context.bins);
+      for(std::vector<BoundingBox>::const_iterator it = bbs.begin(); it != bbs.end(); ++it)
+      {
+        ++bin_starts[getBin(it->corner1(axis) - bb.corner1(axis), scale, last_bin)];
+        ++bin_ends[getBin(it->corner2(axis) - bb.corner1(axis), scale, last_bin)];
+      }
+
+      unsigned long left_count = 0;
+      unsigned long right_count = count;
+      for(unsigned int bin = 1; bin < context.bins; ++bin)
+      {
+        left_count += bin_starts[bin - 1];
+        right_count -= bin_ends[bin - 1];
+        DataType position = bb.corner1(axis) + bin / scale;
+
+        DataType new_cost = context.cost_model.computeRelativeCost(axis, position, bb, count, right_count, left_count);
+
+        if(new_cost < lowest_cost)
+        {
+          lowest_split = std::make_pair(axis, position);
+          lowest_cost = new_cost;
+        }
       }
+    }
 
-      return split_positions;
+    /// Returns the bin of a position relative to the node, clamped before the conversion so that far bounds cannot overflow
+    static unsigned int getBin(DataType position, DataType scale, int last_bin)
+    {
+      return static_cast<unsigned int>(std::min(std::max(position * scale, static_cast<DataType>(0)), static_cast<DataType>(last_bin)));
     }
 
-    static DataType computeCost(int axis, DataType split_position, const BoundingBox& bb, const std::vector<Primitive*>* primitives, std::vector<Primitive*>& right_primitives, std::vector<Primitive*>& left_primitives)
+    /// Adds the start and end events of a primitive along an axis, or its planar event
+    static void addEvents(int axis, unsigned int primitive, const BoundingBox& bb, Events& events)
     {
-      BoundingBox bb_right, bb_left;
-      bb_right = bb_left = bb;
-      bb_right.corner1(axis) = split_position;
-      bb_left.corner2(axis) = split_position;
+      Event event;
+      event.primitive = primitive;
+      event.position = bb.corner1(axis);
+      if(bb.corner1(axis) == bb.corner2(axis))
+      {
+        event.type = Event::Planar;
+        events.push_back(event);
+        return;
+      }
+      event.type = Event::Start;
+      events.push_back(event);
+      event.position = bb.corner2(axis);
+      event.type = Event::End;
+      events.push_back(event);
+    }
 
-      for(std::vector<Primitive*>::const_iterator primitive = primitives->begin(); primitive != primitives->end(); ++primitive)
+    /**
+     * Adds the events of the clipped primitives of a child to the events of the others, keeping them sorted
+     * @param clipped are the positions of the clipped primitives in the child
+     */
+    static void mergeClippedEvents(int axis, const std::vector<unsigned int>& indices, const std::vector<BoundingBox>& bbs, const std::vector<unsigned int>& clipped, Events& events)
+    {
+      Events::size_type middle = events.size();
+      for(std::vector<unsigned int>::const_iterator it = clipped.begin(); it != clipped.end(); ++it)
       {
-        const BoundingBox& bb = (*primitive)->getBoundingBox();
-        
-        if(bb.corner1(axis) <= split_position)
+        addEvents(axis, indices[*it], bbs[*it], events);
+      }
+      std::sort(events.begin() + middle, events.end());
+      std::inplace_merge(events.begin(), events.begin() + middle, events.end());
+    }
+
+    /**
+     * Distributes the events of a node to its children according to the side of their primitive, keeping them sorted
+     * The events of the clipped primitives are skipped, their children adding new ones.
+     * @param sides is the side of each primitive for the split of the node
+     * @param left_events receives the events of the left child, or NULL if it is not needed
+     * @param right_events receives the events of the right child, or NULL if it is not needed
+     */
+    static void splitEvents(const std::vector<unsigned char>& sides, const Events& events, Events* left_events, Events* right_events)
+    {
+      for(Events::const_iterator it = events.begin(); it != events.end(); ++it)
+      {
+        unsigned char side = sides[it->primitive];
+        if(side & Clipped)
         {
-         left_primitives.push_back(*primitive);
+          continue;
         }
-        if(bb.corner2(axis) >= split_position)
+        if(left_events != NULL && (side & Left))
         {
-         right_primitives.push_back(*primitive);
+          left_events->push_back(*it);
+        }
+        if(right_events != NULL && (side & Right))
+        {
+          right_events->push_back(*it);
         }
       }
-
-      return bb_right.SAH() * right_primitives.size() + bb_left.SAH() * left_primitives.size();
     }
   };
 }
@@ -0,0 +1,629 @@
+/**
+ * \file bvh.h
+ * The bounding volume hierarchy implementation for fast primitive lookup
+ */
+
+#ifndef BVH_H
+#define BVH_H
+
+#include <algorithm>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include "common.h"
+#include "accelerator.h"
+#include "bounding_box.h"
+#include "primitive_bounds.h"
+#include "primitive_dispatch.h"
+
+namespace IRT
+{
+  /// Bounding volume hierarchy, stored depth first in one array
+  template<class Primitive>
+  class BVH: public Accelerator<Primitive>
+  {
+  public:
+    /// Node of the hierarchy
+    class BVHNode
+    {
+    private:
+      /// Bounding box of all the primitives under the node
+      BoundingBox bb;
+      /// Index of the second child for an inner node, index of the first primitive for a leaf
+      unsigned int offset;
+      /// The split axis (or 3 for a leaf) in the two low bits, the number of primitives of a leaf in the others
+      unsigned int flags;
+
+      /// Value of the two low bits of a leaf
+      static const unsigned int leaf_flag = 3;
+    public:
+      BVHNode()
+      :offset(0), flags(leaf_flag)
+      {
+      }
+
+      /// Returns the bounding box of the node
+      const BoundingBox& getBoundingBox() const
+      {
+        return bb;
+      }
+
+      /// Sets the bounding box of the node
+      void setBoundingBox(const BoundingBox& bb)
+      {
+        this->bb = bb;
+      }
+
+      /// Returns true is the node is a leaf
+      bool isLeaf() const
+      {
+        return (flags & 3) == leaf_flag;
+      }
+
+      /// Returns the axis along which the children were split
+      short getAxis() const
+      {
+        return flags & 3;
+      }
+
+      /**
+       * Makes the node a leaf
+       * @param offset is the index of the first primitive of the leaf
+       * @param count is the number of primitives in the leaf
+       */
+      void setLeaf(unsigned int offset, unsigned int count)
+      {
+        this->offset = offset;
+        flags = (count << 2) | leaf_flag;
+      }
+
+      /**
+       * Makes the node an inner node, the first child being the next node
+       * @param axis is the split axis
+       * @param second_child is the index of the second child
+       */
+      void setInner(short axis, unsigned int second_child)
+      {
+        offset = second_child;
+        flags = axis;
+      }
+
+      /// Returns the index of the first primitive of the leaf
+      unsigned int getPrimitivesOffset() const
+      {
+        return offset;
+      }
+
+      /// Returns the number of primitives of the leaf
+      unsigned int getPrimitivesCount() const
+      {
+        return flags >> 2;
+      }
+
+      /// Returns the index of the second child
+      unsigned int getSecondChild() const
+      {
+        return offset;
+      }
+
+      /**
+       * Tests if the ray crosses the box
+       * @param ray is the ray to test
+       * @param tnear is the distance where the test starts
+       * @param tfar is the distance where the test stops
+       * @return true if the ray crosses the box between tnear and tfar
+       */
+      bool intersect(const Ray& ray, DataType tnear, DataType tfar) const
+      {
+        DataType entry, exit;
+        BoundingBox::getEntryExitDistances(bb.corner1, bb.corner2, ray, entry, exit);
+        return std::max(tnear, entry) <= std::min(tfar, exit);
+      }
+    };
+
+  private:
+    /// All the nodes, the root being the first one
+    std::vector<BVHNode> nodes;
+    /// The primitives of all leaves, each leaf being a range in this array
+    std::vector<Primitive*> leaf_primitives;
+    /// Number of entries of leaf_primitives left unused by the incremental updates
+    unsigned long unused_primitives;
+    /// Value of computeCost() when the hierarchy was built
+    DataType built_cost;
+
+    BVH(const BVH& bvh);
+
+    /// Keeps the closest hit, or the first one, in the runs of primitives of a leaf
+    struct LeafCollision
+    {
+      const Ray& ray;
+      bool any_hit;
+      TraversalStatistics& statistics;
+      /// The closest hit, hits after its distance being ignored
+      HitRecord& hit;
+      /// The record filled by each test
+      HitRecord& candidate;
+      /// The closest hit primitive in the leaf, NULL if none
+      Primitive* primitive;
+
+      LeafCollision(const Ray& ray, bool any_hit, TraversalStatistics& statistics, HitRecord& hit, HitRecord& candidate)
+      :ray(ray), any_hit(any_hit), statistics(statistics), hit(hit), candidate(candidate), primitive(NULL)
+      {
+      }
+
+      template<class Intersection>
+      bool visit(Primitive* const* begin, Primitive* const* end)
+      {
+        for(Primitive* const* it = begin; it != end; ++it)
+        {
+          ++statistics.intersection_tests;
+          if(Intersection::intersect(*it, ray, candidate) && (0.0001f < candidate.dist) && (candidate.dist < hit.dist))
+          {
+            primitive = *it;
+            hit = candidate;
+            hit.primitive = primitive;
+            if(any_hit)
+            {
+              return false;
+            }
+          }
+        }
+        return true;
+      }
+    };
+
+    /// Orders the primitives of each leaf by type
+    void groupLeafPrimitives()
+    {
+      for(typename std::vector<BVHNode>::const_iterator it = nodes.begin(); it != nodes.end(); ++it)
+      {
+        if(it->isLeaf())
+        {
+          PrimitiveDispatch<Primitive>::group(leaf_primitives.begin() + it->getPrimitivesOffset(), leaf_primitives.begin() + it->getPrimitivesOffset() + it->getPrimitivesCount());
+        }
+      }
+    }
+
+    /// Returns the union of two boxes
+    static BoundingBox merge(const BoundingBox& bb1, const BoundingBox& bb2)
+    {
+      BoundingBox bb;
+      bb.corner1 = bb1.corner1.cwiseMin(bb2.corner1);
+      bb.corner2 = bb1.corner2.cwiseMax(bb2.corner2);
+      return bb;
+    }
+
+    /**
+     * Computes the surface area heuristic cost of the hierarchy
+     * @return the area of the inner nodes plus the area of the leaves times their number of primitives, relative to the area of the root
+     */
+    DataType computeCost() const
+    {
+      const BoundingBox& root_bb = nodes[0].getBoundingBox();
+      if(root_bb.isEmpty() || root_bb.SAH() <= 0)
+      {
+        return 0;
+      }
+      DataType cost = 0;
+      for(typename std::vector<BVHNode>::const_iterator it = nodes.begin(); it != nodes.end(); ++it)
+      {
+        if(it->getBoundingBox().isEmpty())
+        {
+          continue;
+        }
+        cost += it->getBoundingBox().SAH() * (it->isLeaf() ? it->getPrimitivesCount() : 1);
+      }
+      return cost / root_bb.SAH();
+    }
+
+    /**
+     * Finds the leaf holding a primitive, looking first under the nodes containing its bounding box
+     * @param primitive is the primitive to look for
+     * @param primitive_bb is the bounding box the primitive had when it was added
+     * @return the index of the primitive in the leaf primitives array, the index of the leaf being stored in leaf
+     */
+    long findPrimitive(Primitive* primitive, const BoundingBox& primitive_bb, unsigned int& leaf) const
+    {
+      std::vector<unsigned int> stack(1, 0);
+      while(!stack.empty())
+      {
+        unsigned int index = stack.back();
+        stack.pop_back();
+        const BVHNode& node = nodes[index];
+        const BoundingBox& bb = node.getBoundingBox();
+        if(!((bb.corner1.array() <= primitive_bb.corner1.array()).all() && (primitive_bb.corner2.array() <= bb.corner2.array()).all()))
+        {
+          continue;
+        }
+        if(!node.isLeaf())
+        {
+          stack.push_back(node.getSecondChild());
+          stack.push_back(index + 1);
+          continue;
+        }
+        for(unsigned int i = node.getPrimitivesOffset(); i < node.getPrimitivesOffset() + node.getPrimitivesCount(); ++i)
+        {
+          if(leaf_primitives[i] == primitive)
+          {
+            leaf = index;
+            return i;
+          }
+        }
+      }
+
+      // The primitive was modified without its bounds being updated
+      for(unsigned int index = 0; index < nodes.size(); ++index)
+      {
+        if(!nodes[index].isLeaf())
+        {
+          continue;
+        }
+        for(unsigned int i = nodes[index].getPrimitivesOffset(); i < nodes[index].getPrimitivesOffset() + nodes[index].getPrimitivesCount(); ++i)
+        {
+          if(leaf_primitives[i] == primitive)
+          {
+            leaf = index;
+            return i;
+          }
+        }
+      }
+      return -1;
+    }
+
+    /// Removes the unused entries of the leaf primitives array
+    void packLeafPrimitives()
+    {
+      std::vector<Primitive*> packed;
+      packed.reserve(leaf_primitives.size() - unused_primitives);
+      for(typename std::vector<BVHNode>::iterator it = nodes.begin(); it != nodes.end(); ++it)
+      {
+        if(it->isLeaf())
+        {
+          unsigned int offset = packed.size();
+          packed.insert(packed.end(), leaf_primitives.begin() + it->getPrimitivesOffset(), leaf_primitives.begin() + it->getPrimitivesOffset() + it->getPrimitivesCount());
+          PrimitiveDispatch<Primitive>::group(packed.begin() + offset, packed.end());
+          it->setLeaf(offset, it->getPrimitivesCount());
+        }
+      }
+      leaf_primitives.swap(packed);
+      unused_primitives = 0;
+    }
+
+    /// Maximum depth of the hierarchy, bounded by the builder
+    static const int stack_size = 64;
+
+    /**
+     * Finds the closest hit, or any hit, of a ray
+     * @param ray is the ray to test
+     * @param tnear is the distance where the test starts
+     * @param tfar is the distance where the test stops
+     * @param any_hit indicates if the traversal stops at the first hit found
+     * @param hit is filled with the distance and the data of the hit
+     * @param statistics is updated with the work done
+     * @return the hit primitive, else NULL
+     */
+    Primitive* traverse(const Ray& ray, float tnear, float tfar, bool any_hit, HitRecord& hit, TraversalStatistics& statistics) const
+    {
+      unsigned int stack[stack_size];
+      int top = 0;
+      unsigned int current = 0;
+
+      Primitive* primitive = NULL;
+      HitRecord candidate;
+      hit.dist = tfar;
+      hit.primitive = NULL;
+
+      while(true)
+      {
+        const BVHNode& node = nodes[current];
+        if(node.intersect(ray, tnear, hit.dist))
+        {
+          if(!node.isLeaf())
+          {
+            ++statistics.inner_nodes;
+            ++statistics.pushes;
+            if(ray.sign(node.getAxis()))
+            {
+              stack[top++] = current + 1;
+              current = node.getSecondChild();
+            }
+            else
+            {
+              stack[top++] = node.getSecondChild();
+              ++current;
+            }
+            continue;
+          }
+
+          ++statistics.leaves;
+          LeafCollision collision(ray, any_hit, statistics, hit, candidate);
+          Primitive* const* begin = leaf_primitives.empty() ? NULL : &leaf_primitives[node.getPrimitivesOffset()];
+          bool complete = PrimitiveDispatch<Primitive>::visit(begin, begin + node.getPrimitivesCount(), collision);
+          if(collision.primitive != NULL)
+          {
+            primitive = collision.primitive;
+            if(!complete)
+            {
+              return primitive;
+            }
+          }
+        }
+
+        if(top == 0)
+        {
+          break;
+        }
+        current = stack[--top];
+      }
+
+      return primitive;
+    }
+
+  public:
+    /// Constructs an empty hierarchy
+    BVH()
+    :nodes(1), unused_primitives(0), built_cost(0)
+    {
+      nodes[0].setBoundingBox(BoundingBox::empty());
+    }
+
+    /// Destructor
+    ~BVH()
+    {
+    }
+
+    void setPrimitives(const std::vector<Primitive*>& primitives)
+    {
+      nodes.clear();
+      leaf_primitives = primitives;
+
+      BVHNode node;
+      BoundingBox bb;
+      bb.corner1 = Point3df::Constant(std::numeric_limits<DataType>::max());
+      bb.corner2 = Point3df::Constant(-std::numeric_limits<DataType>::max());
+      for(typename std::vector<Primitive*>::const_iterator it = primitives.begin(); it != primitives.end(); ++it)
+      {
+        BoundingBox primitive_bb = (*it)->getBoundingBox();
+        bb.corner1 = bb.corner1.cwiseMin(primitive_bb.corner1);
+        bb.corner2 = bb.corner2.cwiseMax(primitive_bb.corner2);
+      }
+      node.setBoundingBox(bb);
+      node.setLeaf(0, primitives.size());
+      nodes.push_back(node);
+      unused_primitives = 0;
+      built_cost = computeCost();
+    }
+
+    bool appendPrimitive(Primitive* primitive)
+    {
+      if(nodes.size() != 1)
+      {
+        return false;
+      }
+      BoundingBox bb = nodes[0].getBoundingBox();
+      BoundingBox primitive_bb = primitive->getBoundingBox();
+      if(leaf_primitives.empty())
+      {
+        bb = primitive_bb;
+      }
+      else
+      {
+        bb.corner1 = bb.corner1.cwiseMin(primitive_bb.corner1);
+        bb.corner2 = bb.corner2.cwiseMax(primitive_bb.corner2);
+      }
+      leaf_primitives.push_back(primitive);
+      nodes[0].setBoundingBox(bb);
+      nodes[0].setLeaf(0, leaf_primitives.size());
+      return true;
+    }
+
+    /**
+     * Replaces the whole hierarchy, used by the builder
+     * @param nodes are the new nodes, stored depth first
+     * @param primitives are the primitives, the leaves being ranges in this array
+     */
+    void setNodes(std::vector<BVHNode>& nodes, std::vector<Primitive*>& primitives)
+    {
+      this->nodes.swap(nodes);
+      leaf_primitives.swap(primitives);
+      groupLeafPrimitives();
+      unused_primitives = 0;
+      built_cost = computeCost();
+    }
+
+    /**
+     * Adds a primitive to the leaf whose box grows the least, the boxes on the path being enlarged
+     * The leaf is moved at the end of the leaf primitives array, which is packed when too many entries are unused.
+     * @param primitive is the new primitive
+     * @param primitive_bb is the bounding box of the primitive
+     * @param bb is unused, the hierarchy having its own boxes
+     */
+    void insertPrimitive(Primitive* primitive, const BoundingBox& primitive_bb, const BoundingBox& bb)
+    {
+      unsigned int index = 0;
+      while(true)
+      {
+        BVHNode& node = nodes[index];
+        node.setBoundingBox(merge(node.getBoundingBox(), primitive_bb));
+        if(node.isLeaf())
+        {
+          break;
+        }
+        const BoundingBox& first_bb = nodes[index + 1].getBoundingBox();
+        const BoundingBox& second_bb = nodes[node.getSecondChild()].getBoundingBox();
+        DataType first_growth = merge(first_bb, primitive_bb).SAH() - (first_bb.isEmpty() ? 0 : first_bb.SAH());
+        DataType second_growth = merge(second_bb, primitive_bb).SAH() - (second_bb.isEmpty() ? 0 : second_bb.SAH());
+        index = first_growth <= second_growth ? index + 1 : node.getSecondChild();
+      }
+
+      BVHNode& leaf = nodes[index];
+      unsigned int offset = leaf.getPrimitivesOffset();
+      unsigned int count = leaf.getPrimitivesCount();
+      if(offset + count != leaf_primitives.size())
+      {
+        unsigned int new_offset = leaf_primitives.size();
+        leaf_primitives.resize(new_offset + count);
+        std::copy(leaf_primitives.begin() + offset, leaf_primitives.begin() + offset + count, leaf_primitives.begin() + new_offset);
+        unused_primitives += count;
+        offset = new_offset;
+      }
+      leaf_primitives.push_back(primitive);
+      leaf.setLeaf(offset, count + 1);
+
+      if(unused_primitives > leaf_primitives.size() / 2)
+      {
+        packLeafPrimitives();
+      }
+    }
+
+    /**
+     * Removes a primitive from its leaf, the boxes being kept until refit() is called
+     * @param primitive is the primitive to remove
+     * @param primitive_bb is the bounding box the primitive had when it was added
+     * @param bb is unused, the hierarchy having its own boxes
+     */
+    void removePrimitive(Primitive* primitive, const BoundingBox& primitive_bb, const BoundingBox& bb)
+    {
+      unsigned int index;
+      long position = findPrimitive(primitive, primitive_bb, index);
+      if(position < 0)
+      {
+        return;
+      }
+
+      BVHNode& leaf = nodes[index];
+      unsigned int offset = leaf.getPrimitivesOffset();
+      unsigned int count = leaf.getPrimitivesCount();
+      leaf_primitives[position] = leaf_primitives[offset + count - 1];
+      if(offset + count == leaf_primitives.size())
+      {
+        leaf_primitives.pop_back();
+      }
+      else
+      {
+        ++unused_primitives;
+      }
+      leaf.setLeaf(offset, count - 1);
+    }
+
+    /**
+     * Recomputes the boxes of all the nodes from the cached boxes of the primitives, the tree being kept
+     * The leaves hold pointers, so the primitives are sorted once to find their index in the cache.
+     * @param primitives are all the primitives of the hierarchy
+     * @param bounds are the cached bounds of the primitives, in the same order
+     */
+    void refit(const std::vector<Primitive*>& primitives, const PrimitiveBounds& bounds)
+    {
+      std::vector<std::pair<Primitive*, unsigned long> > indices(primitives.size());
+      for(unsigned long i = 0; i < primitives.size(); ++i)
+      {
+        indices[i] = std::make_pair(primitives[i], i);
+      }
+      std::sort(indices.begin(), indices.end());
+
+      for(long index = nodes.size() - 1; index >= 0; --index)
+      {
+        BVHNode& node = nodes[index];
+        BoundingBox bb = BoundingBox::empty();
+        if(node.isLeaf())
+        {
+          for(unsigned int i = node.getPrimitivesOffset(); i < node.getPrimitivesOffset() + node.getPrimitivesCount(); ++i)
+          {
+            typename std::vector<std::pair<Primitive*, unsigned long> >::const_iterator it = std::lower_bound(indices.begin(), indices.end(), std::make_pair(leaf_primitives[i], 0UL));
+            bb = merge(bb, bounds.getBoundingBox(it->second));
+          }
+        }
+        else
+        {
+          bb = merge(nodes[index + 1].getBoundingBox(), nodes[node.getSecondChild()].getBoundingBox());
+        }
+        node.setBoundingBox(bb);
+      }
+    }
+
+    DataType getDegradation() const
+    {
+      return built_cost > 0 ? computeCost() / built_cost : 1;
+    }
+
+    const std::vector<BVHNode>& getNodes() const
+    {
+      return nodes;
+    }
+
+    Primitive* getFirstCollision(const Ray& ray, float& dist, float tnear, float tfar) const
+    {
+      TraversalStatistics statistics;
+      HitRecord hit;
+      Primitive* primitive = traverse(ray, tnear, tfar, false, hit, statistics);
+      if(primitive != NULL)
+      {
+        dist = hit.dist;
+      }
+      return primitive;
+    }
+
+    Primitive* getFirstCollision(const Ray& ray, HitRecord& hit, float tnear, float tfar) const
+    {
+      TraversalStatistics statistics;
+      return traverse(ray, tnear, tfar, false, hit, statistics);
+    }
+
+    bool testCollision(const Ray& ray, float tnear, float tfar) const
+    {
+      TraversalStatistics statistics;
+      HitRecord hit;
+      return traverse(ray, tnear, tfar, true, hit, statistics) != NULL;
+    }
+
+    /**
+     * Returns the first collisions of a packet of rays, each ray being traced on its own
+     */
+    void getFirstCollisions(const RayPacket& packet, const RayPacket::Array& tnear, const RayPacket::Array& tfar, const RayPacket::Mask& active, HitRecord* hits) const
+    {
+      for(unsigned int i = 0; i < RayPacket::size; ++i)
+      {
+        hits[i].primitive = NULL;
+        if(active(i))
+        {
+          getFirstCollision(packet[i], hits[i], tnear(i), tfar(i));
+        }
+      }
+    }
+
+    /**
+     * Returns the number of inner nodes visited before the hit
+     */
+    int getHitLevel(const Ray& ray, float tnear, float tfar) const
+    {
+      TraversalStatistics statistics;
+      HitRecord hit;
+      if(traverse(ray, tnear, tfar, false, hit, statistics) == NULL)
+      {
+        return 1;
+      }
+      return statistics.inner_nodes;
+    }
+
+    TraversalStatistics getTraversalStatistics(const Ray& ray, float tnear, float tfar) const
+    {
+      TraversalStatistics statistics;
+      HitRecord hit;
+      traverse(ray, tnear, tfar, false, hit, statistics);
+      return statistics;
+    }
+
+    /// A hierarchy never duplicates primitives, so no test is skipped
+    unsigned long getAvoidedTests() const
+    {
+      return 0;
+    }
+
+    void resetAvoidedTests()
+    {
+    }
+  };
+}
+
+#endif
@@ -0,0 +1,17 @@
+/* -*- C -*-  (not really, but good for syntax highlighting) */
+
+#ifdef SWIGPYTHON
+
+%{
+#include "IRT/build_bvh.h"
+%}
+
+namespace IRT
+{
+  struct BuildBVH
+  {
+    static void custom_build(IRT::SimpleScene* scene, unsigned int max_leaf_size);
+    static void automatic_build(IRT::SimpleScene* scene);
+  };
+}
+#endif /* SWIGPYTHON */
@@ -31,6 +31,8 @@ namespace IRT
   typedef Eigen::Matrix<DataType, 3, 1> Point3df;
   /// Type for a normal
   typedef Eigen::Matrix<DataType, 3, 1> Normal3df;
+  /// Type for a linear transformation
+  typedef Eigen::Matrix<DataType, 3, 3> Matrix3df;
 
   /// Number of colors
   const unsigned int nbColors = 3;
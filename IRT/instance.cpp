@@ -0,0 +1,150 @@
+/**
+ * \file instance.cpp
+ * Implementation of the instances
+ */
+
+#include <limits>
+#include <stdexcept>
+
+#include "instance.h"
+#include "build_bvh.h"
+#include "primitive_dispatch.h"
+
+namespace IRT
+{
+  Prototype::Prototype()
+  :primitives()
+  {
+  }
+
+  Prototype::~Prototype()
+  {
+    for(std::vector<Primitive*>::const_iterator it = primitives.begin(); it != primitives.end(); ++it)
+      delete *it;
+  }
+
+  unsigned long Prototype::addPrimitive(Primitive* primitive)
+  {
+    if(dynamic_cast<Instance*>(primitive) != NULL)
+      throw std::invalid_argument("An instance cannot be added to a prototype");
+
+    BoundingBox primitive_bb = primitive->getBoundingBox();
+    if(primitives.empty())
+    {
+      bb = primitive_bb;
+    }
+    else
+    {
+      bb.corner1 = bb.corner1.array().min(primitive_bb.corner1.array());
+      bb.corner2 = bb.corner2.array().max(primitive_bb.corner2.array());
+    }
+
+    primitives.push_back(primitive);
+    bounds.push_back(primitive_bb);
+    if(!bvh.appendPrimitive(primitive))
+      bvh.setPrimitives(primitives);
+    return primitives.size() - 1;
+  }
+
+  void Prototype::build(unsigned int max_leaf_size)
+  {
+    BuildBVH::build(primitives, bounds, max_leaf_size, bvh);
+  }
+
+  Primitive* Prototype::getFirstCollision(const Ray& ray, HitRecord& hit) const
+  {
+    return bvh.getFirstCollision(ray, hit, 0, std::numeric_limits<DataType>::max());
+  }
+
+  const BoundingBox& Prototype::getBoundingBox() const
+  {
+    return bb;
+  }
+
+  Instance::Instance(const Prototype* prototype, const Point3df& translation, DataType scale)
+  :prototype(prototype), linear(Matrix3df::Identity() * scale), inverse_linear(Matrix3df::Identity() / scale), translation(translation)
+  {
+  }
+
+  Instance::Instance(const Prototype* prototype, const Matrix3df& linear, const Point3df& translation)
+  :prototype(prototype), linear(linear), inverse_linear(linear.inverse()), translation(translation)
+  {
+  }
+
+  Instance::~Instance()
+  {
+  }
+
+  Ray Instance::toPrototype(const Ray& ray, DataType& scale) const
+  {
+    Vector3df direction = inverse_linear * ray.direction();
+    scale = std::sqrt(norm2(direction));
+    return Ray(inverse_linear * (ray.origin() - translation), direction / scale);
+  }
+
+  bool Instance::intersect(const Ray& ray, DataType& dist) const
+  {
+    HitRecord hit;
+    if(!intersect(ray, hit))
+      return false;
+
+    dist = hit.dist;
+    return true;
+  }
+
+  bool Instance::intersect(const Ray& ray, HitRecord& hit) const
+  {
+    DataType scale;
+    HitRecord prototype_hit;
+    if(prototype->getFirstCollision(toPrototype(ray, scale), prototype_hit) == NULL)
+      return false;
+
+    hit.dist = prototype_hit.dist / scale;
+    hit.u = prototype_hit.u;
+    hit.v = prototype_hit.v;
+    hit.face = prototype_hit.face;
+    hit.prototype_primitive = prototype_hit.primitive;
+    return true;
+  }
+
+  void Instance::computeHit(const Ray& ray, HitRecord& hit) const
+  {
+    // The prototype primitive is shaded in the space of the prototype from the data of its hit, only the normal being brought back
+    DataType scale;
+    Ray prototype_ray = toPrototype(ray, scale);
+    HitRecord prototype_hit(hit);
+    prototype_hit.primitive = hit.prototype_primitive;
+    prototype_hit.dist = hit.dist * scale;
+    PrimitiveDispatch<Primitive>::computeHit(prototype_ray, prototype_hit);
+    hit.normal = inverse_linear.transpose() * prototype_hit.normal;
+    normalize(hit.normal);
+  }
+
+  BoundingBox Instance::getBoundingBox() const
+  {
+    const BoundingBox& prototype_bb = prototype->getBoundingBox();
+    BoundingBox bb;
+    for(int i = 0; i < 8; ++i)
+    {
+      Point3df corner((i & 1) ? prototype_bb.corner2(0) : prototype_bb.corner1(0),
+                      (i & 2) ? prototype_bb.corner2(1) : prototype_bb.corner1(1),
+                      (i & 4) ? prototype_bb.corner2(2) : prototype_bb.corner1(2));
+      corner = linear * corner + translation;
+      if(i == 0)
+      {
+        bb.corner1 = bb.corner2 = corner;
+      }
+      else
+      {
+        bb.corner1 = bb.corner1.array().min(corner.array());
+        bb.corner2 = bb.corner2.array().max(corner.array());
+      }
+    }
+    return bb;
+  }
+
+  void Instance::setTranslation(const Point3df& translation)
+  {
+    this->translation = translation;
+  }
+}
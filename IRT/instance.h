@@ -0,0 +1,147 @@
+/**
+ * \file instance.h
+ * Describes the instances of a shared set of primitives
+ */
+
+#ifndef INSTANCE
+#define INSTANCE
+
+#include <vector>
+
+#include "common.h"
+#include "primitives.h"
+#include "primitive_bounds.h"
+#include "bvh.h"
+
+namespace IRT
+{
+  /// A set of primitives with its own hierarchy, shared by all its instances
+  class Prototype
+  {
+  private:
+    /// Array for the primitives
+    std::vector<Primitive*> primitives;
+    /// Cached bounds of the primitives, in the same order
+    PrimitiveBounds bounds;
+    /// Hierarchy over the primitives, in the prototype space
+    BVH<Primitive> bvh;
+    /// Bounding box of the primitives
+    BoundingBox bb;
+
+    Prototype(const Prototype& prototype);
+
+  public:
+    /// Constructor
+    _export_tools Prototype();
+
+    /// Destructor, deletes the primitives
+    _export_tools ~Prototype();
+
+    /**
+     * Adds a new primitive to the prototype
+     * @param primitive is the primitive to add
+     * @return the index of the primitive
+     * @throw std::invalid_argument if the primitive is an instance, the hit records keeping only one level of prototype
+     */
+    _export_tools unsigned long addPrimitive(Primitive* primitive);
+
+    /**
+     * Builds the hierarchy of the prototype, to be called once all primitives are added
+     * @param max_leaf_size is the number of primitives under which a leaf is always created
+     */
+    _export_tools void build(unsigned int max_leaf_size);
+
+    /**
+     * Returns the first primitive hit by a ray
+     * @param ray is the ray to test, in the prototype space
+     * @param hit is filled with the primitive, the distance and the data of the hit, in the prototype space
+     * @return the hit primitive, else NULL
+     */
+    _export_tools Primitive* getFirstCollision(const Ray& ray, HitRecord& hit) const;
+
+    /**
+     * Returns the bounding box
+     * @return the bounding box, in the prototype space
+     */
+    _export_tools const BoundingBox& getBoundingBox() const;
+  };
+
+  /// A prototype placed in the scene by an affine transformation
+  class Instance: public Primitive
+  {
+  public:
+    /**
+     * Constructs a new instance
+     * @param prototype is the shared prototype, which must outlive the instance
+     * @param translation is the position of the prototype origin in the scene
+     * @param scale is the uniform scale of the prototype
+     */
+    _export_tools Instance(const Prototype* prototype, const Point3df& translation, DataType scale);
+
+    /**
+     * Constructs a new instance
+     * @param prototype is the shared prototype, which must outlive the instance
+     * @param linear is the linear part of the transformation, which must be invertible
+     * @param translation is the position of the prototype origin in the scene
+     */
+    _export_tools Instance(const Prototype* prototype, const Matrix3df& linear, const Point3df& translation);
+
+    /// Destructor
+    _export_tools ~Instance();
+
+    /**
+     * Tests if a ray intersects the instance
+     * @param ray is the ray to test
+     * @param dist is an output argument that will contain the distance between the ray origin and the primitive
+     * @return True or False depending on the result of the test
+     */
+    _export_tools bool intersect(const Ray& ray, DataType& dist) const;
+
+    /**
+     * Tests if a ray intersects the instance, recording the primitive of the prototype that is hit and the data of its hit
+     * @param ray is the ray to test
+     * @param hit is an output argument that will contain the distance, the prototype primitive and its data
+     * @return True or False depending on the result of the test
+     */
+    _export_tools bool intersect(const Ray& ray, HitRecord& hit) const;
+
+    /**
+     * Fills the normal of the prototype primitive that was hit, brought back in the scene
+     * @param ray is the direction ray
+     * @param hit has its distance, its point and the data recorded by intersect() set
+     */
+    _export_tools void computeHit(const Ray& ray, HitRecord& hit) const;
+
+    /**
+     * Returns the bounding box of the primitive
+     * @return the bounding box
+     */
+    _export_tools virtual BoundingBox getBoundingBox() const;
+
+    /**
+     * Moves the instance, the scene structure must then be rebuilt
+     * @param translation is the new position of the prototype origin
+     */
+    _export_tools void setTranslation(const Point3df& translation);
+
+  private:
+    /**
+     * Transforms a ray in the prototype space
+     * @param ray is the ray in the scene
+     * @param scale is the length of the transformed direction, dividing the distances in the prototype space
+     * @return the ray in the prototype space, with a normalized direction
+     */
+    Ray toPrototype(const Ray& ray, DataType& scale) const;
+
+    /// The shared prototype
+    const Prototype* prototype;
+    /// Linear part of the transformation
+    Matrix3df linear;
+    /// Inverse of the linear part
+    Matrix3df inverse_linear;
+    /// Translation part of the transformation
+    Point3df translation;
+  };
+}
+
+#endif
@@ -0,0 +1,34 @@
+/* -*- C -*-  (not really, but good for syntax highlighting) */
+
+#ifdef SWIGPYTHON
+
+%{
+#include "IRT/instance.h"
+%}
+
+%typemap(in) IRT::Prototype*
+{
+  if ((SWIG_ConvertPtr($input,(void **)(&$1),$1_descriptor, SWIG_POINTER_EXCEPTION | SWIG_POINTER_DISOWN)) == -1) SWIG_fail;
+}
+
+namespace IRT
+{
+  class Prototype
+  {
+  public:
+    Prototype();
+    ~Prototype();
+    unsigned long addPrimitive(IRT::Primitive* primitive);
+    void build(unsigned int max_leaf_size);
+  };
+
+  class Instance: public Primitive
+  {
+  public:
+    Instance(const IRT::Prototype* prototype, IRT::Point3df& translation, float scale);
+    ~Instance();
+    void setTranslation(IRT::Point3df& translation);
+  };
+}
+
+#endif /* SWIGPYTHON */
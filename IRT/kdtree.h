@@ -6,36 +6,216 @@
 #ifndef KDTREE
 #define KDTREE
 
+#include <algorithm>
+#include <deque>
 #include <iostream>
-#include <list>
+#include <limits>
+#include <stdexcept>
 #include <vector>
 
+#ifdef USE_TBB
+#include <atomic>
+#include <tbb/concurrent_vector.h>
+#include <tbb/enumerable_thread_specific.h>
+#include <tbb/spin_mutex.h>
+#endif
+
 #include "common.h"
+#include "accelerator.h"
+#include "bounding_box.h"
+#include "mailbox.h"
+#include "leaf_blocks.h"
+#include "primitive_dispatch.h"
+#include "ray_packet.h"
 
 namespace IRT
 {
+  /// Constants of the surface area heuristic that drives the kd-tree build
+  struct KDTreeCostModel
+  {
+    /// Cost of traversing an inner node, relative to the intersection cost
+    DataType traversal_cost;
+    /// Cost of intersecting one primitive
+    DataType intersection_cost;
+    /// Fraction of the cost saved by a split that cuts off empty space, high values cutting thin empty slices until the depth runs out
+    DataType empty_bonus;
+    /// If true, a node becomes a leaf as soon as no split is cheaper than intersecting all its primitives
+    bool leaf_termination;
+
+    KDTreeCostModel(DataType traversal_cost = .3, DataType intersection_cost = 1., DataType empty_bonus = .2, bool leaf_termination = false)
+    :traversal_cost(traversal_cost), intersection_cost(intersection_cost), empty_bonus(empty_bonus), leaf_termination(leaf_termination)
+    {
+    }
+
+    /**
+     * Computes the cost of a split relative to the cost of making the node a leaf
+     * A child with no primitive gets the empty space bonus, unless the plane is on the side of the node and the child is flat.
+     * @param count is the number of primitives of the node
+     * @return the ratio of the costs, a split being worth it when it is lower than 1
+     */
+    DataType computeRelativeCost(int axis, DataType split_position, const BoundingBox& bb, unsigned long count, unsigned long right_count, unsigned long left_count) const
+    {
+      BoundingBox bb_right, bb_left;
+      bb_right = bb_left = bb;
+      bb_right.corner1(axis) = split_position;
+      bb_left.corner2(axis) = split_position;
+
+      DataType cost = intersection_cost * (bb_right.SAH() * right_count + bb_left.SAH() * left_count) / bb.SAH();
+      if((right_count == 0 || left_count == 0) && split_position > bb.corner1(axis) && split_position < bb.corner2(axis))
+      {
+        cost *= 1 - empty_bonus;
+      }
+
+      return (traversal_cost + cost) / (intersection_cost * count);
+    }
+  };
+
+  /// Description of the shape of a kd-tree, predicting its rendering cost
+  struct KDTreeQuality
+  {
+    /// Number of nodes, inner nodes and leaves
+    unsigned long nodes;
+    /// Number of leaves
+    unsigned long leaves;
+    /// Number of leaves without primitive
+    unsigned long empty_leaves;
+    /// Depth of the deepest leaf, the root being at depth 0
+    unsigned long max_depth;
+    /// Average depth of the leaves
+    DataType average_depth;
+    /// Number of leaves for each number of primitives, from 0 to the size of the largest leaf
+    std::vector<unsigned long> leaf_sizes;
+    /// Number of primitives in the leaves divided by the number of different primitives
+    DataType duplication;
+    /// Fraction of the leaves without primitive
+    DataType empty_leaf_ratio;
+    /// Expected cost of a ray going through the tree according to the surface area heuristic
+    DataType sah_cost;
+    /// Memory used by the nodes
+    unsigned long node_bytes;
+    /// Memory used by the leaf primitives array
+    unsigned long leaf_bytes;
+
+    KDTreeQuality()
+    :nodes(0), leaves(0), empty_leaves(0), max_depth(0), average_depth(0), duplication(0), empty_leaf_ratio(0), sah_cost(0), node_bytes(0), leaf_bytes(0)
+    {
+    }
+  };
+
   /// The default class for the kd-tree
   template<class Primitive>
-  class KDTree
+  class KDTree: public Accelerator<Primitive>
   {
+  private:
+    /// Keeps the closest hit in the runs of primitives of a leaf
+    struct LeafFirstCollision
+    {
+      Primitive* const* primitives;
+      const LeafBlocks<Primitive>& blocks;
+      const Ray& ray;
+      Mailbox<Primitive>& mailbox;
+      unsigned int ray_id;
+      /// Distance and data of the closest hit
+      HitRecord& hit;
+      /// The closest hit primitive, NULL if none
+      Primitive* primitive;
+
+      LeafFirstCollision(Primitive* const* primitives, const LeafBlocks<Primitive>& blocks, const Ray& ray, Mailbox<Primitive>& mailbox, unsigned int ray_id, HitRecord& hit)
+      :primitives(primitives), blocks(blocks), ray(ray), mailbox(mailbox), ray_id(ray_id), hit(hit), primitive(NULL)
+      {
+        hit.dist = std::numeric_limits<float>::max();
+      }
+
+      template<class Intersection>
+      bool visit(Primitive* const* begin, Primitive* const* end)
+      {
+        int index;
+        if(blocks.firstCollision(static_cast<const Intersection*>(NULL), primitives, begin - primitives, end - begin, ray, mailbox, ray_id, hit, index))
+        {
+          if(index >= 0)
+          {
+            primitive = begin[index];
+          }
+          return true;
+        }
+
+        for(Primitive* const* it = begin; it != end; ++it)
+        {
+          const HitRecord* cur_hit = mailbox.template intersect<Intersection>(*it, ray, ray_id);
+          if(cur_hit != NULL && (0.0001f < cur_hit->dist) && (cur_hit->dist < hit.dist))
+          {
+            primitive = *it;
+            hit = *cur_hit;
+          }
+        }
+        return true;
+      }
+    };
+
+    /// Stops at the first hit before a distance in the runs of primitives of a leaf
+    struct LeafOcclusion
+    {
+      Primitive* const* primitives;
+      const LeafBlocks<Primitive>& blocks;
+      const Ray& ray;
+      Mailbox<Primitive>& mailbox;
+      unsigned int ray_id;
+      /// Distance after which hits are ignored
+      float max_dist;
+
+      LeafOcclusion(Primitive* const* primitives, const LeafBlocks<Primitive>& blocks, const Ray& ray, Mailbox<Primitive>& mailbox, unsigned int ray_id, float max_dist)
+      :primitives(primitives), blocks(blocks), ray(ray), mailbox(mailbox), ray_id(ray_id), max_dist(max_dist)
+      {
+      }
+
+      template<class Intersection>
+      bool visit(Primitive* const* begin, Primitive* const* end)
+      {
+        bool hit;
+        if(blocks.testCollision(static_cast<const Intersection*>(NULL), primitives, begin - primitives, end - begin, ray, mailbox, ray_id, max_dist, hit))
+        {
+          return !hit;
+        }
+
+        for(Primitive* const* it = begin; it != end; ++it)
+        {
+          float cur_dist;
+          if(mailbox.template intersect<Intersection>(*it, ray, ray_id, cur_dist) && (0.0001f < cur_dist) && (cur_dist < max_dist))
+          {
+            return false;
+          }
+        }
+        return true;
+      }
+    };
+
   public:
-    /// Inside kd-tree node
+    /// Inside kd-tree node, packed in 8 bytes
     class KDTreeNode
     {
     private:
-      /// Axis
-      short axis;
-      /// Indicates if the node is a leaf
-      bool is_leaf;
-      /// The primitives that are in this leaf
-      const std::vector<Primitive*>* primitives;
-      /// split position on an axis
-      DataType split_position;
-      /// Pointer to the left node
-      KDTreeNode* left;
+      union
+      {
+        /// split position on an axis for an inner node
+        DataType split_position;
+        /// offset of the first primitive in the leaf primitives array for a leaf
+        unsigned int primitives_offset;
+      };
+      /// The axis (or 3 for a leaf) in the two low bits, the relative offset to the left node or the number of primitives in the leaf in the others
+      unsigned int flags;
+
+      /// Value of the two low bits of a leaf
+      static const unsigned int leaf_flag = 3;
+      /// High bit of a leaf whose subtree is built the first time a ray reaches it
+      static const unsigned int deferred_flag = 1U << 31;
     public:
+      /// Largest number of primitives in a leaf, the bits above the count holding the deferred flag
+      static const unsigned int max_primitives_count = (1U << 29) - 1;
+      /// Largest offset between an inner node and its left node, which must fit in the 30 high bits
+      static const unsigned int max_left_offset = (1U << 30) - 1;
+
       KDTreeNode()
-      : is_leaf(true), primitives(NULL), left(NULL)
+      : primitives_offset(0), flags(leaf_flag)
       {
       }
 
@@ -45,191 +225,1094 @@ namespace IRT
        */
       short getAxis() const
       {
-        return axis;
+        return flags & 3;
+      }
+
+      /// Returns true is the node is a leaf
+      bool isLeaf() const
+      {
+        return (flags & 3) == leaf_flag;
+      }
+
+      /// Returns true if the node is a leaf whose subtree is not built yet
+      bool isDeferred() const
+      {
+        return isLeaf() && (flags & deferred_flag) != 0;
       }
 
       /**
-       * Sets the new axis
-       * @param axis is the new axis
+       * Makes the node a leaf pointing in the leaf primitives array
+       * @param offset is the index of the first primitive of the leaf
+       * @param count is the number of primitives in the leaf
+       * @throw std::out_of_range if count is above max_primitives_count
        */
-      void setAxis(short axis)
+      void setLeaf(unsigned int offset, unsigned int count)
       {
-        this->axis = axis;
+        if(count > max_primitives_count)
+          throw std::out_of_range("Too many primitives in a kd-tree leaf");
+        primitives_offset = offset;
+        flags = (count << 2) | leaf_flag;
       }
 
-      /// Returns true is the node is a leaf
-      bool isLeaf() const
+      /**
+       * Makes the node a leaf whose subtree is built on demand
+       * @param index is the index of the leaf in the deferred leaves of the tree
+       */
+      void setDeferred(unsigned int index)
       {
-        return is_leaf;
+        primitives_offset = index;
+        flags = deferred_flag | leaf_flag;
       }
 
       /**
-       * Sets the fact that the node is a leaf or not
-       * @param is_leaf indicates if the node will be a leaf, or not
+       * Makes the node an inner node
+       * @param axis is the split axis
+       * @param split_position is the split position on this axis
+       * @param left_offset is the offset between this node and its left node
+       * @throw std::out_of_range if left_offset is above max_left_offset
        */
-      void setLeaf(bool is_leaf)
+      void setInner(short axis, DataType split_position, unsigned int left_offset)
+      {
+        if(left_offset > max_left_offset)
+          throw std::out_of_range("Too many kd-tree nodes between an inner node and its left node");
+        this->split_position = split_position;
+        flags = (left_offset << 2) | axis;
+      }
+
+      /// Returns the index of the first primitive of the leaf
+      unsigned int getPrimitivesOffset() const
+      {
+        return primitives_offset;
+      }
+
+      /// Returns the number of primitives of the leaf, 0 for a deferred leaf
+      unsigned int getPrimitivesCount() const
       {
-        this->is_leaf = is_leaf;
+        return (flags & ~deferred_flag) >> 2;
       }
 
       /**
-       *  Sets the container of primitives
-       * @param primitives is the new primitives container
+       * Returns the first collision in the leaf
+       * @param primitives is the leaf primitives array of the tree
+       * @param blocks are the blocks of the leaves of the tree
+       * @param ray is the ray to test
+       * @param mailbox is the mailbox of the current thread
+       * @param ray_id is the identifier of the ray in the mailbox
+       * @param hit is filled with the distance and the data of the hit by the intersection tests
+       * @return the hit primitive, else NULL
        */
-      void setPrimitives(const std::vector<Primitive*>* primitives)
+      Primitive* getFirstCollision(Primitive* const* primitives, const LeafBlocks<Primitive>& blocks, const Ray& ray, Mailbox<Primitive>& mailbox, unsigned int ray_id, HitRecord& hit) const
       {
-        this->primitives = primitives;
+        LeafFirstCollision collision(primitives, blocks, ray, mailbox, ray_id, hit);
+        PrimitiveDispatch<Primitive>::visit(primitives + primitives_offset, primitives + primitives_offset + getPrimitivesCount(), collision);
+
+        hit.primitive = collision.primitive;
+        return collision.primitive;
       }
 
       /**
-       * Returns the inner primitives
+       * Tests if any primitive of the leaf is hit before a distance
+       * @param primitives is the leaf primitives array of the tree
+       * @param blocks are the blocks of the leaves of the tree
+       * @param ray is the ray to test
+       * @param mailbox is the mailbox of the current thread
+       * @param ray_id is the identifier of the ray in the mailbox
+       * @param max_dist is the distance after which hits are ignored
+       * @return true as soon as a primitive is hit
        */
-      const std::vector<Primitive*>* getPrimitives() const
+      bool testCollision(Primitive* const* primitives, const LeafBlocks<Primitive>& blocks, const Ray& ray, Mailbox<Primitive>& mailbox, unsigned int ray_id, float max_dist) const
       {
-        return primitives;
+        LeafOcclusion occlusion(primitives, blocks, ray, mailbox, ray_id, max_dist);
+        return !PrimitiveDispatch<Primitive>::visit(primitives + primitives_offset, primitives + primitives_offset + getPrimitivesCount(), occlusion);
       }
 
-      Primitive* getFirstCollision(const Ray& ray, float& dist) const
+      /// Returns the split position
+      DataType getSplitPosition() const
       {
-        float min_dist = std::numeric_limits<float>::max();
-        Primitive* min_primitive = NULL;
+        return split_position;
+      }
+
+      /// Return the left node
+      const KDTreeNode* leftNode() const
+      {
+        return this + (flags >> 2);
+      }
+
+      /// Returns the right node
+      const KDTreeNode* rightNode() const
+      {
+        return leftNode() + 1;
+      }
+    };
 
-        for(typename std::vector<Primitive*>::const_iterator it = getPrimitives()->begin(); it != getPrimitives()->end(); ++it)
+    /// Stack for the ray traversal
+    struct KDStack
+    {
+      const KDTreeNode* node;
+      DataType t;
+      Vector3df pb;
+      int previous;
+    };
+    
+    /// Arena owning the primitives lists of the leaves during the construction, lists being allocated and released concurrently with TBB
+    class PrimitivesArena
+    {
+    private:
+#ifdef USE_TBB
+      /// All the lists, a concurrent vector so that references stay valid when new lists are added by other threads
+      tbb::concurrent_vector<std::vector<Primitive*> > stores;
+      /// Protects the released lists
+      tbb::spin_mutex free_mutex;
+#else
+      /// All the lists, a deque so that references stay valid when new lists are added
+      std::deque<std::vector<Primitive*> > stores;
+#endif
+      /// The released lists that can be reused
+      std::vector<unsigned int> free_stores;
+    public:
+      /**
+       * Returns a new empty list, reusing a released one if possible
+       * @return the index of the list
+       */
+      unsigned int allocate()
+      {
+#ifdef USE_TBB
         {
-          float cur_dist;
-          bool test = (*it)->intersect(ray, cur_dist);
+          tbb::spin_mutex::scoped_lock lock(free_mutex);
+          if(!free_stores.empty())
+          {
+            unsigned int index = free_stores.back();
+            free_stores.pop_back();
+            return index;
+          }
+        }
+        return stores.grow_by(1) - stores.begin();
+#else
+        if(free_stores.empty())
+        {
+          stores.push_back(std::vector<Primitive*>());
+          return stores.size() - 1;
+        }
+        unsigned int index = free_stores.back();
+        free_stores.pop_back();
+        return index;
+#endif
+      }
+
+      /**
+       * Releases a list in constant time, its memory being kept for the next allocation
+       * @param index is the index of the list
+       */
+      void release(unsigned int index)
+      {
+        stores[index].clear();
+#ifdef USE_TBB
+        tbb::spin_mutex::scoped_lock lock(free_mutex);
+#endif
+        free_stores.push_back(index);
+      }
+
+      /// Returns a list
+      std::vector<Primitive*>& operator[](unsigned int index)
+      {
+        return stores[index];
+      }
+
+      /// Returns a list
+      const std::vector<Primitive*>& operator[](unsigned int index) const
+      {
+        return stores[index];
+      }
+
+      /// Releases all the lists and their memory, not thread safe
+      void clear()
+      {
+        stores.clear();
+        free_stores.clear();
+      }
+    };
+
+    /// Stack for the packet traversal
+    struct KDPacketStack
+    {
+      const KDTreeNode* node;
+      RayPacket::Array tnear;
+      RayPacket::Array tfar;
+    };
+
+    /// Stack for stats
+    struct KDStackStats
+    {
+      const KDTreeNode* node;
+      DataType t;
+      Vector3df pb;
+      int previous;
+      long level;
+    };
+
+    /// Stack for the quality report
+    struct KDStackQuality
+    {
+      const KDTreeNode* node;
+      BoundingBox bb;
+      unsigned long depth;
+    };
+
+    /// Builds the subtree of a deferred leaf the first time a ray reaches it
+    class Refiner
+    {
+    public:
+      /// Virtual destructor
+      virtual ~Refiner()
+      {
+      }
+
+      /**
+       * Builds a subtree, called by one thread at a time for a given leaf while other threads may trace rays in the rest of the tree
+       * @param subtree is the empty tree to build
+       * @param primitives are the primitives of the leaf
+       * @param bb is the bounding box of the leaf
+       * @param remaining_depth is the maximum depth of the subtree
+       * @param remaining_failures is the number of splits allowed on a branch when they do not enhance the cost enough
+       */
+      virtual void refine(KDTree& subtree, const std::vector<Primitive*>& primitives, const BoundingBox& bb, int remaining_depth, int remaining_failures) const = 0;
+    };
+
+    /// A leaf whose subtree is built on demand
+    struct DeferredLeaf
+    {
+      /// The bounding box of the leaf
+      BoundingBox bb;
+      /// The primitives of the leaf
+      std::vector<Primitive*> primitives;
+      /// The build parameters the leaf had when it was deferred
+      int remaining_depth;
+      int remaining_failures;
+#ifdef USE_TBB
+      /// Serializes the construction of the subtree
+      tbb::spin_mutex mutex;
+#endif
+
+      DeferredLeaf()
+      :remaining_depth(0), remaining_failures(0), subtree(NULL)
+      {
+      }
+
+      /// Returns the subtree, NULL until a ray reaches the leaf, read with acquire semantics
+      KDTree* loadSubtree() const
+      {
+#ifdef USE_TBB
+        return subtree.load(std::memory_order_acquire);
+#else
+        return subtree;
+#endif
+      }
+
+      /// Publishes the subtree with release semantics, only called with the mutex held or outside of traversals
+      void storeSubtree(KDTree* new_subtree)
+      {
+#ifdef USE_TBB
+        subtree.store(new_subtree, std::memory_order_release);
+#else
+        subtree = new_subtree;
+#endif
+      }
+
+    private:
+#ifdef USE_TBB
+      std::atomic<KDTree*> subtree;
+#else
+      KDTree* subtree;
+#endif
+    };
+
+  private:
+    /// All the actual nodes of the binary tree
+    std::vector<KDTreeNode> nodes;
+    /// Nodes used in place from a mapped file instead of nodes, else NULL
+    const KDTreeNode* mapped_nodes;
+    /// Number of mapped nodes
+    unsigned long mapped_count;
+#ifdef USE_TBB
+    /// The nodes during the construction, growing without moving so that subtrees can be built concurrently
+    typedef tbb::concurrent_vector<KDTreeNode> BuildNodes;
+#else
+    /// The nodes during the construction
+    typedef std::vector<KDTreeNode> BuildNodes;
+#endif
+    /// The nodes being built, moved to nodes by compact()
+    BuildNodes build_nodes;
+    /// The primitives of all leaves, each leaf being a range in this array
+    std::vector<Primitive*> leaf_primitives;
+    /// Copies of the runs of spheres and triangles of the leaves, intersected several at a time
+    LeafBlocks<Primitive> leaf_blocks;
+    /// The primitives lists used during the construction, the offset of a leaf being the index of its list until compact() is called
+    PrimitivesArena arena;
+    /// Number of entries of leaf_primitives left unused by the incremental updates
+    unsigned long unused_primitives;
+    /// Sum over the leaves of their area times their number of primitives
+    DataType leaf_cost;
+    /// Value of leaf_cost when the tree was built
+    DataType built_leaf_cost;
+#ifdef USE_TBB
+    /// The deferred leaves, a concurrent vector so that leaves can be deferred by the parallel build
+    typedef tbb::concurrent_vector<DeferredLeaf> DeferredLeaves;
+#else
+    /// The deferred leaves, a deque so that references stay valid when leaves are added
+    typedef std::deque<DeferredLeaf> DeferredLeaves;
+#endif
+    /// The deferred leaves, indexed by the primitives offset of the deferred nodes, their subtrees being built during the traversal
+    mutable DeferredLeaves deferred_leaves;
+    /// Builds the deferred subtrees, owned by the tree, NULL to make them one leaf
+    Refiner* refiner;
+    /// True for the subtree of a deferred leaf
+    bool nested;
+
+#ifdef USE_TBB
+    /// The mailbox of each thread
+    mutable tbb::enumerable_thread_specific<Mailbox<Primitive> > mailboxes;
+#else
+    /// The mailbox
+    mutable Mailbox<Primitive> mailbox;
+#endif
+
+    KDTree(const KDTree& tree);
+
+    int mod[5];
+
+    /// Returns the mailbox of the current thread
+    Mailbox<Primitive>& getMailbox() const
+    {
+#ifdef USE_TBB
+      return mailboxes.local();
+#else
+      return mailbox;
+#endif
+    }
+
+    /// Returns the root of the tree
+    const KDTreeNode* getRoot() const
+    {
+      return mapped_nodes != NULL ? mapped_nodes : &nodes[0];
+    }
+
+    /// Copies the mapped nodes so that they can be modified
+    void unmapNodes()
+    {
+      if(mapped_nodes != NULL)
+      {
+        nodes.assign(mapped_nodes, mapped_nodes + mapped_count);
+        mapped_nodes = NULL;
+        mapped_count = 0;
+      }
+    }
+
+    /**
+     * Finds the leaves a box overlaps, a box lying in a split plane being on both sides like during the construction
+     * @param primitive_bb is the box to locate
+     * @param bb is the bounding box of the tree
+     * @param leaves is filled with the index and the area of each leaf
+     */
+    void findLeaves(const BoundingBox& primitive_bb, const BoundingBox& bb, std::vector<std::pair<unsigned int, DataType> >& leaves) const
+    {
+      const KDTreeNode* root = getRoot();
+      std::vector<std::pair<const KDTreeNode*, BoundingBox> > stack(1, std::make_pair(root, bb));
+      while(!stack.empty())
+      {
+        const KDTreeNode* node = stack.back().first;
+        BoundingBox node_bb = stack.back().second;
+        stack.pop_back();
+
+        if(node->isLeaf())
+        {
+          leaves.push_back(std::make_pair(static_cast<unsigned int>(node - root), node_bb.isEmpty() ? 0 : node_bb.SAH()));
+          continue;
+        }
+
+        int axis = node->getAxis();
+        DataType position = node->getSplitPosition();
+        BoundingBox left_bb = node_bb;
+        left_bb.corner2(axis) = std::max(std::min(position, node_bb.corner2(axis)), node_bb.corner1(axis));
+        BoundingBox right_bb = node_bb;
+        right_bb.corner1(axis) = left_bb.corner2(axis);
 
-          if(test && (0.0001f < cur_dist) && (cur_dist < min_dist))
+        if(primitive_bb.corner2(axis) > position || primitive_bb.corner1(axis) >= position)
+        {
+          stack.push_back(std::make_pair(node->rightNode(), right_bb));
+        }
+        if(primitive_bb.corner1(axis) < position || primitive_bb.corner2(axis) <= position)
+        {
+          stack.push_back(std::make_pair(node->leftNode(), left_bb));
+        }
+      }
+    }
+
+    /// Removes the unused entries of the leaf primitives array
+    void packLeafPrimitives()
+    {
+      std::vector<Primitive*> packed;
+      packed.reserve(leaf_primitives.size() - unused_primitives);
+      for(unsigned int i = 0; i < nodes.size(); ++i)
+      {
+        if(nodes[i].isLeaf() && !nodes[i].isDeferred())
+        {
+          unsigned int offset = packed.size();
+          packed.insert(packed.end(), leaf_primitives.begin() + nodes[i].getPrimitivesOffset(), leaf_primitives.begin() + nodes[i].getPrimitivesOffset() + nodes[i].getPrimitivesCount());
+          PrimitiveDispatch<Primitive>::group(packed.begin() + offset, packed.end());
+          nodes[i].setLeaf(offset, nodes[i].getPrimitivesCount());
+        }
+      }
+      leaf_primitives.swap(packed);
+      unused_primitives = 0;
+      buildLeafBlocks();
+    }
+
+    /// Returns the beginning of the leaf primitives array
+    Primitive* const* getLeafPrimitives() const
+    {
+      return leaf_primitives.empty() ? NULL : &leaf_primitives[0];
+    }
+
+    /**
+     * Copies the runs of all the leaves in blocks
+     * The primitives of several leaves are marked as shared so that their blocks use the mailbox, all of them for a subtree, whose primitives may be in the leaves of its parent.
+     */
+    void buildLeafBlocks()
+    {
+      leaf_blocks.clear();
+      const KDTreeNode* root = getRoot();
+      std::vector<Primitive*> shared;
+      for(unsigned long i = 0; i < getNodeCount(); ++i)
+      {
+        if(!root[i].isLeaf())
+        {
+          continue;
+        }
+        if(root[i].isDeferred())
+        {
+          const std::vector<Primitive*>& deferred = deferred_leaves[root[i].getPrimitivesOffset()].primitives;
+          shared.insert(shared.end(), deferred.begin(), deferred.end());
+        }
+        else
+        {
+          shared.insert(shared.end(), leaf_primitives.begin() + root[i].getPrimitivesOffset(), leaf_primitives.begin() + root[i].getPrimitivesOffset() + root[i].getPrimitivesCount());
+        }
+      }
+      std::sort(shared.begin(), shared.end());
+      if(nested)
+      {
+        shared.erase(std::unique(shared.begin(), shared.end()), shared.end());
+      }
+      else
+      {
+        // Keeps one copy of the primitives found at least twice
+        typename std::vector<Primitive*>::iterator last = shared.begin();
+        for(unsigned long i = 1; i < shared.size(); ++i)
+        {
+          if(shared[i] == shared[i - 1] && (last == shared.begin() || *(last - 1) != shared[i]))
           {
-            min_primitive = *it;
-            dist = cur_dist;
+            *last++ = shared[i];
           }
         }
+        shared.erase(last, shared.end());
+      }
 
-        return min_primitive;
+      for(unsigned long i = 0; i < getNodeCount(); ++i)
+      {
+        if(root[i].isLeaf() && !root[i].isDeferred())
+        {
+          leaf_blocks.addLeaf(getLeafPrimitives(), root[i].getPrimitivesOffset(), root[i].getPrimitivesCount(), shared);
+        }
       }
+    }
 
-      /// Returns the split position
-      DataType getSplitPosition() const
+    /// Returns the number of primitives of a leaf, deferred or not
+    unsigned int getLeafCount(const KDTreeNode* node) const
+    {
+      return node->isDeferred() ? deferred_leaves[node->getPrimitivesOffset()].primitives.size() : node->getPrimitivesCount();
+    }
+
+    /// Deletes the deferred leaves and their subtrees
+    void clearDeferredLeaves()
+    {
+      for(typename DeferredLeaves::iterator it = deferred_leaves.begin(); it != deferred_leaves.end(); ++it)
       {
-        return split_position;
+        delete it->loadSubtree();
       }
+      deferred_leaves.clear();
+    }
 
-      /// Sets the split position for this node
-      void setSplitPosition(DataType split_position)
+    /**
+     * Returns the subtree of a deferred leaf, building it if no ray reached the leaf before
+     * The pointer is checked again with the mutex held so that only one thread builds the subtree, the others waiting for it.
+     * It is read with acquire semantics, like in all the other readers, so that a thread seeing the subtree also sees its nodes.
+     */
+    const KDTree* getSubtree(const KDTreeNode* node) const
+    {
+      DeferredLeaf& leaf = deferred_leaves[node->getPrimitivesOffset()];
+      KDTree* subtree = leaf.loadSubtree();
+      if(subtree == NULL)
       {
-        this->split_position = split_position;
+#ifdef USE_TBB
+        tbb::spin_mutex::scoped_lock lock(leaf.mutex);
+#endif
+        subtree = leaf.loadSubtree();
+        if(subtree == NULL)
+        {
+          subtree = new KDTree;
+          subtree->nested = true;
+          if(refiner != NULL)
+          {
+            refiner->refine(*subtree, leaf.primitives, leaf.bb, leaf.remaining_depth, leaf.remaining_failures);
+          }
+          else
+          {
+            subtree->setPrimitives(leaf.primitives);
+          }
+          leaf.storeSubtree(subtree);
+        }
       }
+      return subtree;
+    }
+  public:
+    /**
+   * Constructs an empty kdtree
+   */
+    KDTree()
+    :nodes(1), mapped_nodes(NULL), mapped_count(0), unused_primitives(0), leaf_cost(0), built_leaf_cost(0), refiner(NULL), nested(false)
+    {
+      mod[0] = 0, mod[1] = 1, mod[2] = 2, mod[3] = 0, mod[4] = 1;
+    }
 
-      /// Return the left node
-      KDTreeNode* leftNode() const
+    /// Destructor
+    ~KDTree()
+    {
+      clearDeferredLeaves();
+      delete refiner;
+    }
+
+    /**
+     * Resets the tree to one leaf containing all the primitives
+     * @param primitives is the primitives container
+     */
+    void setPrimitives(const std::vector<Primitive*>& primitives)
+    {
+      mapped_nodes = NULL;
+      mapped_count = 0;
+      nodes.clear();
+      nodes.push_back(KDTreeNode());
+      build_nodes.clear();
+      build_nodes.push_back(KDTreeNode());
+      arena.clear();
+      unused_primitives = 0;
+      leaf_cost = built_leaf_cost = 0;
+      clearDeferredLeaves();
+      setRefiner(NULL);
+
+      leaf_primitives = primitives;
+      leaf_blocks.clear();
+      nodes[0].setLeaf(0, leaf_primitives.size());
+    }
+
+    /**
+     * Adds a primitive to a tree that was not subdivided
+     * @param primitive is the new primitive
+     * @return false if the tree was subdivided and must be reset
+     */
+    bool appendPrimitive(Primitive* primitive)
+    {
+      if(nodes.size() != 1 || nodes[0].isDeferred())
+      {
+        return false;
+      }
+      leaf_primitives.push_back(primitive);
+      leaf_blocks.clear();
+      nodes[0].setLeaf(0, leaf_primitives.size());
+      return true;
+    }
+
+    Primitive* getFirstCollision(const Ray& ray, float& dist, float tnear, float tfar) const
+    {
+      HitRecord hit;
+      Primitive* primitive = getFirstCollision<DefaultTraversal>(ray, hit, tnear, tfar);
+      if(primitive != NULL)
+      {
+        dist = hit.dist;
+      }
+      return primitive;
+    }
+
+    Primitive* getFirstCollision(const Ray& ray, HitRecord& hit, float tnear, float tfar) const
+    {
+      return getFirstCollision<DefaultTraversal>(ray, hit, tnear, tfar);
+    }
+
+    bool testCollision(const Ray& ray, float tnear, float tfar) const
+    {
+      return testCollision<OcclusionTraversal>(ray, tnear, tfar);
+    }
+
+    int getHitLevel(const Ray& ray, float tnear, float tfar) const
+    {
+      HitRecord hit;
+      return getFirstCollision<HitLevelTraversal>(ray, hit, tnear, tfar);
+    }
+
+    TraversalStatistics getTraversalStatistics(const Ray& ray, float tnear, float tfar) const
+    {
+      HitRecord hit;
+      return getFirstCollision<StatisticsTraversal>(ray, hit, tnear, tfar);
+    }
+
+    /**
+     * Returns the number of intersection tests skipped thanks to the mailboxes
+     * @return the number of skipped tests over all threads
+     */
+    unsigned long getAvoidedTests() const
+    {
+#ifdef USE_TBB
+      unsigned long avoided_tests = 0;
+      for(typename tbb::enumerable_thread_specific<Mailbox<Primitive> >::const_iterator it = mailboxes.begin(); it != mailboxes.end(); ++it)
       {
-        return left;
+        avoided_tests += it->getAvoidedTests();
       }
+      return avoided_tests;
+#else
+      return mailbox.getAvoidedTests();
+#endif
+    }
+
+    /// Resets the number of skipped intersection tests
+    void resetAvoidedTests()
+    {
+#ifdef USE_TBB
+      for(typename tbb::enumerable_thread_specific<Mailbox<Primitive> >::iterator it = mailboxes.begin(); it != mailboxes.end(); ++it)
+      {
+        it->resetAvoidedTests();
+      }
+#else
+      mailbox.resetAvoidedTests();
+#endif
+    }
+
+    /// Returns the nodes of a tree that was built, empty if the nodes are mapped
+    const std::vector<KDTreeNode>& getNodes() const
+    {
+      return nodes;
+    }
+
+    /// Returns all the nodes, the root being the first one, whether they were built or mapped
+    const KDTreeNode* getNodeData() const
+    {
+      return getRoot();
+    }
+
+    /// Returns the number of nodes, whether they were built or mapped
+    unsigned long getNodeCount() const
+    {
+      return mapped_nodes != NULL ? mapped_count : nodes.size();
+    }
+
+    /**
+     * Returns the primitives of all leaves, each leaf being a range in this array
+     */
+    const std::vector<Primitive*>& getAllLeafPrimitives() const
+    {
+      return leaf_primitives;
+    }
+
+    /**
+     * Uses nodes stored elsewhere, typically in a mapped file, instead of building them
+     * The nodes must stay valid until the tree is reset by setPrimitives().
+     * @param nodes are the nodes, the root being the first one
+     * @param count is the number of nodes
+     * @param primitives are the primitives of all leaves, swapped with the array of the tree
+     */
+    void setMappedNodes(const KDTreeNode* nodes, unsigned long count, std::vector<Primitive*>& primitives)
+    {
+      this->nodes.clear();
+      build_nodes.clear();
+      arena.clear();
+      mapped_nodes = nodes;
+      mapped_count = count;
+      leaf_primitives.swap(primitives);
+      unused_primitives = 0;
+      leaf_cost = built_leaf_cost = 0;
+      clearDeferredLeaves();
+      setRefiner(NULL);
+      buildLeafBlocks();
+    }
+
+    /**
+     * Sets how the deferred leaves are built
+     * @param refiner is the new refiner, owned by the tree, or NULL
+     */
+    void setRefiner(Refiner* refiner)
+    {
+      if(refiner != this->refiner)
+      {
+        delete this->refiner;
+        this->refiner = refiner;
+      }
+    }
+
+    /// Returns true if some leaves are built on demand
+    bool hasDeferredLeaves() const
+    {
+      return !deferred_leaves.empty();
+    }
+
+    /// Returns the number of deferred leaves whose subtree was built
+    unsigned long getRefinedLeaves() const
+    {
+      unsigned long refined = 0;
+      for(typename DeferredLeaves::const_iterator it = deferred_leaves.begin(); it != deferred_leaves.end(); ++it)
+      {
+        if(it->loadSubtree() != NULL)
+        {
+          ++refined;
+        }
+      }
+      return refined;
+    }
+
+    /**
+     * Adds a primitive to the leaves it overlaps, without rebuilding the tree
+     * The leaves that grow are moved at the end of the leaf primitives array, which is packed when too many entries are unused.
+     * Not thread safe, no ray may be traced at the same time.
+     * @param primitive is the new primitive
+     * @param primitive_bb is the bounding box of the primitive
+     * @param bb is the bounding box of the tree
+     */
+    void insertPrimitive(Primitive* primitive, const BoundingBox& primitive_bb, const BoundingBox& bb)
+    {
+      unmapNodes();
+      std::vector<std::pair<unsigned int, DataType> > leaves;
+      findLeaves(primitive_bb, bb, leaves);
+
+      for(std::vector<std::pair<unsigned int, DataType> >::const_iterator it = leaves.begin(); it != leaves.end(); ++it)
+      {
+        KDTreeNode& node = nodes[it->first];
+        unsigned int offset = node.getPrimitivesOffset();
+        unsigned int count = node.getPrimitivesCount();
+        if(node.isDeferred())
+        {
+          DeferredLeaf& leaf = deferred_leaves[offset];
+          leaf.primitives.push_back(primitive);
+          delete leaf.loadSubtree();
+          leaf.storeSubtree(NULL);
+          leaf_cost += it->second;
+          continue;
+        }
+        if(offset + count != leaf_primitives.size())
+        {
+          unsigned int new_offset = leaf_primitives.size();
+          leaf_primitives.resize(new_offset + count);
+          std::copy(leaf_primitives.begin() + offset, leaf_primitives.begin() + offset + count, leaf_primitives.begin() + new_offset);
+          unused_primitives += count;
+          offset = new_offset;
+        }
+        leaf_primitives.push_back(primitive);
+        node.setLeaf(offset, count + 1);
+        leaf_blocks.removeLeaf(offset, count + 1);
+        leaf_cost += it->second;
+      }
+
+      if(unused_primitives > leaf_primitives.size() / 2)
+      {
+        packLeafPrimitives();
+      }
+    }
+
+    /**
+     * Removes a primitive from the leaves it overlaps, without rebuilding the tree
+     * Not thread safe, no ray may be traced at the same time.
+     * @param primitive is the primitive to remove
+     * @param primitive_bb is the bounding box the primitive had when it was added
+     * @param bb is the bounding box of the tree
+     */
+    void removePrimitive(Primitive* primitive, const BoundingBox& primitive_bb, const BoundingBox& bb)
+    {
+      unmapNodes();
+      std::vector<std::pair<unsigned int, DataType> > leaves;
+      findLeaves(primitive_bb, bb, leaves);
+
+      for(std::vector<std::pair<unsigned int, DataType> >::const_iterator it = leaves.begin(); it != leaves.end(); ++it)
+      {
+        KDTreeNode& node = nodes[it->first];
+        unsigned int offset = node.getPrimitivesOffset();
+        unsigned int count = node.getPrimitivesCount();
+        if(node.isDeferred())
+        {
+          DeferredLeaf& leaf = deferred_leaves[offset];
+          typename std::vector<Primitive*>::iterator found = std::find(leaf.primitives.begin(), leaf.primitives.end(), primitive);
+          if(found != leaf.primitives.end())
+          {
+            *found = leaf.primitives.back();
+            leaf.primitives.pop_back();
+            delete leaf.loadSubtree();
+            leaf.storeSubtree(NULL);
+            leaf_cost -= it->second;
+          }
+          continue;
+        }
+        typename std::vector<Primitive*>::iterator first = leaf_primitives.begin() + offset;
+        typename std::vector<Primitive*>::iterator last = first + count;
+        typename std::vector<Primitive*>::iterator found = std::find(first, last, primitive);
+        if(found == last)
+        {
+          continue;
+        }
+        *found = *(last - 1);
+        if(offset + count == leaf_primitives.size())
+        {
+          leaf_primitives.pop_back();
+        }
+        else
+        {
+          ++unused_primitives;
+        }
+        node.setLeaf(offset, count - 1);
+        leaf_blocks.removeLeaf(offset, count);
+        leaf_cost -= it->second;
+      }
+    }
+
+    /**
+     * Computes the cost of the leaves and takes it as the reference of getDegradation(), called once the tree is built
+     * @param bb is the bounding box of the tree
+     */
+    void resetDegradation(const BoundingBox& bb)
+    {
+      BoundingBox everything;
+      everything.corner1 = Point3df::Constant(-std::numeric_limits<DataType>::max());
+      everything.corner2 = Point3df::Constant(std::numeric_limits<DataType>::max());
+      std::vector<std::pair<unsigned int, DataType> > leaves;
+      findLeaves(everything, bb, leaves);
+
+      const KDTreeNode* root = getRoot();
+      leaf_cost = 0;
+      for(std::vector<std::pair<unsigned int, DataType> >::const_iterator it = leaves.begin(); it != leaves.end(); ++it)
+      {
+        leaf_cost += it->second * getLeafCount(root + it->first);
+      }
+      built_leaf_cost = leaf_cost;
+    }
+
+    /**
+     * Returns how much the incremental updates degraded the tree
+     * @return the cost of the leaves relative to their cost when the tree was built, 1 if the tree was not built
+     */
+    DataType getDegradation() const
+    {
+      return built_leaf_cost > 0 ? leaf_cost / built_leaf_cost : 1;
+    }
+
+    /**
+     * Describes the shape of the tree, to compare build parameters without rendering
+     * @param bb is the bounding box of the tree
+     * @param cost_model gives the costs used for the expected cost of a ray
+     * @return the statistics of the tree
+     */
+    KDTreeQuality getQuality(const BoundingBox& bb, const KDTreeCostModel& cost_model = KDTreeCostModel()) const
+    {
+      KDTreeQuality quality;
+      quality.nodes = getNodeCount();
+      quality.node_bytes = quality.nodes * sizeof(KDTreeNode);
+      quality.leaf_bytes = leaf_primitives.size() * sizeof(Primitive*);
+
+      DataType root_area = bb.isEmpty() ? 0 : bb.SAH();
+      unsigned long references = 0;
+      unsigned long total_depth = 0;
+      std::vector<Primitive*> primitives;
+
+      std::vector<KDStackQuality> stack(1);
+      stack[0].node = getRoot();
+      stack[0].bb = bb;
+      stack[0].depth = 0;
+      while(!stack.empty())
+      {
+        KDStackQuality item = stack.back();
+        stack.pop_back();
+        DataType area = root_area > 0 ? item.bb.SAH() / root_area : 1;
+
+        if(item.node->isLeaf())
+        {
+          unsigned int count = getLeafCount(item.node);
+          ++quality.leaves;
+          if(count == 0)
+          {
+            ++quality.empty_leaves;
+          }
+          if(quality.leaf_sizes.size() <= count)
+          {
+            quality.leaf_sizes.resize(count + 1);
+          }
+          ++quality.leaf_sizes[count];
+          quality.max_depth = std::max(quality.max_depth, item.depth);
+          total_depth += item.depth;
+          references += count;
+          if(item.node->isDeferred())
+          {
+            const std::vector<Primitive*>& deferred = deferred_leaves[item.node->getPrimitivesOffset()].primitives;
+            primitives.insert(primitives.end(), deferred.begin(), deferred.end());
+          }
+          else
+          {
+            primitives.insert(primitives.end(), leaf_primitives.begin() + item.node->getPrimitivesOffset(), leaf_primitives.begin() + item.node->getPrimitivesOffset() + count);
+          }
+          quality.sah_cost += cost_model.intersection_cost * count * area;
+          continue;
+        }
 
-      /// Returns the right node
-      KDTreeNode* rightNode() const
-      {
-        return left + 1;
+        quality.sah_cost += cost_model.traversal_cost * area;
+        int axis = item.node->getAxis();
+        KDStackQuality left = item, right = item;
+        left.node = item.node->leftNode();
+        right.node = item.node->rightNode();
+        left.bb.corner2(axis) = std::max(std::min(item.node->getSplitPosition(), item.bb.corner2(axis)), item.bb.corner1(axis));
+        right.bb.corner1(axis) = left.bb.corner2(axis);
+        ++left.depth;
+        ++right.depth;
+        stack.push_back(right);
+        stack.push_back(left);
       }
 
-      /**
-       * Ses the left and by consequence right nodes
-       * @param left is the new left node
-       */
-      void setLeftNode(KDTreeNode* left)
-      {
-        this->left = left;
-      }
-    };
+      std::sort(primitives.begin(), primitives.end());
+      unsigned long different = std::unique(primitives.begin(), primitives.end()) - primitives.begin();
+      quality.duplication = different > 0 ? static_cast<DataType>(references) / different : 0;
+      quality.average_depth = static_cast<DataType>(total_depth) / quality.leaves;
+      quality.empty_leaf_ratio = static_cast<DataType>(quality.empty_leaves) / quality.leaves;
+      return quality;
+    }
 
-    /// Stack for the ray traversal
-    struct KDStack
-    {
-      const KDTreeNode* node;
-      DataType t;
-      Vector3df pb;
-      int previous;
-    };
-    
-    /// Stack for stats
-    struct KDStackStats
+    /**
+     * Creates two new adjacent leaves, thread safe with TBB
+     * @return the index of the first leaf
+     */
+    unsigned int getPairEmptyNodes()
     {
-      const KDTreeNode* node;
-      DataType t;
-      Vector3df pb;
-      int previous;
-      long level;
-    };
+#ifdef USE_TBB
+      return build_nodes.grow_by(2) - build_nodes.begin();
+#else
+      unsigned int size = build_nodes.size();
 
-  private:
-    /// The primitives that the kd-tree will browse
-    std::vector<Primitive*> primitives;
-    /// All the actual nodes of the binary tree
-    std::vector<KDTreeNode> nodes;
-    std::list<std::vector<Primitive*> > nodes_primitives;
+      build_nodes.resize(size + 2);
 
-    KDTree(const KDTree& tree);
+      return size;
+#endif
+    }
 
-    int mod[5];
-  public:
     /**
-   * Constructs a kdtree for some primitives
-   * @param primitives is the primitives container
-   */
-    KDTree()
+     * Transforms a leaf in an inner node during the construction
+     * @param index is the index of the node
+     * @param axis is the split axis
+     * @param split_position is the split position on this axis
+     * @param left_index is the index of the left node, the right node being the next one
+     */
+    void setInnerNode(unsigned int index, short axis, DataType split_position, unsigned int left_index)
     {
-      mod[0] = 0, mod[1] = 1, mod[2] = 2, mod[3] = 0, mod[4] = 1;
+      removeNewPrimitivesStore(build_nodes[index].getPrimitivesOffset());
+      build_nodes[index].setInner(axis, split_position, left_index - index);
     }
 
-    /// Destructor
-    ~KDTree()
+    /**
+     * Returns the primitives of a leaf during the construction
+     * @param index is the index of the leaf
+     */
+    const std::vector<Primitive*>& getNodePrimitives(unsigned int index) const
     {
+      return arena[build_nodes[index].getPrimitivesOffset()];
     }
 
-    void setPrimitives(const std::vector<Primitive*>& primitives)
+    /**
+     * Sets the primitives of a leaf during the construction
+     * @param index is the index of the leaf
+     * @param store is a store obtained by getNewPrimitivesStore()
+     */
+    void setNodePrimitives(unsigned int index, unsigned int store)
     {
-      this->primitives = primitives;
-      KDTreeNode node;
-      node.setLeaf(true);
-      node.setPrimitives(&primitives);
-
-      nodes.clear();
-      nodes.reserve(3 * primitives.size());
-      nodes.push_back(node);
-      nodes_primitives.clear();
+      build_nodes[index].setLeaf(store, 0);
     }
 
-    std::vector<KDTreeNode>& getNodes()
+    /**
+     * Returns a new primitives store for the construction
+     * @return the index of the store
+     */
+    unsigned int getNewPrimitivesStore()
     {
-      return nodes;
+      return arena.allocate();
     }
 
-    KDTreeNode* getPairEmptyNodes()
+    /// Returns a primitives store
+    std::vector<Primitive*>& getPrimitivesStore(unsigned int store)
     {
-      int size = nodes.size();
-
-      nodes.resize(size + 2);
+      return arena[store];
+    }
 
-      return &nodes[size];
+    /// Releases a primitives store
+    void removeNewPrimitivesStore(unsigned int store)
+    {
+      arena.release(store);
     }
 
-    std::vector<Primitive*>* getNewPrimitivesStore()
+    /**
+     * Makes a leaf deferred during the construction, its subtree being built by the refiner the first time a ray reaches it, thread safe with TBB
+     * @param index is the index of the leaf
+     * @param bb is the bounding box of the leaf
+     * @param remaining_depth is the maximum depth of the subtree
+     * @param remaining_failures is the number of splits allowed on a branch of the subtree when they do not enhance the cost enough
+     */
+    void setDeferredNode(unsigned int index, const BoundingBox& bb, int remaining_depth, int remaining_failures)
     {
-      nodes_primitives.push_back(std::vector<Primitive*>());
-      return &nodes_primitives.back();
+#ifdef USE_TBB
+      typename DeferredLeaves::iterator leaf = deferred_leaves.grow_by(1);
+#else
+      deferred_leaves.push_back(DeferredLeaf());
+      typename DeferredLeaves::iterator leaf = deferred_leaves.end() - 1;
+#endif
+      unsigned int store = build_nodes[index].getPrimitivesOffset();
+      leaf->bb = bb;
+      leaf->primitives.swap(arena[store]);
+      leaf->remaining_depth = remaining_depth;
+      leaf->remaining_failures = remaining_failures;
+      removeNewPrimitivesStore(store);
+      build_nodes[index].setDeferred(leaf - deferred_leaves.begin());
     }
 
-    void removeNewPrimitivesStore(const std::vector<Primitive*>* store)
+    /**
+     * Ends the construction by moving the nodes in one array, copying the primitives of every leaf in one array and releasing the arena
+     */
+    void compact()
     {
-      for(typename std::list<std::vector<Primitive*> >::iterator it = nodes_primitives.begin(); it != nodes_primitives.end(); ++it)
+      nodes.assign(build_nodes.begin(), build_nodes.end());
+      BuildNodes().swap(build_nodes);
+
+      unsigned long size = 0;
+      for(unsigned int i = 0; i < nodes.size(); ++i)
       {
-        if(store == &(*it))
+        if(nodes[i].isLeaf() && !nodes[i].isDeferred())
         {
-          nodes_primitives.erase(it);
-          return;
+          size += arena[nodes[i].getPrimitivesOffset()].size();
+        }
+      }
+
+      leaf_primitives.clear();
+      leaf_primitives.reserve(size);
+      for(unsigned int i = 0; i < nodes.size(); ++i)
+      {
+        if(nodes[i].isLeaf() && !nodes[i].isDeferred())
+        {
+          unsigned int offset = leaf_primitives.size();
+          const std::vector<Primitive*>& store = arena[nodes[i].getPrimitivesOffset()];
+          leaf_primitives.insert(leaf_primitives.end(), store.begin(), store.end());
+          PrimitiveDispatch<Primitive>::group(leaf_primitives.begin() + offset, leaf_primitives.end());
+          nodes[i].setLeaf(offset, leaf_primitives.size() - offset);
         }
       }
+      arena.clear();
+      unused_primitives = 0;
+      buildLeafBlocks();
     }
     
     struct DefaultTraversal
@@ -256,8 +1339,50 @@ namespace IRT
       void updateTo(Stack& stack) const
       {
       }
+
+      void updateLeaf(unsigned int tests)
+      {
+      }
+
+      void updatePush()
+      {
+      }
     };
     
+    struct OcclusionTraversal
+    {
+      typedef bool Return;
+      typedef KDStack Stack;
+      Return returnFrom(Primitive* primitive)
+      {
+        return true;
+      }
+      Return defaultReturn()
+      {
+        return false;
+      }
+
+      void update()
+      {
+      }
+
+      void updateFrom(const Stack& stack)
+      {
+      }
+
+      void updateTo(Stack& stack) const
+      {
+      }
+
+      void updateLeaf(unsigned int tests)
+      {
+      }
+
+      void updatePush()
+      {
+      }
+    };
+
     struct HitLevelTraversal
     {
       typedef int Return;
@@ -292,21 +1417,90 @@ namespace IRT
       {
         stack.level = level;
       }
+
+      void updateLeaf(unsigned int tests)
+      {
+      }
+
+      void updatePush()
+      {
+      }
+    };
+
+    struct StatisticsTraversal
+    {
+      typedef TraversalStatistics Return;
+      typedef KDStack Stack;
+
+      Return returnFrom(Primitive* primitive)
+      {
+        return statistics;
+      }
+      TraversalStatistics statistics;
+      Return defaultReturn()
+      {
+        return statistics;
+      }
+
+      void update()
+      {
+        ++statistics.inner_nodes;
+      }
+
+      void updateFrom(const Stack& stack)
+      {
+      }
+
+      void updateTo(Stack& stack) const
+      {
+      }
+
+      void updateLeaf(unsigned int tests)
+      {
+        ++statistics.leaves;
+        statistics.intersection_tests += tests;
+      }
+
+      void updatePush()
+      {
+        ++statistics.pushes;
+      }
     };
     
     /**
      * Returns the first collision from a vector of Primitives
      * @param ray is the ray to test
-     * @param dist is the distance to the primitive
+     * @param hit is filled with the distance and the data of the hit
      * @return the index of the hit primitive, else -1
      */
     template<class TraversalStructure>
-    typename TraversalStructure::Return getFirstCollision(const Ray& ray, float& dist, float tnear, float tfar) const
+    typename TraversalStructure::Return getFirstCollision(const Ray& ray, HitRecord& hit, float tnear, float tfar) const
     {
       TraversalStructure traversal;
+      Mailbox<Primitive>& mailbox = getMailbox();
+      unsigned int ray_id = mailbox.newRay();
+
+      Primitive* primitive = traverse(traversal, ray, mailbox, ray_id, hit, tnear, tfar);
+      return primitive != NULL ? traversal.returnFrom(primitive) : traversal.defaultReturn();
+    }
+
+    /**
+     * Returns the first collision between two distances, going down the subtrees of the deferred leaves
+     * @param traversal is the traversal structure of the ray
+     * @param ray is the ray to test
+     * @param mailbox is the mailbox of the current thread
+     * @param ray_id is the identifier of the ray in the mailbox
+     * @param hit is filled with the distance and the data of the hit, its primitive being NULL if there is none
+     * @param tnear is the entry distance of the ray
+     * @param tfar is the exit distance of the ray
+     * @return the hit primitive, else NULL
+     */
+    template<class TraversalStructure>
+    Primitive* traverse(TraversalStructure& traversal, const Ray& ray, Mailbox<Primitive>& mailbox, unsigned int ray_id, HitRecord& hit, float tnear, float tfar) const
+    {
       typename TraversalStructure::Stack stack[50];
 
-      const KDTreeNode* current_node = &nodes[0];
+      const KDTreeNode* current_node = getRoot();
       int entrypoint = 0;
       int exitpoint = 1;
 
@@ -331,10 +1525,20 @@ namespace IRT
           current_node = splitNode<TraversalStructure>(ray, current_node, entrypoint, exitpoint, stack, traversal);
         }
 
-        Primitive* primitive = current_node->getFirstCollision(ray, dist);
-        if(primitive != NULL && dist <= stack[exitpoint].t)
+        Primitive* primitive;
+        if(current_node->isDeferred())
+        {
+          primitive = getSubtree(current_node)->traverse(traversal, ray, mailbox, ray_id, hit, stack[entrypoint].t, stack[exitpoint].t);
+        }
+        else
+        {
+          unsigned long avoided_tests = mailbox.getAvoidedTests();
+          primitive = current_node->getFirstCollision(getLeafPrimitives(), leaf_blocks, ray, mailbox, ray_id, hit);
+          traversal.updateLeaf(current_node->getPrimitivesCount() - (mailbox.getAvoidedTests() - avoided_tests));
+        }
+        if(primitive != NULL && hit.dist <= stack[exitpoint].t)
         {
-          return traversal.returnFrom(primitive);
+          return primitive;
         }
         entrypoint = exitpoint;
         current_node = stack[exitpoint].node;
@@ -342,9 +1546,84 @@ namespace IRT
         exitpoint = stack[exitpoint].previous;
       }
 
-      return traversal.defaultReturn();
+      hit.primitive = NULL;
+      return NULL;
     }
     
+    /**
+     * Tests if a ray hits any primitive, stopping at the first hit found
+     * @param ray is the ray to test
+     * @param tnear is the distance where the test starts
+     * @param tfar is the distance where the test stops
+     * @return true if a primitive is hit between tnear and tfar
+     */
+    template<class TraversalStructure>
+    typename TraversalStructure::Return testCollision(const Ray& ray, float tnear, float tfar) const
+    {
+      TraversalStructure traversal;
+      Mailbox<Primitive>& mailbox = getMailbox();
+      unsigned int ray_id = mailbox.newRay();
+
+      return traverseOcclusion(traversal, ray, mailbox, ray_id, tnear, tfar, tfar) ? traversal.returnFrom(NULL) : traversal.defaultReturn();
+    }
+
+    /**
+     * Tests if a ray hits any primitive between two distances, going down the subtrees of the deferred leaves
+     * @param max_dist is the distance after which hits are ignored
+     * @return true if a primitive is hit
+     */
+    template<class TraversalStructure>
+    bool traverseOcclusion(TraversalStructure& traversal, const Ray& ray, Mailbox<Primitive>& mailbox, unsigned int ray_id, float tnear, float tfar, float max_dist) const
+    {
+      typename TraversalStructure::Stack stack[50];
+
+      const KDTreeNode* current_node = getRoot();
+      int entrypoint = 0;
+      int exitpoint = 1;
+
+      stack[entrypoint].t = tnear;
+      if (tnear > 0.0f)
+      {
+        stack[entrypoint].pb = ray.origin() + ray.direction() * tnear;
+      }
+      else
+      {
+        stack[entrypoint].pb = ray.origin();
+      }
+      stack[exitpoint].t = tfar;
+      stack[exitpoint].pb = ray.origin() + ray.direction() * tfar;
+      stack[exitpoint].node = NULL;
+      traversal.updateTo(stack[entrypoint]);
+
+      while(current_node != NULL)
+      {
+        while(!current_node->isLeaf())
+        {
+          current_node = splitNode<TraversalStructure>(ray, current_node, entrypoint, exitpoint, stack, traversal);
+        }
+
+        bool hit;
+        if(current_node->isDeferred())
+        {
+          hit = getSubtree(current_node)->traverseOcclusion(traversal, ray, mailbox, ray_id, stack[entrypoint].t, stack[exitpoint].t, max_dist);
+        }
+        else
+        {
+          hit = current_node->testCollision(getLeafPrimitives(), leaf_blocks, ray, mailbox, ray_id, max_dist);
+        }
+        if(hit)
+        {
+          return true;
+        }
+        entrypoint = exitpoint;
+        current_node = stack[exitpoint].node;
+        traversal.updateFrom(stack[exitpoint]);
+        exitpoint = stack[exitpoint].previous;
+      }
+
+      return false;
+    }
+
     template<class TraversalStructure>
     const KDTreeNode* splitNode(const Ray& ray, const KDTreeNode* current_node, int& entrypoint, int& exitpoint, typename TraversalStructure::Stack* stack, TraversalStructure& traversal) const
     {
@@ -374,7 +1653,8 @@ namespace IRT
         far_node = current_node->leftNode();
         current_node = current_node->rightNode();
       }
-      DataType t = (splitpos - ray.origin()(axis)) / ray.direction()(axis);
+      DataType t = (splitpos - ray.origin()(axis)) * ray.invDirection()(axis);
+      traversal.updatePush();
       int tmp = exitpoint++;
       if (exitpoint == entrypoint)
       {
@@ -392,7 +1672,142 @@ namespace IRT
       
       return current_node;
     }
+
+    /**
+     * Returns the first collisions of a packet of rays sharing the same direction signs
+     * Rays that are not coherent are traced one by one.
+     * @param packet is the packet to test
+     * @param tnear is the entry distance of each ray
+     * @param tfar is the exit distance of each ray
+     * @param active indicates the rays to trace
+     * @param hits is filled with the record of the hit of each ray, its primitive being NULL if there is none
+     */
+    void getFirstCollisions(const RayPacket& packet, const RayPacket::Array& tnear, const RayPacket::Array& tfar, const RayPacket::Mask& active, HitRecord* hits) const
+    {
+      RayPacket::Array origin[3];
+      RayPacket::Array inv_direction[3];
+      bool negative[3];
+
+      for(unsigned int i = 0; i < RayPacket::size; ++i)
+      {
+        hits[i].primitive = NULL;
+      }
+
+      for(int axis = 0; axis < 3; ++axis)
+      {
+        RayPacket::Array direction;
+        for(unsigned int i = 0; i < RayPacket::size; ++i)
+        {
+          origin[axis](i) = packet[i].origin()(axis);
+          direction(i) = packet[i].direction()(axis);
+          inv_direction[axis](i) = packet[i].invDirection()(axis);
+        }
+
+        negative[axis] = ((direction < 0) && active).any();
+        if((negative[axis] && ((direction >= 0) && active).any()) || ((direction == 0) && active).any())
+        {
+          for(unsigned int i = 0; i < RayPacket::size; ++i)
+          {
+            if(active(i))
+            {
+              getFirstCollision<DefaultTraversal>(packet[i], hits[i], tnear(i), tfar(i));
+            }
+          }
+          return;
+        }
+      }
+
+      Mailbox<Primitive>& mailbox = getMailbox();
+      unsigned int ray_ids[RayPacket::size];
+      for(unsigned int i = 0; i < RayPacket::size; ++i)
+      {
+        ray_ids[i] = mailbox.newRay();
+      }
+
+      KDPacketStack stack[50];
+      int top = 0;
+      const KDTreeNode* current_node = getRoot();
+      RayPacket::Array current_tnear = tnear;
+      RayPacket::Array current_tfar = tfar;
+      RayPacket::Mask done = !active;
+      HitRecord hit;
+
+      while(true)
+      {
+        while(!current_node->isLeaf())
+        {
+          current_node = splitPacketNode(current_node, origin, inv_direction, negative, done, current_tnear, current_tfar, stack, top);
+        }
+
+        RayPacket::Mask alive = !done && (current_tnear <= current_tfar);
+        const KDTree* subtree = current_node->isDeferred() && alive.any() ? getSubtree(current_node) : NULL;
+        for(unsigned int i = 0; i < RayPacket::size; ++i)
+        {
+          if(alive(i))
+          {
+            Primitive* primitive;
+            if(subtree != NULL)
+            {
+              DefaultTraversal traversal;
+              primitive = subtree->traverse(traversal, packet[i], mailbox, ray_ids[i], hit, current_tnear(i), current_tfar(i));
+            }
+            else
+            {
+              primitive = current_node->getFirstCollision(getLeafPrimitives(), leaf_blocks, packet[i], mailbox, ray_ids[i], hit);
+            }
+            if(primitive != NULL && hit.dist <= current_tfar(i))
+            {
+              hits[i] = hit;
+              done(i) = true;
+            }
+          }
+        }
+
+        if(done.all() || top == 0)
+        {
+          return;
+        }
+        --top;
+        current_node = stack[top].node;
+        current_tnear = stack[top].tnear;
+        current_tfar = stack[top].tfar;
+      }
+    }
+
+    /**
+     * Selects the next node for a packet, pushing the far node on the stack when some rays need it
+     */
+    const KDTreeNode* splitPacketNode(const KDTreeNode* current_node, const RayPacket::Array* origin, const RayPacket::Array* inv_direction, const bool* negative, const RayPacket::Mask& done, RayPacket::Array& tnear, RayPacket::Array& tfar, KDPacketStack* stack, int& top) const
+    {
+      int axis = current_node->getAxis();
+      const KDTreeNode* near_node = negative[axis] ? current_node->rightNode() : current_node->leftNode();
+      const KDTreeNode* far_node = negative[axis] ? current_node->leftNode() : current_node->rightNode();
+
+      RayPacket::Array t = (current_node->getSplitPosition() - origin[axis]) * inv_direction[axis];
+      RayPacket::Mask inactive = done || (tnear > tfar);
+
+      if(((t < tnear) || inactive).all())
+      {
+        return far_node;
+      }
+      if(((t > tfar) || inactive).all())
+      {
+        return near_node;
+      }
+
+      stack[top].node = far_node;
+      stack[top].tnear = tnear.max(t);
+      stack[top].tfar = tfar;
+      ++top;
+      tfar = tfar.min(t);
+      return near_node;
+    }
   };
+
+  template<class Primitive>
+  const unsigned int KDTree<Primitive>::KDTreeNode::max_primitives_count;
+  template<class Primitive>
+  const unsigned int KDTree<Primitive>::KDTreeNode::max_left_offset;
 }
 
 #endif
@@ -9,12 +9,64 @@
 #include "IRT/build_kdtree.h"
 %}
 
+%include "std_vector.i"
+%template(ULongVector) std::vector<unsigned long>;
+
 namespace IRT
 {
+  struct TraversalStatistics
+  {
+    long inner_nodes;
+    long leaves;
+    long intersection_tests;
+    long pushes;
+  };
+
+  struct KDTreeCostModel
+  {
+    KDTreeCostModel(float traversal_cost = .3, float intersection_cost = 1., float empty_bonus = .2, bool leaf_termination = false);
+
+    float traversal_cost;
+    float intersection_cost;
+    float empty_bonus;
+    bool leaf_termination;
+  };
+
+  struct KDTreeQuality
+  {
+    unsigned long nodes;
+    unsigned long leaves;
+    unsigned long empty_leaves;
+    unsigned long max_depth;
+    float average_depth;
+    std::vector<unsigned long> leaf_sizes;
+    float duplication;
+    float empty_leaf_ratio;
+    float sah_cost;
+    unsigned long node_bytes;
+    unsigned long leaf_bytes;
+  };
+
+  template<class Primitive>
+  class KDTree
+  {
+  public:
+    KDTreeQuality getQuality(const BoundingBox& bb, const KDTreeCostModel& cost_model = KDTreeCostModel()) const;
+    unsigned long getNodeCount() const;
+    float getDegradation() const;
+    bool hasDeferredLeaves() const;
+    unsigned long getRefinedLeaves() const;
+  };
+
+  %template(PrimitiveKDTree) KDTree<IRT::Primitive>;
+
   struct BuildKDTree
   {
-    static void custom_build(IRT::SimpleScene* scene, int remaining_depth, int remaining_failures, float enhancement_ratio_failure);
-    static void automatic_build(IRT::SimpleScene* scene);
+    static void custom_build(IRT::SimpleScene* scene, int remaining_depth, int remaining_failures, float enhancement_ratio_failure, const KDTreeCostModel& cost_model = KDTreeCostModel());
+    static void automatic_build(IRT::SimpleScene* scene, const KDTreeCostModel& cost_model = KDTreeCostModel());
+    static void binned_build(IRT::SimpleScene* scene, unsigned int bins, int remaining_depth, int remaining_failures, float enhancement_ratio_failure, const KDTreeCostModel& cost_model = KDTreeCostModel());
+    static void automatic_binned_build(IRT::SimpleScene* scene, unsigned int bins, const KDTreeCostModel& cost_model = KDTreeCostModel());
+    static void lazy_build(IRT::SimpleScene* scene, int eager_depth, const KDTreeCostModel& cost_model = KDTreeCostModel());
   };
 }
 #endif /* SWIGPYTHON */
@@ -0,0 +1,195 @@
+/**
+ * \file leaf_blocks.cpp
+ * Implementation of the blocks of the kd-tree leaves
+ */
+
+#include "leaf_blocks.h"
+
+namespace IRT
+{
+  const unsigned int LeafBlocks<Primitive>::size;
+  const unsigned int LeafBlocks<Primitive>::min_run;
+  const unsigned int LeafBlocks<Primitive>::triangle_bits;
+  const unsigned int LeafBlocks<Primitive>::max_mesh_triangles;
+  const unsigned int LeafBlocks<Primitive>::max_meshes;
+  const unsigned int LeafBlocks<Primitive>::no_reference;
+  const unsigned int LeafBlocks<Primitive>::no_block;
+
+  void LeafBlocks<Primitive>::clear()
+  {
+    run_blocks.clear();
+    spheres.clear();
+    triangles.clear();
+    mesh_triangles.clear();
+    meshes.clear();
+  }
+
+  void LeafBlocks<Primitive>::addLeaf(Primitive* const* primitives, unsigned int offset, unsigned int count, const std::vector<Primitive*>& shared)
+  {
+    if(run_blocks.size() < offset + count)
+    {
+      run_blocks.resize(offset + count, no_block);
+    }
+
+    // The runs are split as PrimitiveDispatch does, so that each run it gives starts at a slot of this array
+    unsigned int end = offset + count;
+    unsigned int begin = offset;
+    while(begin != end)
+    {
+      Primitive::Type type = primitives[begin]->getType();
+      unsigned int run_end = begin + 1;
+      while(run_end != end && primitives[run_end]->getType() == type)
+      {
+        run_blocks[run_end++] = no_block;
+      }
+
+      run_blocks[begin] = no_block;
+      if(run_end - begin >= min_run)
+      {
+        switch(type)
+        {
+        case Primitive::SphereType:
+          run_blocks[begin] = spheres.size();
+          addSpheres(primitives + begin, run_end - begin, shared);
+          break;
+        case Primitive::TriangleType:
+          run_blocks[begin] = triangles.size();
+          addTriangles(primitives + begin, run_end - begin, shared);
+          break;
+        case Primitive::MeshTriangleType:
+          {
+            unsigned int first = mesh_triangles.size();
+            if(addMeshTriangles(primitives + begin, run_end - begin, shared))
+            {
+              run_blocks[begin] = first;
+            }
+          }
+          break;
+        default:
+          break;
+        }
+      }
+      begin = run_end;
+    }
+  }
+
+  void LeafBlocks<Primitive>::removeLeaf(unsigned int offset, unsigned int count)
+  {
+    for(unsigned int i = offset; i < offset + count && i < run_blocks.size(); ++i)
+    {
+      run_blocks[i] = no_block;
+    }
+  }
+
+  void LeafBlocks<Primitive>::addSpheres(Primitive* const* begin, unsigned int count, const std::vector<Primitive*>& shared)
+  {
+    SphereBlock block;
+    for(unsigned int i = 0; i < count; i += size)
+    {
+      block.center_x.setZero();
+      block.center_y.setZero();
+      block.center_z.setZero();
+      block.radius2.setConstant(-std::numeric_limits<DataType>::max());
+      block.shared = 0;
+      for(unsigned int j = 0; j < size && i + j < count; ++j)
+      {
+        const Sphere* sphere = static_cast<const Sphere*>(begin[i + j]);
+        block.center_x(j) = sphere->getCenter()(0);
+        block.center_y(j) = sphere->getCenter()(1);
+        block.center_z(j) = sphere->getCenter()(2);
+        block.radius2(j) = sphere->getRadius() * sphere->getRadius();
+        if(std::binary_search(shared.begin(), shared.end(), begin[i + j]))
+        {
+          block.shared |= 1U << j;
+        }
+      }
+      spheres.push_back(block);
+    }
+  }
+
+  void LeafBlocks<Primitive>::addTriangles(Primitive* const* begin, unsigned int count, const std::vector<Primitive*>& shared)
+  {
+    TriangleBlock block;
+    for(unsigned int i = 0; i < count; i += size)
+    {
+      block.normal_x.setZero();
+      block.normal_y.setZero();
+      block.normal_z.setZero();
+      block.distance.setZero();
+      block.u_x.setZero();
+      block.u_y.setZero();
+      block.u_z.setZero();
+      block.u_offset.setZero();
+      block.v_x.setZero();
+      block.v_y.setZero();
+      block.v_z.setZero();
+      block.v_offset.setZero();
+      block.shared = 0;
+      for(unsigned int j = 0; j < size && i + j < count; ++j)
+      {
+        const Triangle* triangle = static_cast<const Triangle*>(begin[i + j]);
+        const TriangleRecord& record = triangle->getRecord();
+        block.normal_x(j) = record.normal(0);
+        block.normal_y(j) = record.normal(1);
+        block.normal_z(j) = record.normal(2);
+        block.distance(j) = record.distance;
+        block.u_x(j) = record.u_axis(0);
+        block.u_y(j) = record.u_axis(1);
+        block.u_z(j) = record.u_axis(2);
+        block.u_offset(j) = record.u_offset;
+        block.v_x(j) = record.v_axis(0);
+        block.v_y(j) = record.v_axis(1);
+        block.v_z(j) = record.v_axis(2);
+        block.v_offset(j) = record.v_offset;
+        if(std::binary_search(shared.begin(), shared.end(), begin[i + j]))
+        {
+          block.shared |= 1U << j;
+        }
+      }
+      triangles.push_back(block);
+    }
+  }
+
+  bool LeafBlocks<Primitive>::addMeshTriangles(Primitive* const* begin, unsigned int count, const std::vector<Primitive*>& shared)
+  {
+    std::vector<unsigned int> references(count);
+    unsigned int previous_meshes = meshes.size();
+    for(unsigned int i = 0; i < count; ++i)
+    {
+      const MeshTriangle* triangle = static_cast<const MeshTriangle*>(begin[i]);
+      std::vector<const TriangleMesh*>::const_iterator mesh = std::find(meshes.begin(), meshes.end(), triangle->getMesh());
+      if(mesh == meshes.end())
+      {
+        if(meshes.size() == max_meshes)
+        {
+          meshes.resize(previous_meshes);
+          return false;
+        }
+        meshes.push_back(triangle->getMesh());
+        mesh = meshes.end() - 1;
+      }
+      if(triangle->getIndex() >= max_mesh_triangles)
+      {
+        meshes.resize(previous_meshes);
+        return false;
+      }
+      references[i] = (static_cast<unsigned int>(mesh - meshes.begin()) << triangle_bits) | triangle->getIndex();
+    }
+
+    MeshBlock block;
+    for(unsigned int i = 0; i < count; i += size)
+    {
+      block.shared = 0;
+      for(unsigned int j = 0; j < size; ++j)
+      {
+        block.references[j] = i + j < count ? references[i + j] : no_reference;
+        if(i + j < count && std::binary_search(shared.begin(), shared.end(), begin[i + j]))
+        {
+          block.shared |= 1U << j;
+        }
+      }
+      mesh_triangles.push_back(block);
+    }
+    return true;
+  }
+}
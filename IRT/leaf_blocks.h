@@ -0,0 +1,449 @@
+/**
+ * \file leaf_blocks.h
+ * Copies of the spheres and triangles of the kd-tree leaves, stored by blocks to be intersected several at a time
+ */
+
+#ifndef LEAFBLOCKS
+#define LEAFBLOCKS
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+#include "common.h"
+#include "ray.h"
+#include "mailbox.h"
+#include "primitive_dispatch.h"
+
+namespace IRT
+{
+  /**
+   * Intersects the runs of primitives of a leaf by blocks
+   * The generic version has no block, all the runs being tested one primitive at a time.
+   */
+  template<class Primitive>
+  class LeafBlocks
+  {
+  public:
+    /// Removes all the blocks
+    void clear()
+    {
+    }
+
+    /**
+     * Copies the primitives of a leaf in blocks
+     * @param primitives is the leaf primitives array of the tree
+     * @param offset is the offset of the leaf in the array
+     * @param count is the number of primitives of the leaf
+     * @param shared is the sorted list of the primitives that a ray may test in other leaves, the only ones checked against the mailbox
+     */
+    void addLeaf(Primitive* const* primitives, unsigned int offset, unsigned int count, const std::vector<Primitive*>& shared)
+    {
+    }
+
+    /**
+     * Stops using the blocks of a leaf whose primitives changed, its runs being tested one primitive at a time until the blocks are rebuilt
+     * @param offset is the offset of the leaf in the leaf primitives array
+     * @param count is the number of primitives of the leaf
+     */
+    void removeLeaf(unsigned int offset, unsigned int count)
+    {
+    }
+
+    /**
+     * Finds the closest hit in a run of primitives
+     * @param primitives is the leaf primitives array of the tree
+     * @param slot is the index of the first primitive of the run in the leaf primitives array
+     * @param count is the number of primitives of the run
+     * @param ray is the ray to test
+     * @param mailbox is the mailbox of the current thread, the primitives already tested by the ray not being tested again
+     * @param ray_id is the identifier of the ray in the mailbox
+     * @param hit is the record of the closest hit so far, its distance and its data being updated if a closer hit is found
+     * @param index is the index in the run of the closer hit, -1 if there is none
+     * @return false if the run has no block and must be tested one primitive at a time
+     */
+    template<class Intersection>
+    bool firstCollision(const Intersection*, Primitive* const* primitives, unsigned int slot, unsigned int count, const Ray& ray, Mailbox<Primitive>& mailbox, unsigned int ray_id, HitRecord& hit, int& index) const
+    {
+      return false;
+    }
+
+    /**
+     * Tests if a primitive of a run is hit before a distance
+     * @param hit is true if a primitive is hit
+     * @return false if the run has no block and must be tested one primitive at a time
+     */
+    template<class Intersection>
+    bool testCollision(const Intersection*, Primitive* const* primitives, unsigned int slot, unsigned int count, const Ray& ray, Mailbox<Primitive>& mailbox, unsigned int ray_id, DataType max_dist, bool& hit) const
+    {
+      return false;
+    }
+  };
+
+  /**
+   * The blocks of the spheres and of the triangles, each block holding four primitives in a single SSE register per constant
+   * The triangles of a mesh are not copied: their blocks hold 32-bit references, the index of the mesh in a table in the high bits and the index of the triangle in the mesh in the low bits, the corners being read from the arrays of the mesh.
+   */
+  template<>
+  class LeafBlocks<Primitive>
+  {
+  public:
+    /// Number of primitives in a block
+    static const unsigned int size = 4;
+    /// One value per primitive, vectorized by Eigen
+    typedef Eigen::Array<DataType, size, 1> Array;
+    /// One flag per primitive
+    typedef Eigen::Array<bool, size, 1> Mask;
+    /// Runs shorter than this are tested one primitive at a time
+    static const unsigned int min_run = 4;
+    /// Number of low bits of a mesh reference holding the index of the triangle
+    static const unsigned int triangle_bits = 24;
+    /// At most this number of triangles per mesh and of meshes can be referenced, the runs of the other triangles being tested one primitive at a time
+    static const unsigned int max_mesh_triangles = 1U << triangle_bits;
+    static const unsigned int max_meshes = (1U << (32 - triangle_bits)) - 1;
+
+  private:
+    /// Spheres, the unused places having a negative squared radius
+    struct SphereBlock
+    {
+      Array center_x;
+      Array center_y;
+      Array center_z;
+      Array radius2;
+      /// Bit j is set if the sphere j is shared with other leaves
+      unsigned int shared;
+    };
+
+    /// Triangle records, the unused places having a null normal, the back-face culling flags being read from the triangles
+    struct TriangleBlock
+    {
+      Array normal_x;
+      Array normal_y;
+      Array normal_z;
+      Array distance;
+      Array u_x;
+      Array u_y;
+      Array u_z;
+      Array u_offset;
+      Array v_x;
+      Array v_y;
+      Array v_z;
+      Array v_offset;
+      /// Bit j is set if the triangle j is shared with other leaves
+      unsigned int shared;
+    };
+
+    /// References to triangles of meshes, the unused places holding no_reference
+    struct MeshBlock
+    {
+      unsigned int references[size];
+      /// Bit j is set if the triangle j is shared with other leaves
+      unsigned int shared;
+    };
+
+    /// Reference of the unused places of a mesh block, its mesh index being past max_meshes
+    static const unsigned int no_reference = ~0U;
+
+    /// Value of run_blocks for the slots that do not start a run with blocks
+    static const unsigned int no_block = ~0U;
+
+    /// For each slot of the leaf primitives array starting a run with blocks, the index of its first block
+    std::vector<unsigned int> run_blocks;
+    std::vector<SphereBlock, Eigen::aligned_allocator<SphereBlock> > spheres;
+    std::vector<TriangleBlock, Eigen::aligned_allocator<TriangleBlock> > triangles;
+    std::vector<MeshBlock> mesh_triangles;
+    /// The meshes referenced by the mesh blocks
+    std::vector<const TriangleMesh*> meshes;
+
+    /// Returns the first block of a run, or no_block
+    unsigned int getBlock(unsigned int slot) const
+    {
+      return slot < run_blocks.size() ? run_blocks[slot] : no_block;
+    }
+
+    /// Copies a run of spheres
+    void addSpheres(Primitive* const* begin, unsigned int count, const std::vector<Primitive*>& shared);
+    /// Copies a run of triangles
+    void addTriangles(Primitive* const* begin, unsigned int count, const std::vector<Primitive*>& shared);
+    /// References a run of triangles of meshes, returning false without adding a block if one of them cannot be referenced
+    bool addMeshTriangles(Primitive* const* begin, unsigned int count, const std::vector<Primitive*>& shared);
+
+    /**
+     * Intersects a ray with a block of spheres
+     * @param dist is the distance of each hit
+     * @param u and v are the barycentric coordinates of each hit, none for spheres
+     * @param back is set to the places hit on a back face, none for spheres
+     * @return the places hit, as Sphere::intersect() returns them
+     */
+    static Mask intersect(const SphereBlock& block, const Ray& ray, Array& dist, Array& u, Array& v, Mask& back)
+    {
+      back.setConstant(false);
+      u.setZero();
+      v.setZero();
+      Array x = ray.origin()(0) - block.center_x;
+      Array y = ray.origin()(1) - block.center_y;
+      Array z = ray.origin()(2) - block.center_z;
+      Array B = -(ray.direction()(0) * x + ray.direction()(1) * y + ray.direction()(2) * z);
+      Array C = x * x + y * y + z * z - block.radius2;
+      Array delta = B * B - C;
+
+      Array disc = delta.max(0).sqrt();
+      dist = B - disc;
+      dist = (dist < 0).select(B + disc, dist);
+      return delta >= 0;
+    }
+
+    /// Intersects a ray with a block of triangles on both faces, as TriangleRecord::intersect() does without culling
+    static Mask intersect(const TriangleBlock& block, const Ray& ray, Array& dist, Array& u, Array& v, Mask& back)
+    {
+      Array coeff = ray.direction()(0) * block.normal_x + ray.direction()(1) * block.normal_y + ray.direction()(2) * block.normal_z;
+      back = coeff > 0;
+
+      dist = (block.distance - (ray.origin()(0) * block.normal_x + ray.origin()(1) * block.normal_y + ray.origin()(2) * block.normal_z)) / coeff;
+      Array x = ray.origin()(0) + ray.direction()(0) * dist;
+      Array y = ray.origin()(1) + ray.direction()(1) * dist;
+      Array z = ray.origin()(2) + ray.direction()(2) * dist;
+      u = block.u_x * x + block.u_y * y + block.u_z * z - block.u_offset;
+      v = block.v_x * x + block.v_y * y + block.v_z * z - block.v_offset;
+
+      return (coeff.abs() >= std::numeric_limits<DataType>::epsilon()) && (u >= 0) && (v >= 0) && (u + v < 1);
+    }
+
+    /// Intersects a ray with a block of mesh triangles on both faces, the corners being gathered from the meshes for the test of TriangleMesh::intersect()
+    Mask intersect(const MeshBlock& block, const Ray& ray, Array& dist, Array& u, Array& v, Mask& back) const
+    {
+      Array corner_x, corner_y, corner_z;
+      Array edge1_x, edge1_y, edge1_z;
+      Array edge2_x, edge2_y, edge2_z;
+      for(unsigned int j = 0; j < size; ++j)
+      {
+        unsigned int reference = block.references[j];
+        if(reference == no_reference)
+        {
+          // Null edges, the determinant of the unused places being null
+          corner_x(j) = corner_y(j) = corner_z(j) = 0;
+          edge1_x(j) = edge1_y(j) = edge1_z(j) = 0;
+          edge2_x(j) = edge2_y(j) = edge2_z(j) = 0;
+          continue;
+        }
+        const TriangleMesh* mesh = meshes[reference >> triangle_bits];
+        unsigned int triangle = reference & (max_mesh_triangles - 1);
+        const Point3df& corner1 = mesh->getCorner(triangle, 0);
+        const Point3df& corner2 = mesh->getCorner(triangle, 1);
+        const Point3df& corner3 = mesh->getCorner(triangle, 2);
+        corner_x(j) = corner1(0);
+        corner_y(j) = corner1(1);
+        corner_z(j) = corner1(2);
+        edge1_x(j) = corner2(0) - corner1(0);
+        edge1_y(j) = corner2(1) - corner1(1);
+        edge1_z(j) = corner2(2) - corner1(2);
+        edge2_x(j) = corner3(0) - corner1(0);
+        edge2_y(j) = corner3(1) - corner1(1);
+        edge2_z(j) = corner3(2) - corner1(2);
+      }
+
+      DataType dir_x = ray.direction()(0);
+      DataType dir_y = ray.direction()(1);
+      DataType dir_z = ray.direction()(2);
+      Array p_x = dir_y * edge2_z - dir_z * edge2_y;
+      Array p_y = dir_z * edge2_x - dir_x * edge2_z;
+      Array p_z = dir_x * edge2_y - dir_y * edge2_x;
+      Array det = edge1_x * p_x + edge1_y * p_y + edge1_z * p_z;
+      back = det < 0;
+      Mask valid = det != 0;
+      Array inv_det = valid.select(det, Array::Ones()).inverse();
+
+      Array s_x = ray.origin()(0) - corner_x;
+      Array s_y = ray.origin()(1) - corner_y;
+      Array s_z = ray.origin()(2) - corner_z;
+      v = (s_x * p_x + s_y * p_y + s_z * p_z) * inv_det;
+      Array q_x = s_y * edge1_z - s_z * edge1_y;
+      Array q_y = s_z * edge1_x - s_x * edge1_z;
+      Array q_z = s_x * edge1_y - s_y * edge1_x;
+      u = (dir_x * q_x + dir_y * q_y + dir_z * q_z) * inv_det;
+      dist = (edge2_x * q_x + edge2_y * q_y + edge2_z * q_z) * inv_det;
+
+      return valid && (u >= 0) && (v >= 0) && (u + v < 1);
+    }
+
+    /// Spheres have no back face
+    void cullBackFaces(const SphereBlock& block, Primitive* const* begin, const Mask& back, Mask& hit) const
+    {
+    }
+
+    /// Removes the hits on the back faces of the triangles that cull them, the flag being read from each triangle so that it can change after the build
+    void cullBackFaces(const TriangleBlock& block, Primitive* const* begin, const Mask& back, Mask& hit) const
+    {
+      // The unused places of a block are never hit
+      for(unsigned int j = 0; j < size; ++j)
+      {
+        if(back(j) && hit(j) && static_cast<const Triangle*>(begin[j])->getBackFaceCulling())
+        {
+          hit(j) = false;
+        }
+      }
+    }
+
+    /// Removes the hits on the back faces of the triangles whose mesh culls them, the flag being read from the mesh of each reference
+    void cullBackFaces(const MeshBlock& block, Primitive* const* begin, const Mask& back, Mask& hit) const
+    {
+      for(unsigned int j = 0; j < size; ++j)
+      {
+        if(back(j) && hit(j) && meshes[block.references[j] >> triangle_bits]->getBackFaceCulling())
+        {
+          hit(j) = false;
+        }
+      }
+    }
+
+    /**
+     * Intersects a ray with a block of a run
+     * The results of the shared primitives go through the mailbox, those already tested by the ray being replaced by their previous results. The other primitives are only in this leaf and cannot have been tested.
+     * @param begin is the first primitive of the block in the leaf primitives array
+     * @param count is the number of primitives in the block
+     * @param dist, u and v are the distance and the barycentric coordinates of each hit
+     * @return the places hit between the ray origin and max_dist
+     */
+    template<class Block>
+    Mask intersect(const Block& block, Primitive* const* begin, unsigned int count, const Ray& ray, Mailbox<Primitive>& mailbox, unsigned int ray_id, DataType max_dist, Array& dist, Array& u, Array& v) const
+    {
+      Mask back;
+      Mask hit = intersect(block, ray, dist, u, v, back);
+      if((back && hit).any())
+      {
+        cullBackFaces(block, begin, back, hit);
+      }
+
+      if(block.shared != 0)
+      {
+        bool shared_hit[size];
+        DataType shared_dist[size];
+        DataType shared_u[size];
+        DataType shared_v[size];
+        for(unsigned int j = 0; j < size; ++j)
+        {
+          shared_hit[j] = hit(j);
+          shared_dist[j] = dist(j);
+          shared_u[j] = u(j);
+          shared_v[j] = v(j);
+        }
+        for(unsigned int j = 0; j < count; ++j)
+        {
+          if(block.shared & (1U << j))
+          {
+            mailbox.record(begin[j], ray_id, shared_hit[j], shared_dist[j], shared_u[j], shared_v[j]);
+          }
+        }
+        for(unsigned int j = 0; j < size; ++j)
+        {
+          hit(j) = shared_hit[j];
+          dist(j) = shared_dist[j];
+          u(j) = shared_u[j];
+          v(j) = shared_v[j];
+        }
+      }
+      return hit && (dist > 0.0001f) && (dist < max_dist);
+    }
+
+    /// Reduces the blocks of a run to their closest hit, the barycentric coordinates of the kernel being kept in the record
+    template<class Blocks>
+    bool firstBlockCollision(const Blocks& blocks, Primitive* const* primitives, unsigned int slot, unsigned int count, const Ray& ray, Mailbox<Primitive>& mailbox, unsigned int ray_id, HitRecord& record, int& index) const
+    {
+      unsigned int first = getBlock(slot);
+      if(first == no_block)
+      {
+        return false;
+      }
+
+      index = -1;
+      for(unsigned int i = 0; i * size < count; ++i)
+      {
+        Array block_dist;
+        Array block_u;
+        Array block_v;
+        Mask hit = intersect(blocks[first + i], primitives + slot + i * size, std::min(size, count - i * size), ray, mailbox, ray_id, record.dist, block_dist, block_u, block_v);
+        if(hit.any())
+        {
+          int place;
+          record.dist = hit.select(block_dist, record.dist).minCoeff(&place);
+          record.u = block_u(place);
+          record.v = block_v(place);
+          index = i * size + place;
+        }
+      }
+      return true;
+    }
+
+    /// Stops at the first block of a run with a hit
+    template<class Blocks>
+    bool testBlockCollision(const Blocks& blocks, Primitive* const* primitives, unsigned int slot, unsigned int count, const Ray& ray, Mailbox<Primitive>& mailbox, unsigned int ray_id, DataType max_dist, bool& hit) const
+    {
+      unsigned int first = getBlock(slot);
+      if(first == no_block)
+      {
+        return false;
+      }
+
+      hit = false;
+      for(unsigned int i = 0; !hit && i * size < count; ++i)
+      {
+        Array block_dist;
+        Array block_u;
+        Array block_v;
+        hit = intersect(blocks[first + i], primitives + slot + i * size, std::min(size, count - i * size), ray, mailbox, ray_id, max_dist, block_dist, block_u, block_v).any();
+      }
+      return true;
+    }
+
+  public:
+    _export_tools void clear();
+
+    _export_tools void addLeaf(Primitive* const* primitives, unsigned int offset, unsigned int count, const std::vector<Primitive*>& shared);
+
+    _export_tools void removeLeaf(unsigned int offset, unsigned int count);
+
+    template<class Intersection>
+    bool firstCollision(const Intersection*, Primitive* const* primitives, unsigned int slot, unsigned int count, const Ray& ray, Mailbox<Primitive>& mailbox, unsigned int ray_id, HitRecord& hit, int& index) const
+    {
+      return false;
+    }
+
+    bool firstCollision(const DirectIntersection<Sphere>*, Primitive* const* primitives, unsigned int slot, unsigned int count, const Ray& ray, Mailbox<Primitive>& mailbox, unsigned int ray_id, HitRecord& hit, int& index) const
+    {
+      return firstBlockCollision(spheres, primitives, slot, count, ray, mailbox, ray_id, hit, index);
+    }
+
+    bool firstCollision(const DirectIntersection<Triangle>*, Primitive* const* primitives, unsigned int slot, unsigned int count, const Ray& ray, Mailbox<Primitive>& mailbox, unsigned int ray_id, HitRecord& hit, int& index) const
+    {
+      return firstBlockCollision(triangles, primitives, slot, count, ray, mailbox, ray_id, hit, index);
+    }
+
+    bool firstCollision(const DirectIntersection<MeshTriangle>*, Primitive* const* primitives, unsigned int slot, unsigned int count, const Ray& ray, Mailbox<Primitive>& mailbox, unsigned int ray_id, HitRecord& hit, int& index) const
+    {
+      return firstBlockCollision(mesh_triangles, primitives, slot, count, ray, mailbox, ray_id, hit, index);
+    }
+
+    template<class Intersection>
+    bool testCollision(const Intersection*, Primitive* const* primitives, unsigned int slot, unsigned int count, const Ray& ray, Mailbox<Primitive>& mailbox, unsigned int ray_id, DataType max_dist, bool& hit) const
+    {
+      return false;
+    }
+
+    bool testCollision(const DirectIntersection<Sphere>*, Primitive* const* primitives, unsigned int slot, unsigned int count, const Ray& ray, Mailbox<Primitive>& mailbox, unsigned int ray_id, DataType max_dist, bool& hit) const
+    {
+      return testBlockCollision(spheres, primitives, slot, count, ray, mailbox, ray_id, max_dist, hit);
+    }
+
+    bool testCollision(const DirectIntersection<Triangle>*, Primitive* const* primitives, unsigned int slot, unsigned int count, const Ray& ray, Mailbox<Primitive>& mailbox, unsigned int ray_id, DataType max_dist, bool& hit) const
+    {
+      return testBlockCollision(triangles, primitives, slot, count, ray, mailbox, ray_id, max_dist, hit);
+    }
+
+    bool testCollision(const DirectIntersection<MeshTriangle>*, Primitive* const* primitives, unsigned int slot, unsigned int count, const Ray& ray, Mailbox<Primitive>& mailbox, unsigned int ray_id, DataType max_dist, bool& hit) const
+    {
+      return testBlockCollision(mesh_triangles, primitives, slot, count, ray, mailbox, ray_id, max_dist, hit);
+    }
+  };
+}
+
+#endif
@@ -21,4 +21,9 @@ namespace IRT
   {
     return center;
   }
+
+  const Color& Light::getColor() const
+  {
+    return color;
+  }
 }
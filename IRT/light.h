@@ -41,6 +41,11 @@ namespace IRT
      * Resturns the center of the light
      */
     _export_tools const Vector3df& getCenter() const;
+
+    /**
+     * Returns the color of the light at its center
+     */
+    _export_tools const Color& getColor() const;
   };
 }
 
@@ -0,0 +1,190 @@
+/**
+ * \file mailbox.h
+ * Per-thread record of the last intersection tests done for a ray
+ */
+
+#ifndef MAILBOX
+#define MAILBOX
+
+#include <cstddef>
+
+#include "common.h"
+#include "ray.h"
+#include "primitives.h"
+
+namespace IRT
+{
+  /**
+   * Hashed mailbox: remembers for a set of primitives the last ray that tested them and the result of the test
+   * A primitive that straddles several leaves is then intersected only once per ray.
+   */
+  template<class Primitive>
+  class Mailbox
+  {
+  public:
+    /// Number of slots, a power of two
+    static const unsigned int size = 64;
+
+  private:
+    struct Entry
+    {
+      /// The tested primitive
+      const Primitive* primitive;
+      /// The ray that tested it
+      unsigned int ray;
+      /// Result of the test
+      bool hit;
+      /// Distance and data of the hit
+      HitRecord record;
+    };
+
+    /// The intersection through the virtual table
+    struct VirtualTest
+    {
+      static bool intersect(const Primitive* primitive, const Ray& ray, HitRecord& hit)
+      {
+        return primitive->intersect(ray, hit);
+      }
+    };
+
+    Entry entries[size];
+    /// Last ray identifier given
+    unsigned int last_ray;
+    /// Number of intersection tests that were skipped
+    unsigned long avoided_tests;
+
+    /// Returns the slot of a primitive
+    Entry& getEntry(const Primitive* primitive)
+    {
+      return entries[(reinterpret_cast<std::size_t>(primitive) / sizeof(void*)) & (size - 1)];
+    }
+
+    /// Empties all the slots
+    void reset()
+    {
+      for(unsigned int i = 0; i < size; ++i)
+      {
+        entries[i].primitive = NULL;
+        entries[i].ray = 0;
+      }
+    }
+
+  public:
+    Mailbox()
+    :last_ray(0), avoided_tests(0)
+    {
+      reset();
+    }
+
+    /**
+     * Returns a new ray identifier
+     * @return the identifier, never 0
+     */
+    unsigned int newRay()
+    {
+      if(++last_ray == 0)
+      {
+        reset();
+        last_ray = 1;
+      }
+      return last_ray;
+    }
+
+    /**
+     * Tests if a ray intersects the primitive, reusing the previous result if this ray already tested it
+     * @param primitive is the primitive to test
+     * @param ray is the ray to test
+     * @param ray_id is the identifier of the ray given by newRay()
+     * @param dist is an output argument that will contain the distance between the ray origin and the primitive
+     * @return True or False depending on the result of the test
+     */
+    bool intersect(const Primitive* primitive, const Ray& ray, unsigned int ray_id, DataType& dist)
+    {
+      return intersect<VirtualTest>(primitive, ray, ray_id, dist);
+    }
+
+    /**
+     * Tests if a ray intersects the primitive with a given intersection, reusing the previous result if this ray already tested it
+     * @param Intersection has a static intersect(primitive, ray, hit), for instance a direct call for a known concrete type
+     */
+    template<class Intersection>
+    bool intersect(const Primitive* primitive, const Ray& ray, unsigned int ray_id, DataType& dist)
+    {
+      const HitRecord* hit = intersect<Intersection>(primitive, ray, ray_id);
+      if(hit == NULL)
+      {
+        return false;
+      }
+      dist = hit->dist;
+      return true;
+    }
+
+    /**
+     * Tests if a ray intersects the primitive with a given intersection, reusing the previous record if this ray already tested it
+     * @param primitive is the primitive to test
+     * @param ray is the ray to test
+     * @param ray_id is the identifier of the ray given by newRay()
+     * @return the distance and the data of the hit, valid until the next test, else NULL
+     */
+    template<class Intersection>
+    const HitRecord* intersect(const Primitive* primitive, const Ray& ray, unsigned int ray_id)
+    {
+      Entry& entry = getEntry(primitive);
+      if(entry.primitive == primitive && entry.ray == ray_id)
+      {
+        ++avoided_tests;
+        return entry.hit ? &entry.record : NULL;
+      }
+
+      entry.primitive = primitive;
+      entry.ray = ray_id;
+      entry.hit = Intersection::intersect(primitive, ray, entry.record);
+      return entry.hit ? &entry.record : NULL;
+    }
+
+    /**
+     * Records the result of a test done outside of intersect(), for the primitives tested several at a time
+     * If the ray already tested the primitive, the previous result is kept and returned instead, the test counting as skipped.
+     * @param hit is the result of the test, replaced by the previous one
+     * @param dist is the distance of the hit, replaced by the previous one
+     * @param u is the barycentric coordinate along the third corner of a triangle, replaced by the previous one
+     * @param v is the barycentric coordinate along the second corner of a triangle, replaced by the previous one
+     * @return true if the ray already tested the primitive
+     */
+    bool record(const Primitive* primitive, unsigned int ray_id, bool& hit, DataType& dist, DataType& u, DataType& v)
+    {
+      Entry& entry = getEntry(primitive);
+      if(entry.primitive == primitive && entry.ray == ray_id)
+      {
+        ++avoided_tests;
+        hit = entry.hit;
+        dist = entry.record.dist;
+        u = entry.record.u;
+        v = entry.record.v;
+        return true;
+      }
+
+      entry.primitive = primitive;
+      entry.ray = ray_id;
+      entry.hit = hit;
+      entry.record.dist = dist;
+      entry.record.u = u;
+      entry.record.v = v;
+      return false;
+    }
+
+    /// Returns the number of intersection tests that were skipped
+    unsigned long getAvoidedTests() const
+    {
+      return avoided_tests;
+    }
+
+    /// Resets the number of skipped tests
+    void resetAvoidedTests()
+    {
+      avoided_tests = 0;
+    }
+  };
+}
+
+#endif
@@ -0,0 +1,95 @@
+/**
+ * \file mapped_file.cpp
+ * Implementation of the files mapped in memory
+ */
+
+#include <stdexcept>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "mapped_file.h"
+
+namespace IRT
+{
+#ifdef _WIN32
+  MappedFile::MappedFile(const std::string& filename)
+  :data(NULL), size(0), file(INVALID_HANDLE_VALUE), mapping(NULL)
+  {
+    file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(file == INVALID_HANDLE_VALUE)
+      throw std::runtime_error("Cannot open " + filename);
+
+    size = GetFileSize(file, NULL);
+    if(size == 0)
+    {
+      CloseHandle(file);
+      throw std::runtime_error("Empty file " + filename);
+    }
+
+    mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if(mapping != NULL)
+    {
+      data = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+    }
+    if(data == NULL)
+    {
+      if(mapping != NULL)
+        CloseHandle(mapping);
+      CloseHandle(file);
+      throw std::runtime_error("Cannot map " + filename);
+    }
+  }
+
+  MappedFile::~MappedFile()
+  {
+    UnmapViewOfFile(data);
+    CloseHandle(mapping);
+    CloseHandle(file);
+  }
+#else
+  MappedFile::MappedFile(const std::string& filename)
+  :data(NULL), size(0)
+  {
+    int descriptor = open(filename.c_str(), O_RDONLY);
+    if(descriptor == -1)
+      throw std::runtime_error("Cannot open " + filename);
+
+    struct stat status;
+    if(fstat(descriptor, &status) == -1 || status.st_size == 0)
+    {
+      close(descriptor);
+      throw std::runtime_error("Empty file " + filename);
+    }
+    size = status.st_size;
+
+    void* address = mmap(NULL, size, PROT_READ, MAP_SHARED, descriptor, 0);
+    // The mapping stays valid once the descriptor is closed
+    close(descriptor);
+    if(address == MAP_FAILED)
+      throw std::runtime_error("Cannot map " + filename);
+    data = static_cast<const char*>(address);
+  }
+
+  MappedFile::~MappedFile()
+  {
+    munmap(const_cast<char*>(data), size);
+  }
+#endif
+
+  const char* MappedFile::getData() const
+  {
+    return data;
+  }
+
+  unsigned long MappedFile::getSize() const
+  {
+    return size;
+  }
+}
@@ -0,0 +1,52 @@
+/**
+ * \file mapped_file.h
+ * Describes a read-only file mapped in memory
+ */
+
+#ifndef MAPPEDFILE
+#define MAPPEDFILE
+
+#include <string>
+
+#include "common.h"
+
+namespace IRT
+{
+  /// A file mapped read-only in memory, its pages being shared by all the processes that map it
+  class MappedFile
+  {
+  private:
+    /// Beginning of the mapping
+    const char* data;
+    /// Size of the file
+    unsigned long size;
+#ifdef _WIN32
+    /// Handle of the file
+    void* file;
+    /// Handle of the mapping
+    void* mapping;
+#endif
+
+    MappedFile(const MappedFile& file);
+    MappedFile& operator=(const MappedFile& file);
+
+  public:
+    /**
+     * Maps a file
+     * @param filename is the name of the file to map
+     * @throw std::runtime_error if the file cannot be opened or mapped
+     */
+    _export_tools MappedFile(const std::string& filename);
+
+    /// Destructor, unmaps the file
+    _export_tools ~MappedFile();
+
+    /// Returns the beginning of the file
+    _export_tools const char* getData() const;
+
+    /// Returns the size of the file
+    _export_tools unsigned long getSize() const;
+  };
+}
+
+#endif
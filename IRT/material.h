@@ -0,0 +1,42 @@
+/**
+ * \file material.h
+ * Describes the shading parameters shared by the primitives
+ */
+
+#ifndef MATERIAL
+#define MATERIAL
+
+#include "common.h"
+
+namespace IRT
+{
+  /// Shading parameters, stored once in the material table of the scene and referenced by index by the primitives
+  struct Material
+  {
+    /// Color of the material
+    Color color;
+    /// Reflection factor of the material
+    DataType reflection;
+    /// Diffuse factor of the material
+    DataType diffuse;
+
+    /// Constructs the default material, white, neither reflective nor diffuse
+    Material()
+    :color(Color::Constant(1.f)), reflection(0), diffuse(0)
+    {
+    }
+
+    /**
+     * Constructs a material
+     * @param color is the color of the material
+     * @param reflection is the reflection factor
+     * @param diffuse is the diffuse factor
+     */
+    Material(const Color& color, DataType reflection, DataType diffuse)
+    :color(color), reflection(reflection), diffuse(diffuse)
+    {
+    }
+  };
+}
+
+#endif
@@ -0,0 +1,132 @@
+/**
+ * \file primitive_bounds.h
+ * The cache of the bounds of the primitives of a scene
+ */
+
+#ifndef PRIMITIVEBOUNDS
+#define PRIMITIVEBOUNDS
+
+#include <algorithm>
+#include <vector>
+
+#include "common.h"
+#include "bounding_box.h"
+
+namespace IRT
+{
+  /// Bounds and centroids of a set of primitives, each coordinate being stored in its own array
+  class PrimitiveBounds
+  {
+  private:
+    /// Lower bound of each primitive along each axis
+    std::vector<DataType> lower[3];
+    /// Upper bound of each primitive along each axis
+    std::vector<DataType> upper[3];
+    /// Center of the bounds of each primitive along each axis
+    std::vector<DataType> centroids[3];
+
+  public:
+    /// Returns the number of primitives
+    unsigned long size() const
+    {
+      return lower[0].size();
+    }
+
+    /**
+     * Adds the bounds of a new primitive
+     * @param bb is the bounding box of the primitive
+     */
+    void push_back(const BoundingBox& bb)
+    {
+      for(int axis = 0; axis < 3; ++axis)
+      {
+        lower[axis].push_back(bb.corner1(axis));
+        upper[axis].push_back(bb.corner2(axis));
+        centroids[axis].push_back((bb.corner1(axis) + bb.corner2(axis)) / 2);
+      }
+    }
+
+    /**
+     * Replaces the bounds of a primitive that was modified
+     * @param index is the index of the primitive
+     * @param bb is the new bounding box of the primitive
+     */
+    void set(unsigned long index, const BoundingBox& bb)
+    {
+      for(int axis = 0; axis < 3; ++axis)
+      {
+        lower[axis][index] = bb.corner1(axis);
+        upper[axis][index] = bb.corner2(axis);
+        centroids[axis][index] = (bb.corner1(axis) + bb.corner2(axis)) / 2;
+      }
+    }
+
+    /**
+     * Removes the bounds of a primitive, the next ones being shifted
+     * @param index is the index of the primitive
+     */
+    void erase(unsigned long index)
+    {
+      for(int axis = 0; axis < 3; ++axis)
+      {
+        lower[axis].erase(lower[axis].begin() + index);
+        upper[axis].erase(upper[axis].begin() + index);
+        centroids[axis].erase(centroids[axis].begin() + index);
+      }
+    }
+
+    /// Returns the bounding box of a primitive
+    BoundingBox getBoundingBox(unsigned long index) const
+    {
+      BoundingBox bb;
+      bb.corner1 = Point3df(lower[0][index], lower[1][index], lower[2][index]);
+      bb.corner2 = Point3df(upper[0][index], upper[1][index], upper[2][index]);
+      return bb;
+    }
+
+    /// Returns the center of the bounding box of a primitive
+    Point3df getCentroid(unsigned long index) const
+    {
+      return Point3df(centroids[0][index], centroids[1][index], centroids[2][index]);
+    }
+
+    /// Returns the lower bounds of all the primitives along an axis
+    const std::vector<DataType>& getLower(int axis) const
+    {
+      return lower[axis];
+    }
+
+    /// Returns the upper bounds of all the primitives along an axis
+    const std::vector<DataType>& getUpper(int axis) const
+    {
+      return upper[axis];
+    }
+
+    /// Returns the centers of all the primitives along an axis
+    const std::vector<DataType>& getCentroids(int axis) const
+    {
+      return centroids[axis];
+    }
+
+    /**
+     * Computes the bounding box of all the primitives
+     * @return the union of the bounds, empty if there is no primitive
+     */
+    BoundingBox getUnion() const
+    {
+      BoundingBox bb = BoundingBox::empty();
+      if(size() == 0)
+      {
+        return bb;
+      }
+      for(int axis = 0; axis < 3; ++axis)
+      {
+        bb.corner1(axis) = *std::min_element(lower[axis].begin(), lower[axis].end());
+        bb.corner2(axis) = *std::max_element(upper[axis].begin(), upper[axis].end());
+      }
+      return bb;
+    }
+  };
+}
+
+#endif
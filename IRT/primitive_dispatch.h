@@ -0,0 +1,164 @@
+/**
+ * \file primitive_dispatch.h
+ * Dispatch of the primitives of a leaf to loops specialized for their concrete type
+ */
+
+#ifndef PRIMITIVEDISPATCH
+#define PRIMITIVEDISPATCH
+
+#include <algorithm>
+#include <vector>
+
+#include "common.h"
+#include "ray.h"
+#include "primitives.h"
+#include "triangle_mesh.h"
+
+namespace IRT
+{
+  /// Calls the intersection of a concrete type directly, without going through the virtual table
+  template<class Concrete>
+  struct DirectIntersection
+  {
+    template<class Base>
+    static bool intersect(const Base* primitive, const Ray& ray, DataType& dist)
+    {
+      return static_cast<const Concrete*>(primitive)->Concrete::intersect(ray, dist);
+    }
+
+    template<class Base>
+    static bool intersect(const Base* primitive, const Ray& ray, HitRecord& hit)
+    {
+      return static_cast<const Concrete*>(primitive)->Concrete::intersect(ray, hit);
+    }
+  };
+
+  /// Calls the intersection through the virtual table, for the types without a specialized loop
+  struct VirtualIntersection
+  {
+    template<class Base>
+    static bool intersect(const Base* primitive, const Ray& ray, DataType& dist)
+    {
+      return primitive->intersect(ray, dist);
+    }
+
+    template<class Base>
+    static bool intersect(const Base* primitive, const Ray& ray, HitRecord& hit)
+    {
+      return primitive->intersect(ray, hit);
+    }
+  };
+
+  /**
+   * Splits the primitives of a leaf in runs of the same concrete type, each run being tested by a loop specialized for its type
+   * The generic version tests all the primitives through the virtual table.
+   */
+  template<class Base>
+  struct PrimitiveDispatch
+  {
+    /// Orders the primitives of a leaf so that the primitives of a type are contiguous
+    static void group(typename std::vector<Base*>::iterator begin, typename std::vector<Base*>::iterator end)
+    {
+    }
+
+    /**
+     * Gives the runs of a leaf to a visitor
+     * @param visitor has a method visit<Intersection>(begin, end) returning false to stop
+     * @return false if the visitor stopped
+     */
+    template<class Visitor>
+    static bool visit(Base* const* begin, Base* const* end, Visitor& visitor)
+    {
+      return begin == end || visitor.template visit<VirtualIntersection>(begin, end);
+    }
+  };
+
+  /// The runs of the primitives of the library, the virtual table being used once per run instead of once per primitive
+  template<>
+  struct PrimitiveDispatch<Primitive>
+  {
+    /// Orders the primitives by type
+    struct TypeOrder
+    {
+      bool operator()(const Primitive* primitive1, const Primitive* primitive2) const
+      {
+        return primitive1->getType() < primitive2->getType();
+      }
+    };
+
+    static void group(std::vector<Primitive*>::iterator begin, std::vector<Primitive*>::iterator end)
+    {
+      std::stable_sort(begin, end, TypeOrder());
+    }
+
+    /**
+     * Fills the point and the normal of the closest hit of a ray, the concrete types being called without the virtual table
+     * @param ray is the ray that hit the primitive
+     * @param hit is the record filled by the intersection test, with its primitive set
+     */
+    static void computeHit(const Ray& ray, HitRecord& hit)
+    {
+      const Primitive* primitive = hit.primitive;
+      hit.point = ray.origin() + hit.dist * ray.direction();
+
+      switch(primitive->getType())
+      {
+      case Primitive::SphereType:
+        static_cast<const Sphere*>(primitive)->Sphere::computeHit(ray, hit);
+        break;
+      case Primitive::BoxType:
+        static_cast<const Box*>(primitive)->Box::computeHit(ray, hit);
+        break;
+      case Primitive::TriangleType:
+        static_cast<const Triangle*>(primitive)->Triangle::computeHit(ray, hit);
+        break;
+      case Primitive::MeshTriangleType:
+        static_cast<const MeshTriangle*>(primitive)->MeshTriangle::computeHit(ray, hit);
+        break;
+      default:
+        primitive->computeHit(ray, hit);
+      }
+    }
+
+    template<class Visitor>
+    static bool visit(Primitive* const* begin, Primitive* const* end, Visitor& visitor)
+    {
+      while(begin != end)
+      {
+        Primitive::Type type = (*begin)->getType();
+        Primitive* const* run_end = begin + 1;
+        while(run_end != end && (*run_end)->getType() == type)
+        {
+          ++run_end;
+        }
+
+        bool next;
+        switch(type)
+        {
+        case Primitive::SphereType:
+          next = visitor.template visit<DirectIntersection<Sphere> >(begin, run_end);
+          break;
+        case Primitive::BoxType:
+          next = visitor.template visit<DirectIntersection<Box> >(begin, run_end);
+          break;
+        case Primitive::TriangleType:
+          next = visitor.template visit<DirectIntersection<Triangle> >(begin, run_end);
+          break;
+        case Primitive::MeshTriangleType:
+          next = visitor.template visit<DirectIntersection<MeshTriangle> >(begin, run_end);
+          break;
+        default:
+          next = visitor.template visit<VirtualIntersection>(begin, run_end);
+        }
+        if(!next)
+        {
+          return false;
+        }
+        begin = run_end;
+      }
+      return true;
+    }
+  };
+}
+
+#endif
@@ -8,48 +8,38 @@
 
 namespace IRT
 {
-  MaterialPoint::MaterialPoint()
-  :normal(Normal3df::Zero())
+  HitRecord::HitRecord()
+  :dist(0), primitive(NULL), point(Point3df::Zero()), normal(Normal3df::Zero()), u(0), v(0), face(0), prototype_primitive(NULL)
   {
   }
 
   Primitive::Primitive()
-  :color(Color::Constant(1.f)), reflection(0), diffuse(0)
+  :material(0), type(GenericType)
   {
   }
 
-  void Primitive::setColor(const Color& color)
+  Primitive::Primitive(Type type)
+  :material(0), type(type)
   {
-    this->color = color;
   }
 
-  const Color& Primitive::getColor() const
+  bool Primitive::intersect(const Ray& ray, HitRecord& hit) const
   {
-    return color;
+    return intersect(ray, hit.dist);
   }
 
-  void Primitive::setReflection(float reflection)
+  void Primitive::setMaterial(unsigned int material)
   {
-    this->reflection = reflection;
+    this->material = material;
   }
 
-  float Primitive::getReflection() const
+  BoundingBox Primitive::getClippedBoundingBox(const BoundingBox& box) const
   {
-    return reflection;
-  }
-
-  void Primitive::setDiffuse(float diffuse)
-  {
-    this->diffuse = diffuse;
-  }
-
-  float Primitive::getDiffuse() const
-  {
-    return diffuse;
+    return getBoundingBox().clip(box);
   }
 
   Sphere::Sphere(const Point3df& center, DataType radius) :
-    center(center), radius(radius)
+    Primitive(SphereType), center(center), radius(radius)
   {
   }
 
@@ -57,80 +47,62 @@ namespace IRT
   {
   }
 
-  bool Sphere::intersect(const Ray& ray, DataType& dist) const
+  BoundingBox Sphere::getBoundingBox() const
   {
-    const Vector3df& vector = ray.origin() - center;
-    DataType B = -(ray.direction().dot(vector));
-    DataType C = norm2(vector) - radius * radius;
+    BoundingBox bb;
 
-    DataType delta = (B * B - C);
+    bb.corner1 = center.array() - radius;
+    bb.corner2 = center.array() + radius;
 
-    if (delta < 0.f)
-      return false;
-    DataType disc = std::sqrt(delta);
-    if ((dist = (B - disc)) < 0.)
-      dist = (B + disc);
-    return true;
+    return bb;
   }
 
-  void Sphere::computeColorNormal(const Ray& ray, DataType dist, MaterialPoint& caracteristics) const
+  BoundingBox Sphere::getClippedBoundingBox(const BoundingBox& box) const
   {
-    caracteristics.normal = ray.origin() + dist * ray.direction() - center;
-    normalize(caracteristics.normal);
-  }
+    BoundingBox bb = getBoundingBox().clip(box);
+    if(bb.isEmpty())
+    {
+      return bb;
+    }
 
-  BoundingBox Sphere::getBoundingBox() const
-  {
-    BoundingBox bb;
+    // Squared distance between the center and the clipped box along each axis
+    Vector3df distances = (bb.corner1 - center).cwiseMax(center - bb.corner2).cwiseMax(Vector3df::Zero());
+    distances = distances.cwiseProduct(distances);
+    DataType total = distances.sum();
 
-    bb.corner1 = center.array() - radius;
-    bb.corner2 = center.array() + radius;
+    for(int i = 0; i < 3; ++i)
+    {
+      // A point of the sphere inside the box is at least as far from the center along the other axes as the box is
+      DataType remaining = radius * radius - (total - distances(i));
+      if(remaining < 0)
+      {
+        return BoundingBox::empty();
+      }
+      DataType extent = std::sqrt(remaining);
+      bb.corner1(i) = std::max(bb.corner1(i), center(i) - extent);
+      bb.corner2(i) = std::min(bb.corner2(i), center(i) + extent);
+    }
 
     return bb;
   }
   
-  Box::Box(const Point3df& corner1, const Point3df& corner2) :
-  corner1(corner1), corner2(corner2)
+  const Point3df& Sphere::getCenter() const
   {
+    return center;
   }
-  
-  Box::~Box()
+
+  DataType Sphere::getRadius() const
   {
+    return radius;
   }
-  
-  bool Box::intersect(const Ray& ray, float& dist) const
+
+  Box::Box(const Point3df& corner1, const Point3df& corner2) :
+  Primitive(BoxType), corner1(corner1), corner2(corner2)
   {
-    DataType tnear, tfar;
-    BoundingBox bb;
-    bb.corner1 = corner1;
-    bb.corner2 = corner2;
-    
-    bool result = bb.getEntryExitDistances(ray, tnear, tfar);
-    
-    if(result)
-    {
-      dist = tnear;
-    }
-    
-    return result;
   }
   
-  void Box::computeColorNormal(const Ray& ray, float dist, MaterialPoint& caracteristics) const
+  Box::~Box()
   {
-    Vector3df collide(ray.origin() + dist * ray.direction());
-    
-    caracteristics.normal = Normal3df::Zero();
-    for(int i = 0; i < 3; ++i)
-    {
-      if(std::abs(collide(i) - corner1(i)) <= std::numeric_limits<DataType>::epsilon())
-      {
-        caracteristics.normal(i) = -1;
-      }
-      if(std::abs(collide(i) - corner2(i)) <= std::numeric_limits<DataType>::epsilon())
-      {
-        caracteristics.normal(i) = 1;
-      }
-    }
   }
   
   BoundingBox Box::getBoundingBox() const
@@ -142,49 +114,54 @@ namespace IRT
     
     return bb;
   }
-  
-  Triangle::Triangle(const Point3df& corner1, const Point3df& corner2, const Point3df& corner3) :
-  corner1(corner1), corner2(corner2), corner3(corner3), v0(corner3 - corner1), v1(corner2 - corner1), normal(v1.cross(v0))
+
+  BoundingBox Box::getClippedBoundingBox(const BoundingBox& box) const
   {
-    normalize(normal);
+    // The intersection of the boxes is exactly the clipped box
+    return getBoundingBox().clip(box);
   }
   
-  Triangle::~Triangle()
+  const Point3df& Box::getCorner1() const
   {
+    return corner1;
   }
-  
-  bool Triangle::intersect(const Ray& ray, float& dist) const
+
+  const Point3df& Box::getCorner2() const
   {
-    float coeff = ray.direction().dot(normal);
-    if(std::abs(coeff) < std::numeric_limits<float>::epsilon())
-      return false;
-  
-    float d = corner1.dot(normal);
-    dist = - (ray.origin().dot(normal) - d) / coeff;
-    
-    Vector3df intersect = ray.origin() + ray.direction() * dist;
+    return corner2;
+  }
 
-    Vector3df v2 = intersect - corner1;
-    
-    // Compute dot products
+  TriangleRecord::TriangleRecord()
+  :normal(Normal3df::Zero()), distance(0), u_axis(Vector3df::Zero()), u_offset(1), v_axis(Vector3df::Zero()), v_offset(1)
+  {
+  }
+
+  TriangleRecord::TriangleRecord(const Point3df& corner1, const Point3df& corner2, const Point3df& corner3)
+  {
+    Vector3df v0 = corner3 - corner1;
+    Vector3df v1 = corner2 - corner1;
+    normal = v1.cross(v0);
+    normalize(normal);
+    distance = corner1.dot(normal);
+
+    // The barycentric coordinates of corner1 + v2 are linear in v2, their dot products being folded in two axes
     float dot00 = v0.dot(v0);
     float dot01 = v0.dot(v1);
-    float dot02 = v0.dot(v2);
     float dot11 = v1.dot(v1);
-    float dot12 = v1.dot(v2);
-    
-    // Compute barycentric coordinates
     float invDenom = 1 / (dot00 * dot11 - dot01 * dot01);
-    float u = (dot11 * dot02 - dot01 * dot12) * invDenom;
-    float v = (dot00 * dot12 - dot01 * dot02) * invDenom;
-    
-    // Check if point is in triangle
-    return (u >= 0) && (v >= 0) && (u + v < 1);
+    u_axis = (dot11 * v0 - dot01 * v1) * invDenom;
+    v_axis = (dot00 * v1 - dot01 * v0) * invDenom;
+    u_offset = u_axis.dot(corner1);
+    v_offset = v_axis.dot(corner1);
+  }
+
+  Triangle::Triangle(const Point3df& corner1, const Point3df& corner2, const Point3df& corner3) :
+  Primitive(TriangleType), corner1(corner1), corner2(corner2), corner3(corner3), record(corner1, corner2, corner3), back_face_culling(false)
+  {
   }
   
-  void Triangle::computeColorNormal(const Ray& ray, float dist, MaterialPoint& caracteristics) const
+  Triangle::~Triangle()
   {
-    caracteristics.normal = normal;
   }
   
   BoundingBox Triangle::getBoundingBox() const
@@ -196,4 +173,105 @@ namespace IRT
     
     return bb;
   }
+
+  BoundingBox Triangle::getClippedBoundingBox(const BoundingBox& box) const
+  {
+    return clipTriangle(corner1, corner2, corner3, box);
+  }
+
+  BoundingBox Triangle::clipTriangle(const Point3df& corner1, const Point3df& corner2, const Point3df& corner3, const BoundingBox& box)
+  {
+    // Sutherland-Hodgman clipping by the six planes of the box, each plane adding at most one vertex
+    const int max_vertices = 9;
+    Point3df polygons[2][2 * max_vertices];
+    polygons[0][0] = corner1;
+    polygons[0][1] = corner2;
+    polygons[0][2] = corner3;
+    int count = 3;
+    int current = 0;
+
+    for(int axis = 0; axis < 3; ++axis)
+    {
+      for(int side = 0; side < 2; ++side)
+      {
+        DataType position = side == 0 ? box.corner1(axis) : box.corner2(axis);
+        DataType orientation = side == 0 ? 1 : -1;
+        const Point3df* polygon = polygons[current];
+        Point3df* clipped = polygons[1 - current];
+        int clipped_count = 0;
+
+        for(int i = 0; i < count; ++i)
+        {
+          const Point3df& point = polygon[i];
+          const Point3df& next = polygon[(i + 1) % count];
+          DataType distance = orientation * (point(axis) - position);
+          DataType next_distance = orientation * (next(axis) - position);
+          if(distance >= 0)
+          {
+            clipped[clipped_count++] = point;
+          }
+          if((distance < 0 && next_distance > 0) || (distance > 0 && next_distance < 0))
+          {
+            clipped[clipped_count] = point + (next - point) * (distance / (distance - next_distance));
+            clipped[clipped_count++](axis) = position;
+          }
+        }
+
+        count = clipped_count;
+        current = 1 - current;
+        if(count == 0)
+        {
+          return BoundingBox::empty();
+        }
+        if(count > max_vertices)
+        {
+          // Only rounding errors can make the polygon concave, the box is then a safe answer
+          BoundingBox bb;
+          bb.corner1 = corner1.array().min(corner2.array()).min(corner3.array());
+          bb.corner2 = corner1.array().max(corner2.array()).max(corner3.array());
+          return bb.clip(box);
+        }
+      }
+    }
+
+    BoundingBox bb;
+    bb.corner1 = bb.corner2 = polygons[current][0];
+    for(int i = 1; i < count; ++i)
+    {
+      bb.corner1 = bb.corner1.cwiseMin(polygons[current][i]);
+      bb.corner2 = bb.corner2.cwiseMax(polygons[current][i]);
+    }
+
+    return bb.clip(box);
+  }
+
+  const Point3df& Triangle::getCorner1() const
+  {
+    return corner1;
+  }
+
+  const Point3df& Triangle::getCorner2() const
+  {
+    return corner2;
+  }
+
+  const Point3df& Triangle::getCorner3() const
+  {
+    return corner3;
+  }
+
+  const TriangleRecord& Triangle::getRecord() const
+  {
+    return record;
+  }
+
+  bool Triangle::getBackFaceCulling() const
+  {
+    return back_face_culling;
+  }
+
+  void Triangle::setBackFaceCulling(bool back_face_culling)
+  {
+    this->back_face_culling = back_face_culling;
+  }
 }
@@ -6,24 +6,56 @@
 #ifndef PRIMITIVES
 #define PRIMITIVES
 
+#include <cmath>
+#include <limits>
+
 #include "common.h"
 #include "ray.h"
 #include "bounding_box.h"
 
 namespace IRT
 {
-  /// Carateristic of a primitive at a specific point
-  struct MaterialPoint
+  class Primitive;
+
+  /**
+   * Data of the closest hit of a ray, consumed by the shading
+   * The intersection tests fill the distance and the data they compute on the way, each type reading back only the fields its own test wrote.
+   * The point and the normal are filled once after the traversal.
+   */
+  struct HitRecord
   {
-    _export_tools MaterialPoint();
-    /// Normal of the primitive at a point
+    _export_tools HitRecord();
+    /// Distance between the ray origin and the hit point
+    DataType dist;
+    /// The hit primitive
+    const Primitive* primitive;
+    /// Hit point
+    Point3df point;
+    /// Normal of the primitive at the hit point
     Normal3df normal;
+    /// Barycentric coordinates of the hit point in a triangle, along its third and second corners
+    DataType u;
+    DataType v;
+    /// Face of a box that is hit, twice the axis of the face plus one for the face of the second corner
+    unsigned int face;
+    /// For an instance, the primitive of its prototype that is hit, u, v and face being the data of that primitive
+    const Primitive* prototype_primitive;
   };
 
   /// Virtual class for primitives (triangles, spheres, ...)
   class Primitive
   {
   public:
+    /// The concrete types that the leaves of the trees test with a loop specialized for the type
+    enum Type
+    {
+      GenericType,
+      SphereType,
+      BoxType,
+      TriangleType,
+      MeshTriangleType
+    };
+
     Primitive();
 
     /// Virtual destructor
@@ -39,12 +71,19 @@ namespace IRT
     virtual bool intersect(const Ray& ray, DataType& dist) const = 0;
 
     /**
-     * Computes the normal and the color of the point based on the intersection point with the primitive
+     * Tests if a ray intersects the primitive, filling the distance and the data of the hit computed by the test, by default only the distance
+     * @param ray is the ray to test
+     * @param hit is an output argument that will contain the distance and the data of the hit
+     * @return True or False depending on the result of the test
+     */
+    _export_tools virtual bool intersect(const Ray& ray, HitRecord& hit) const;
+
+    /**
+     * Fills the normal of the primitive in the record of a hit
      * @param ray is the direction ray
-     * @param dist is the distance to the primitive
-     * @param caracteristics is a the caracteristics of the primitive at this point
+     * @param hit has its distance, its point and the data of the intersection set
      */
-    virtual void computeColorNormal(const Ray& ray, DataType dist, MaterialPoint& caracteristics) const = 0;
+    virtual void computeHit(const Ray& ray, HitRecord& hit) const = 0;
 
     /**
      * Returns the bounding box of the primitive
@@ -53,34 +92,40 @@ namespace IRT
     virtual BoundingBox getBoundingBox() const = 0;
 
     /**
-     * Sets the color of the sphere
-     * @param color is the color of the sphere
+     * Returns the bounding box of the part of the primitive inside a box, by default the intersection of the boxes
+     * @param box is the box that clips the primitive
+     * @return the clipped bounding box, empty if the primitive does not cross the box
      */
-    _export_tools void setColor(const Color& color);
-
-    _export_tools const Color& getColor() const;
+    _export_tools virtual BoundingBox getClippedBoundingBox(const BoundingBox& box) const;
 
     /**
-      * Sets the reflection parameters of the sphere
-      * @param reflection is the reflection "color" of the sphere
-      */
-    _export_tools void setReflection(float reflection);
+     * Sets the material of the primitive
+     * @param material is the index of the material in the material table of the scene
+     */
+    _export_tools void setMaterial(unsigned int material);
 
-    _export_tools float getReflection() const;    
-    /**
-      * Sets the diffuse parameters of the sphere
-      * @param diffuse is the reflection "color" of the sphere
-      */
-    _export_tools void setDiffuse(float diffuse);
+    /// Returns the index of the material of the primitive in the material table of the scene
+    unsigned int getMaterial() const
+    {
+      return material;
+    }
 
-    _export_tools float getDiffuse() const;
+    /// Returns the concrete type of the primitive, GenericType for the types without a specialized loop
+    Type getType() const
+    {
+      return type;
+    }
   protected:
-    /// Color of the sphere
-    Color color;
-    /// Reflection factor of the sphere
-    float reflection;
-    /// Diffuse factor of the sphere
-    float diffuse;
+    /**
+     * Constructs a primitive of one of the concrete types
+     * @param type is the concrete type of the primitive
+     */
+    explicit Primitive(Type type);
+
+    /// Index of the material in the material table of the scene
+    unsigned int material;
+    /// Concrete type of the primitive
+    Type type;
   };
 
   /// A simple sphere
@@ -103,21 +148,41 @@ namespace IRT
      * @param dist is an output argument that will contain the distance between the ray origin and the primitive
      * @return True or False depending on the result of the test
      */
-    _export_tools bool intersect(const Ray& ray, DataType& dist) const;
+    bool intersect(const Ray& ray, DataType& dist) const;
 
     /**
-     * Computes the normal and the color of the point based on the intersection point with the primitive
+     * Tests if a ray intersects the sphere, the distance being the only data of the hit
+     * @param ray is the ray to test
+     * @param hit is an output argument that will contain the distance of the hit
+     * @return True or False depending on the result of the test
+     */
+    bool intersect(const Ray& ray, HitRecord& hit) const;
+
+    /**
+     * Fills the normal of the sphere in the record of a hit, from the hit point
      * @param ray is the direction ray
-     * @param dist is the distance to the primitive
-     * @param caracteristics is a the caracteristics of the primitive at this point
+     * @param hit has its distance and its point set
      */
-    _export_tools void computeColorNormal(const Ray& ray, DataType dist, MaterialPoint& caracteristics) const;
+    void computeHit(const Ray& ray, HitRecord& hit) const;
 
     /**
      * Returns the bounding box of the primitive
      * @return the bounding box
      */
     _export_tools virtual BoundingBox getBoundingBox() const;
+
+    /**
+     * Returns the bounding box of the part of the primitive inside a box
+     * @param box is the box that clips the primitive
+     * @return the clipped bounding box
+     */
+    _export_tools virtual BoundingBox getClippedBoundingBox(const BoundingBox& box) const;
+
+    /// Returns the center of the sphere
+    _export_tools const Point3df& getCenter() const;
+
+    /// Returns the radius of the sphere
+    _export_tools DataType getRadius() const;
   private:
     /// Center of the sphere
     Point3df center;
@@ -140,33 +205,107 @@ namespace IRT
     _export_tools ~Box();
     
     /**
-     * Tests if a ray intersects the sphere
+     * Tests if a ray intersects the box, on the face where it enters or, from inside, where it leaves
      * @param ray is the ray to test
      * @param dist is an output argument that will contain the distance between the ray origin and the primitive
      * @return True or False depending on the result of the test
      */
-    _export_tools bool intersect(const Ray& ray, DataType& dist) const;
+    bool intersect(const Ray& ray, DataType& dist) const;
+
+    /**
+     * Tests if a ray intersects the box, recording the face that is hit
+     * @param ray is the ray to test
+     * @param hit is an output argument that will contain the distance and the face of the hit
+     * @return True or False depending on the result of the test
+     */
+    bool intersect(const Ray& ray, HitRecord& hit) const;
     
     /**
-     * Computes the normal and the color of the point based on the intersection point with the primitive
+     * Fills the normal of the box in the record of a hit, from the face that is hit
      * @param ray is the direction ray
-     * @param dist is the distance to the primitive
-     * @param caracteristics is a the caracteristics of the primitive at this point
+     * @param hit has its distance, its point and its face set
      */
-    _export_tools void computeColorNormal(const Ray& ray, DataType dist, MaterialPoint& caracteristics) const;
+    void computeHit(const Ray& ray, HitRecord& hit) const;
     
     /**
      * Returns the bounding box of the primitive
      * @return the bounding box
      */
     _export_tools virtual BoundingBox getBoundingBox() const;
+
+    /**
+     * Returns the bounding box of the part of the primitive inside a box
+     * @param box is the box that clips the primitive
+     * @return the clipped bounding box
+     */
+    _export_tools virtual BoundingBox getClippedBoundingBox(const BoundingBox& box) const;
+
+    /// Returns the first corner
+    _export_tools const Point3df& getCorner1() const;
+
+    /// Returns the second corner
+    _export_tools const Point3df& getCorner2() const;
   private:
+    /**
+     * Finds the face that a ray hits, the slab that it enters last or, if it starts inside the box, the slab that it leaves first
+     * @param face is an output argument that will contain the face, as in HitRecord
+     */
+    bool intersect(const Ray& ray, DataType& dist, unsigned int& face) const;
+
     /// First corner
     Point3df corner1;
     /// Second corner
     Point3df corner2;
   };
   
+  /// Constants of the intersection between a ray and a triangle, computed once for each triangle
+  struct TriangleRecord
+  {
+    /// Unit normal of the triangle, the front face being the side it points to
+    Normal3df normal;
+    /// Distance between the origin and the plane of the triangle along the normal
+    DataType distance;
+    /// The barycentric coordinate along the third corner of a point of the plane is u_axis.dot(point) - u_offset
+    Vector3df u_axis;
+    DataType u_offset;
+    /// The barycentric coordinate along the second corner of a point of the plane is v_axis.dot(point) - v_offset
+    Vector3df v_axis;
+    DataType v_offset;
+
+    /// Constructs the record of a degenerated triangle, never hit
+    _export_tools TriangleRecord();
+
+    /**
+     * Computes the record of a triangle
+     * @param corner1
+     * @param corner2
+     * @param corner3
+     */
+    _export_tools TriangleRecord(const Point3df& corner1, const Point3df& corner2, const Point3df& corner3);
+
+    /**
+     * Tests if a ray intersects the triangle
+     * @param ray is the ray to test
+     * @param dist is an output argument that will contain the distance between the ray origin and the triangle
+     * @param back_face_culling ignores the hits on the back face, for closed meshes
+     * @return True or False depending on the result of the test
+     */
+    bool intersect(const Ray& ray, DataType& dist, bool back_face_culling) const;
+
+    /**
+     * Tests if a ray intersects the triangle, keeping the barycentric coordinates that the test computes
+     * @param u is an output argument that will contain the barycentric coordinate along the third corner
+     * @param v is an output argument that will contain the barycentric coordinate along the second corner
+     */
+    bool intersect(const Ray& ray, DataType& dist, DataType& u, DataType& v, bool back_face_culling) const;
+
+    /**
+     * Fills the normal in the record of a hit
+     * @param hit has its barycentric coordinates set by the intersection
+     */
+    void computeHit(HitRecord& hit) const;
+  };
+
   /// A simple triangle
   class Triangle: public Primitive
   {
@@ -188,21 +327,66 @@ namespace IRT
      * @param dist is an output argument that will contain the distance between the ray origin and the primitive
      * @return True or False depending on the result of the test
      */
-    _export_tools bool intersect(const Ray& ray, DataType& dist) const;
+    bool intersect(const Ray& ray, DataType& dist) const;
+
+    /**
+     * Tests if a ray intersects the triangle, recording the barycentric coordinates of the hit
+     * @param ray is the ray to test
+     * @param hit is an output argument that will contain the distance and the barycentric coordinates of the hit
+     * @return True or False depending on the result of the test
+     */
+    bool intersect(const Ray& ray, HitRecord& hit) const;
     
     /**
-     * Computes the normal and the color of the point based on the intersection point with the primitive
+     * Fills the normal of the triangle in the record of a hit
      * @param ray is the direction ray
-     * @param dist is the distance to the primitive
-     * @param caracteristics is a the caracteristics of the primitive at this point
+     * @param hit has its distance, its point and its barycentric coordinates set
      */
-    _export_tools void computeColorNormal(const Ray& ray, DataType dist, MaterialPoint& caracteristics) const;
+    void computeHit(const Ray& ray, HitRecord& hit) const;
     
     /**
      * Returns the bounding box of the primitive
      * @return the bounding box
      */
     _export_tools virtual BoundingBox getBoundingBox() const;
+
+    /**
+     * Returns the bounding box of the part of the primitive inside a box
+     * @param box is the box that clips the primitive
+     * @return the clipped bounding box
+     */
+    _export_tools virtual BoundingBox getClippedBoundingBox(const BoundingBox& box) const;
+
+    /// Returns the first corner
+    _export_tools const Point3df& getCorner1() const;
+
+    /// Returns the second corner
+    _export_tools const Point3df& getCorner2() const;
+
+    /// Returns the third corner
+    _export_tools const Point3df& getCorner3() const;
+
+    /// Returns the precomputed intersection constants
+    _export_tools const TriangleRecord& getRecord() const;
+
+    /// Returns true if the hits on the back face are ignored
+    _export_tools bool getBackFaceCulling() const;
+
+    /**
+     * Ignores the hits on the back face of the triangle, the side where the corners are seen clockwise
+     * @param back_face_culling is true to ignore the back face
+     */
+    _export_tools void setBackFaceCulling(bool back_face_culling);
+
+    /**
+     * Returns the bounding box of the part of a triangle inside a box
+     * @param corner1 is the first corner of the triangle
+     * @param corner2 is the second corner of the triangle
+     * @param corner3 is the third corner of the triangle
+     * @param box is the box that clips the triangle
+     * @return the clipped bounding box, empty if the triangle does not cross the box
+     */
+    _export_tools static BoundingBox clipTriangle(const Point3df& corner1, const Point3df& corner2, const Point3df& corner3, const BoundingBox& box);
   private:
     /// First corner
     Point3df corner1;
@@ -210,13 +394,141 @@ namespace IRT
     Point3df corner2;
     /// Third corner
     Point3df corner3;
-    /// First direction
-    Point3df v0;
-    /// Second direction
-    Point3df v1;
-    /// Normal
-    Point3df normal;
+    /// Precomputed intersection constants
+    TriangleRecord record;
+    /// Ignores the hits on the back face
+    bool back_face_culling;
   };
+
+  // The intersections are inlined in the loops specialized for each type of primitive
+  inline bool Sphere::intersect(const Ray& ray, DataType& dist) const
+  {
+    const Vector3df& vector = ray.origin() - center;
+    DataType B = -(ray.direction().dot(vector));
+    DataType C = norm2(vector) - radius * radius;
+
+    DataType delta = (B * B - C);
+
+    if (delta < 0.f)
+      return false;
+    DataType disc = std::sqrt(delta);
+    if ((dist = (B - disc)) < 0.)
+      dist = (B + disc);
+    return true;
+  }
+
+  inline bool Sphere::intersect(const Ray& ray, HitRecord& hit) const
+  {
+    return intersect(ray, hit.dist);
+  }
+
+  inline bool Box::intersect(const Ray& ray, DataType& dist, unsigned int& face) const
+  {
+    const Point3df* corners[2] = {&corner1, &corner2};
+    DataType tnear = -std::numeric_limits<float>::max();
+    DataType tfar = std::numeric_limits<float>::max();
+    int near_axis = 0;
+    int far_axis = 0;
+    for(int i = 0; i < 3; ++i)
+    {
+      DataType entry = ((*corners[ray.sign(i)])(i) - ray.origin()(i)) * ray.invDirection()(i);
+      DataType exit = ((*corners[1 - ray.sign(i)])(i) - ray.origin()(i)) * ray.invDirection()(i);
+      // A NaN (origin on a slab of a parallel ray) fails both comparisons, so it is ignored
+      if(entry > tnear)
+      {
+        tnear = entry;
+        near_axis = i;
+      }
+      if(exit < tfar)
+      {
+        tfar = exit;
+        far_axis = i;
+      }
+    }
+
+    if(tnear > tfar || tfar < std::numeric_limits<float>::epsilon())
+      return false;
+
+    if(tnear >= std::numeric_limits<float>::epsilon())
+    {
+      dist = tnear;
+      face = 2 * near_axis + ray.sign(near_axis);
+    }
+    else
+    {
+      dist = tfar;
+      face = 2 * far_axis + 1 - ray.sign(far_axis);
+    }
+    return true;
+  }
+
+  inline bool Box::intersect(const Ray& ray, DataType& dist) const
+  {
+    unsigned int face;
+    return intersect(ray, dist, face);
+  }
+
+  inline bool Box::intersect(const Ray& ray, HitRecord& hit) const
+  {
+    return intersect(ray, hit.dist, hit.face);
+  }
+
+  inline bool TriangleRecord::intersect(const Ray& ray, DataType& dist, DataType& u, DataType& v, bool back_face_culling) const
+  {
+    DataType coeff = ray.direction().dot(normal);
+    if(back_face_culling ? coeff > -std::numeric_limits<float>::epsilon() : std::abs(coeff) < std::numeric_limits<float>::epsilon())
+      return false;
+
+    dist = (distance - ray.origin().dot(normal)) / coeff;
+
+    Vector3df intersect = ray.origin() + ray.direction() * dist;
+    u = u_axis.dot(intersect) - u_offset;
+    v = v_axis.dot(intersect) - v_offset;
+
+    // Check if point is in triangle
+    return (u >= 0) && (v >= 0) && (u + v < 1);
+  }
+
+  inline bool TriangleRecord::intersect(const Ray& ray, DataType& dist, bool back_face_culling) const
+  {
+    DataType u, v;
+    return intersect(ray, dist, u, v, back_face_culling);
+  }
+
+  inline bool Triangle::intersect(const Ray& ray, DataType& dist) const
+  {
+    return record.intersect(ray, dist, back_face_culling);
+  }
+
+  inline bool Triangle::intersect(const Ray& ray, HitRecord& hit) const
+  {
+    return record.intersect(ray, hit.dist, hit.u, hit.v, back_face_culling);
+  }
+
+  // The hit records are filled inline, PrimitiveDispatch calling the concrete types without the virtual table
+  inline void Sphere::computeHit(const Ray& ray, HitRecord& hit) const
+  {
+    // Normalized rather than divided by the radius, the hit points of the far spheres being off their surface
+    hit.normal = hit.point - center;
+    normalize(hit.normal);
+  }
+
+  inline void Box::computeHit(const Ray& ray, HitRecord& hit) const
+  {
+    int axis = hit.face / 2;
+    hit.normal = Normal3df::Zero();
+    hit.normal(axis) = (hit.face & 1) ? 1 : -1;
+  }
+
+  inline void TriangleRecord::computeHit(HitRecord& hit) const
+  {
+    hit.normal = normal;
+  }
+
+  inline void Triangle::computeHit(const Ray& ray, HitRecord& hit) const
+  {
+    record.computeHit(hit);
+  }
 }
 
 #endif
@@ -77,9 +77,8 @@ namespace IRT
   {
   public:
     ~Primitive();
-    void setColor(IRT::Color& color);
-    void setReflection(float reflection);
-    void setDiffuse(float diffuse);
+    void setMaterial(unsigned int material);
+    unsigned int getMaterial();
   };
 
   class Sphere: public Primitive
@@ -101,6 +100,7 @@ namespace IRT
   public:
     Triangle(IRT::Vector3df& corner1, IRT::Vector3df& corner2, IRT::Vector3df& corner3);
     ~Triangle();
+    void setBackFaceCulling(bool back_face_culling);
   };
 }
 
@@ -18,17 +18,34 @@ namespace IRT
     Point3df origin_;
     /// The direction
     Vector3df direction_;
+    /// The inverse of each component of the direction
+    Vector3df inv_direction_;
+    /// 1 for each axis along which the direction is negative, else 0
+    int sign_[3];
+
+    /// Computes the inverse direction and the signs once for all the slab tests
+    void updateInverse()
+    {
+      inv_direction_ = direction_.cwiseInverse();
+      for(int i = 0; i < 3; ++i)
+      {
+        // Taken from the inverse so that a -0 component gives a consistent -inf
+        sign_[i] = inv_direction_(i) < 0;
+      }
+    }
 
   public:
     /// Simple constructor
     Ray(const Point3df& origin, const Vector3df& direction)
       :origin_(origin), direction_(direction)
     {
+      updateInverse();
     }
     /// Simple constructor
     Ray()
       :origin_(Point3df::Zero()), direction_(Vector3df::Zero())
     {
+      updateInverse();
     }
 
     /// Returns the origin of the ray
@@ -46,10 +63,21 @@ namespace IRT
     {
       return direction_;
     }
-    /// Returns the direction of the ray
-    Vector3df& direction()
+    /// Sets the direction of the ray
+    void setDirection(const Vector3df& direction)
     {
-      return direction_;
+      direction_ = direction;
+      updateInverse();
+    }
+    /// Returns the inverse of each component of the direction
+    const Vector3df& invDirection() const
+    {
+      return inv_direction_;
+    }
+    /// Returns 1 if the direction is negative along the axis, else 0
+    int sign(int axis) const
+    {
+      return sign_[axis];
     }
   };
 }
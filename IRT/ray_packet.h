@@ -0,0 +1,77 @@
+/**
+ * \file ray_packet.h
+ * Describes a packet of coherent rays traced together
+ */
+
+#ifndef RAYPACKET
+#define RAYPACKET
+
+#include "common.h"
+#include "ray.h"
+
+namespace IRT
+{
+  /// A small bundle of rays sharing the same origin, traced together in the kd-tree
+  class RayPacket
+  {
+  public:
+    /// Number of rays in a packet
+    static const unsigned int size = 4;
+    /// One value per ray, vectorized by Eigen in a single SSE register
+    typedef Eigen::Array<DataType, size, 1> Array;
+    /// One flag per ray
+    typedef Eigen::Array<bool, size, 1> Mask;
+
+  private:
+    /// The rays
+    Ray rays[size];
+    /// Number of rays already set
+    unsigned int count;
+
+  public:
+    /**
+     * Constructs an empty packet
+     * @param ray is the model ray giving the origin of all rays
+     */
+    explicit RayPacket(const Ray& ray)
+    :count(0)
+    {
+      for(unsigned int i = 0; i < size; ++i)
+      {
+        rays[i] = ray;
+      }
+    }
+
+    /// Returns the next free ray of the packet and adds it to the packet
+    Ray& next()
+    {
+      return rays[count++];
+    }
+
+    /// Returns a ray
+    const Ray& operator[](unsigned int i) const
+    {
+      return rays[i];
+    }
+
+    /// Returns the number of rays in the packet
+    unsigned int getCount() const
+    {
+      return count;
+    }
+
+    /// Indicates if the packet cannot take another ray
+    bool full() const
+    {
+      return count == size;
+    }
+
+    /// Empties the packet, the rays keeping their origin
+    void clear()
+    {
+      count = 0;
+    }
+  };
+}
+
+#endif
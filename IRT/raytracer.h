@@ -6,6 +6,9 @@
 #ifndef RAYTRACER
 #define RAYTRACER
 
+#include <algorithm>
+#include <limits>
+
 #ifdef USE_TBB
 #include <tbb/tbb.h>
 #endif
@@ -16,7 +19,9 @@
 
 #include "common.h"
 #include "ray.h"
+#include "ray_packet.h"
 #include "bounding_box.h"
+#include "kdtree.h"
 
 namespace IRT
 {
@@ -35,9 +40,9 @@ namespace IRT
      */
     void generateRay(float x, float y, Ray& ray) const
     {
-      ray.direction() = direction + orientation_u * (x - precompWidth) + orientation_v * (precompHeight - y);
-
-      normalize(ray.direction());
+      Vector3df ray_direction = direction + orientation_u * (x - precompWidth) + orientation_v * (precompHeight - y);
+      normalize(ray_direction);
+      ray.setDirection(ray_direction);
     }
 
     /**
@@ -56,27 +61,100 @@ namespace IRT
         return;
       }
 
-      DataType dist;
-      Primitive* primitive = scene->getFirstCollision(ray, dist, tnear, tfar);
-      if(primitive == NULL)
+      HitRecord hit;
+      if(scene->getFirstCollision(ray, hit, tnear, tfar) == NULL)
         return;
 
-      MaterialPoint caracteristics;
-      primitive->computeColorNormal(ray, dist, caracteristics);
-      color = scene->computeColor(ray.origin() + dist * ray.direction(), caracteristics, primitive);
+      computeColor(ray, hit, color, level);
+    }
+
+    /**
+     * Computes the summed color of the rays of a packet, tracing the primary rays together, and empties the packet
+     * @param packet is the packet of primary rays
+     * @param bb is the bounding box of the scene
+     * @return the sum of the colors of the rays
+     */
+    Color computeColor(RayPacket& packet, const BoundingBox& bb) const
+    {
+      Color colors[RayPacket::size];
+      computeColors(packet, bb, colors);
+
+      Color final_color = Color::Zero();
+      for(unsigned int i = 0; i < RayPacket::size; ++i)
+      {
+        final_color += colors[i];
+      }
+      return final_color;
+    }
+
+    /**
+     * Computes the color of each ray of a packet, tracing the primary rays together, and empties the packet
+     * @param packet is the packet of primary rays
+     * @param bb is the bounding box of the scene
+     * @param colors is filled with the color of each ray, black for the rays that hit nothing and for the unused places
+     */
+    void computeColors(RayPacket& packet, const BoundingBox& bb, Color* colors) const
+    {
+      // The inactive rays get an empty interval, so that the packet traversal never takes them into account
+      RayPacket::Array tnear = RayPacket::Array::Constant(std::numeric_limits<DataType>::max());
+      RayPacket::Array tfar = RayPacket::Array::Constant(-std::numeric_limits<DataType>::max());
+      RayPacket::Mask active = RayPacket::Mask::Constant(false);
+
+      for(unsigned int i = 0; i < packet.getCount(); ++i)
+      {
+        active(i) = mustShoot(packet[i], bb) && bb.getEntryExitDistances(packet[i], tnear(i), tfar(i));
+        if(!active(i))
+        {
+          tnear(i) = std::numeric_limits<DataType>::max();
+          tfar(i) = -std::numeric_limits<DataType>::max();
+        }
+      }
+
+      for(unsigned int i = 0; i < RayPacket::size; ++i)
+      {
+        colors[i] = Color::Zero();
+      }
+      if(active.any())
+      {
+        HitRecord hits[RayPacket::size];
+        scene->getFirstCollisions(packet, tnear, tfar, active, hits);
+
+        for(unsigned int i = 0; i < RayPacket::size; ++i)
+        {
+          if(hits[i].primitive != NULL)
+          {
+            computeColor(packet[i], hits[i], colors[i], 0);
+          }
+        }
+      }
+      packet.clear();
+    }
+
+  private:
+    /**
+     * Computes the color for a ray that hit a primitive
+     * @param ray is the ray to use
+     * @param hit is the record filled by the intersection, completed by the shading
+     * @param color is the color to specify
+     * @param level is the level of the ray (primary ray = 0)
+     */
+    void computeColor(const Ray& ray, HitRecord& hit, Color& color, unsigned int level) const
+    {
+      PrimitiveDispatch<Primitive>::computeHit(ray, hit);
+      color = scene->computeColor(hit);
 
       if(level < levels)
       {
-        Ray ray_sec(ray.origin() + dist * ray.direction(), ray.direction() - (ray.direction().dot(caracteristics.normal)) * 2 * caracteristics.normal);
-        normalize(ray_sec.direction());
+        Vector3df direction_sec = ray.direction() - (ray.direction().dot(hit.normal)) * 2 * hit.normal;
+        normalize(direction_sec);
+        Ray ray_sec(hit.point, direction_sec);
         Color color_sec = Color::Zero();
         computeColor(ray_sec, color_sec, level+1);
 
-        color += color_sec * primitive->getReflection();
+        color += color_sec * scene->getMaterial(hit.primitive->getMaterial()).reflection;
       }
     }
 
-  private:
     /// Updates the parameters of the raytracer
     void updateParameters()
     {
@@ -90,6 +168,48 @@ namespace IRT
       orientation_v *= height / pixelHeight;
     }
     
+    /// Sets the color of a pixel of the screen
+    void setPixel(DataType* screen, unsigned int i, unsigned int j, const Color& color) const
+    {
+      for(unsigned int k = 0; k < nbColors; ++k)
+        screen[nbColors * (j * pixelWidth + i) + k] = color(k);
+    }
+
+    /**
+     * Draws a rectangle of the screen
+     * Without oversampling, a packet holds the rays of a square of 2x2 pixels, the last row and column of an odd rectangle being drawn pixel by pixel.
+     * With oversampling, the sampler packs the sub-pixel samples of each pixel.
+     */
+    void drawRange(DataType* screen, const BoundingBox& bb, unsigned int i_begin, unsigned int i_end, unsigned int j_begin, unsigned int j_end) const
+    {
+      Ray ray(origin, direction);
+      unsigned int j = j_begin;
+      if(sampler.getOversampling() == 1)
+      {
+        for(; j + 1 < j_end; j += 2)
+        {
+          unsigned int i = i_begin;
+          for(; i + 1 < i_end; i += 2)
+          {
+            Color colors[RayPacket::size];
+            sampler.computePixelsColors(this, bb, ray, i, j, colors);
+            for(unsigned int k = 0; k < RayPacket::size; ++k)
+              setPixel(screen, i + k % 2, j + k / 2, colors[k]);
+          }
+          if(i < i_end)
+          {
+            setPixel(screen, i, j, sampler.computeColor(this, bb, ray, i, j));
+            setPixel(screen, i, j + 1, sampler.computeColor(this, bb, ray, i, j + 1));
+          }
+        }
+      }
+      for(; j < j_end; ++j)
+      {
+        for(unsigned int i = i_begin; i < i_end; ++i)
+          setPixel(screen, i, j, sampler.computeColor(this, bb, ray, i, j));
+      }
+    }
+    
     void hitLevel(const Ray& ray, int& level)
     {
       DataType tnear;
@@ -117,11 +237,45 @@ namespace IRT
       dist = scene->getHitDistance(ray, tnear, tfar);
     }
 
+    void hitStatistics(const Ray& ray, long type, int& value)
+    {
+      DataType tnear;
+      DataType tfar;
+
+      if(!scene->getBoundingBox().getEntryExitDistances(ray, tnear, tfar))
+      {
+        return;
+      }
+
+      TraversalStatistics ray_statistics = scene->getTraversalStatistics(ray, tnear, tfar);
+      statistics += ray_statistics;
+
+      switch(type)
+      {
+      case 2:
+        value = ray_statistics.inner_nodes;
+        break;
+      case 3:
+        value = ray_statistics.leaves;
+        break;
+      case 4:
+        value = ray_statistics.intersection_tests;
+        break;
+      case 5:
+        value = ray_statistics.pushes;
+        break;
+      }
+    }
+
     /// Maximum recursion level
     unsigned int levels;
 
+    /// Traversal statistics of the last checkDraw() call
+    TraversalStatistics statistics;
+
     Sampler sampler;
-#ifdef USE_TBB
+#if defined(USE_TBB) && TBB_INTERFACE_VERSION < 12000
+    /// oneTBB no longer needs (nor provides) an explicit scheduler initialization
     tbb::task_scheduler_init init;
 #endif
 
@@ -152,62 +306,42 @@ namespace IRT
     class RaytracerOperator
     {
       const Raytracer* raytracer;
-      const Sampler& sampler;
       DataType* screen;
-      unsigned int pixelWidth;
       const BoundingBox& bb;
-      Point3df origin;
-      Vector3df direction;
 
     public:
-      RaytracerOperator(const Raytracer* raytracer, const Sampler& sampler, DataType* screen, unsigned int pixelWidth, const BoundingBox& bb, const Point3df& origin, const Vector3df& direction)
-      :raytracer(raytracer), sampler(sampler), screen(screen), pixelWidth(pixelWidth), bb(bb), origin(origin), direction(direction)
+      RaytracerOperator(const Raytracer* raytracer, DataType* screen, const BoundingBox& bb)
+      :raytracer(raytracer), screen(screen), bb(bb)
       {
       }
 
       void operator()(const tbb::blocked_range2d<unsigned int>& range) const
       {
-        Ray ray(origin, direction);
-        for( unsigned int j=range.cols().begin(); j!=range.cols().end(); ++j )
-        {
-          for( unsigned int i=range.rows().begin(); i!=range.rows().end(); ++i )
-          {
-            Color final_color = sampler.computeColor(raytracer, bb, ray, i, j);
-
-            for(unsigned int k = 0; k < nbColors; ++k)
-              screen[nbColors * (j * pixelWidth + i) + k] = final_color(k);
-          }
-        }
+        raytracer->drawRange(screen, bb, range.rows().begin(), range.rows().end(), range.cols().begin(), range.cols().end());
       }
     };
   public:
     void draw(DataType* screen) const
     {
-      tbb::parallel_for( tbb::blocked_range2d<unsigned int>(0, pixelWidth, 32, 0, pixelHeight, 32), RaytracerOperator(this, sampler, screen, pixelWidth, scene->getBoundingBox(), origin, direction) );
+      tbb::parallel_for( tbb::blocked_range2d<unsigned int>(0, pixelWidth, 32, 0, pixelHeight, 32), RaytracerOperator(this, screen, scene->getBoundingBox()) );
     }
 #else
     void draw(DataType* screen) const
     {
-      Ray ray(origin, direction);
       const BoundingBox& bb = scene->getBoundingBox();
 #ifdef USE_ANNOTATE
       ANNOTATE_SITE_BEGIN( draw_scene )
 #endif
-      for(unsigned int j = 0; j < pixelHeight; ++j)
+      // Two rows at a time, so that the squares of pixels of the packets are not split
+      for(unsigned int j = 0; j < pixelHeight; j += 2)
       {
-        for(unsigned int i = 0; i < pixelWidth; ++i)
-        {
 #ifdef USE_ANNOTATE
-          ANNOTATE_TASK_BEGIN( ray )
+        ANNOTATE_TASK_BEGIN( ray )
 #endif
-          Color final_color = sampler.computeColor(this, bb, ray, i, j);
-
-          for(unsigned int k = 0; k < nbColors; ++k)
-              screen[nbColors * (j * pixelWidth + i) + k] = final_color(k);
+        drawRange(screen, bb, 0, pixelWidth, j, std::min<unsigned int>(j + 2, pixelHeight));
 #ifdef USE_ANNOTATE
-          ANNOTATE_TASK_END( ray )
+        ANNOTATE_TASK_END( ray )
 #endif
-        }
       }
 #ifdef USE_ANNOTATE
       ANNOTATE_SITE_END( draw_scene )
@@ -218,12 +352,13 @@ namespace IRT
     /**
      * @brief checkDraw allows to display some information of how the raytracer works
      * @param screen is the screen where everything will be drawn
-     * @param type is 0 to get kd-tree hit level, 1 to check distance
+     * @param type is 0 to get kd-tree hit level, 1 to check distance, 2 to count the inner nodes visited, 3 the leaves visited, 4 the intersection tests and 5 the stack pushes
      */
     void checkDraw(int* screen, long type)
     {
       Ray ray(origin, direction);
       const BoundingBox& bb = scene->getBoundingBox();
+      statistics = TraversalStatistics();
       
       switch(type)
       {
@@ -252,8 +387,33 @@ namespace IRT
             }
           }
         }
+        break;
+      case 2:
+      case 3:
+      case 4:
+      case 5:
+        for(unsigned int j = 0; j < pixelHeight; ++j)
+        {
+          for(unsigned int i = 0; i < pixelWidth; ++i)
+          {
+            generateRay(i, j, ray);
+            if(mustShoot(ray, bb))
+            {
+              hitStatistics(ray, type, screen[j * pixelWidth + i]);
+            }
+          }
+        }
       }
     }
+
+    /**
+     * Returns the traversal statistics summed over all the rays of the last checkDraw() call with a type between 2 and 5
+     * @return the statistics of the frame
+     */
+    const TraversalStatistics& getStatistics() const
+    {
+      return statistics;
+    }
     
     /**
      * Sets the size of the screen
@@ -354,21 +514,12 @@ namespace IRT
       */
     bool mustShoot(const Ray& ray, const BoundingBox& bb) const
     {
+      bool outside = false;
       for ( int i = 0; i < 3; ++i )
       {
-        if (ray.direction()(i) < 0)
-        {
-          if (ray.origin()(i) < bb.corner1(i))
-          {
-            return false;
-          }
-        }
-        else if (ray.origin()(i) > bb.corner2(i))
-        {
-          return false;
-        }
+        outside |= ray.sign(i) ? ray.origin()(i) < bb.corner1(i) : ray.origin()(i) > bb.corner2(i);
       }
-      return true;
+      return !outside;
     }
    private:
     /// Origin of the field of view
@@ -66,6 +66,7 @@ namespace IRT
 
     void draw(IRT::DataType* INPLACE_ARRAY);
     void checkDraw(int* INPLACE_ARRAY, long type);
+    const IRT::TraversalStatistics& getStatistics();
     void setResolution(unsigned long pixelWidth, unsigned long pixelHeight);
     std::pair<unsigned long, unsigned long> getResolution();
     void setScene(IRT::SimpleScene* scene);
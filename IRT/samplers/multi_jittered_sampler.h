@@ -15,6 +15,7 @@
 #include <boost/random/uniform_real.hpp>
 
 #include "../common.h"
+#include "../ray_packet.h"
 
 namespace IRT
 {
@@ -68,22 +69,35 @@ namespace IRT
     Color computeColor(const Raytracer<MultiJitteredSampler>* raytracer, const BoundingBox& bb, Ray& ray, int i, int j) const
     {
       Color final_color = Color::Zero();
+      RayPacket packet(ray);
       for(typename std::vector<std::pair<DataType, DataType> >::const_iterator sample = samples.begin(); sample != samples.end(); ++sample)
       {
-        raytracer->generateRay(i + sample->first, j + sample->second, ray);
-        Color color = Color::Zero();
-        if(raytracer->mustShoot(ray, bb))
+        raytracer->generateRay(i + sample->first, j + sample->second, packet.next());
+        if(packet.full())
         {
-          raytracer->computeColor(ray, color);
+          final_color += raytracer->computeColor(packet, bb);
         }
-
-        final_color += color;
       }
+      final_color += raytracer->computeColor(packet, bb);
       final_color *= inverse_oversampling * inverse_oversampling;
 
       return final_color;
     }
 
+    /**
+     * Computes the colors of a square of 2x2 pixels without oversampling, their rays being traced as one packet
+     * @param colors is filled with the colors of the pixels (i, j), (i + 1, j), (i, j + 1) and (i + 1, j + 1)
+     */
+    void computePixelsColors(const Raytracer<MultiJitteredSampler>* raytracer, const BoundingBox& bb, Ray& ray, int i, int j, Color* colors) const
+    {
+      RayPacket packet(ray);
+      for(unsigned int k = 0; k < RayPacket::size; ++k)
+      {
+        raytracer->generateRay(i + k % 2 + samples.front().first, j + k / 2 + samples.front().second, packet.next());
+      }
+      raytracer->computeColors(packet, bb, colors);
+    }
+
   protected:
     unsigned int oversampling;
     DataType inverse_oversampling;
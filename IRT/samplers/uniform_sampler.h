@@ -7,6 +7,7 @@
 #define UNIFORMSAMPLER
 
 #include "../common.h"
+#include "../ray_packet.h"
 
 namespace IRT
 {
@@ -35,25 +36,38 @@ namespace IRT
     Color computeColor(const Raytracer<UniformSampler>* raytracer, const BoundingBox& bb, Ray& ray, int i, int j) const
     {
       Color final_color = Color::Zero();
+      RayPacket packet(ray);
       for(float l = -1/2. + inverse_oversampling / 2; l < 1/2.; l += inverse_oversampling)
       {
         for(float k = -1/2. + inverse_oversampling / 2; k < 1/2.; k += inverse_oversampling)
         {
-          raytracer->generateRay(i + k, j + l, ray);
-          Color color = Color::Zero();
-          if(raytracer->mustShoot(ray, bb))
+          raytracer->generateRay(i + k, j + l, packet.next());
+          if(packet.full())
           {
-            raytracer->computeColor(ray, color);
+            final_color += raytracer->computeColor(packet, bb);
           }
-
-          final_color += color;
         }
       }
+      final_color += raytracer->computeColor(packet, bb);
       final_color *= inverse_oversampling * inverse_oversampling;
 
       return final_color;
     }
 
+    /**
+     * Computes the colors of a square of 2x2 pixels without oversampling, their rays being traced as one packet
+     * @param colors is filled with the colors of the pixels (i, j), (i + 1, j), (i, j + 1) and (i + 1, j + 1)
+     */
+    void computePixelsColors(const Raytracer<UniformSampler>* raytracer, const BoundingBox& bb, Ray& ray, int i, int j, Color* colors) const
+    {
+      RayPacket packet(ray);
+      for(unsigned int k = 0; k < RayPacket::size; ++k)
+      {
+        raytracer->generateRay(i + k % 2, j + k / 2, packet.next());
+      }
+      raytracer->computeColors(packet, bb, colors);
+    }
+
   protected:
     unsigned int oversampling;
     DataType inverse_oversampling;
@@ -0,0 +1,399 @@
+/**
+ * \file scene_file.cpp
+ * Implementation of the binary scene file
+ */
+
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <stdexcept>
+
+#include "scene_file.h"
+#include "simple_scene.h"
+#include "primitives.h"
+#include "light.h"
+#include "mapped_file.h"
+
+namespace IRT
+{
+  namespace
+  {
+    typedef KDTree<Primitive>::KDTreeNode KDTreeNode;
+
+    /// Identifies the format
+    const char magic[8] = {'I', 'R', 'T', 'S', 'C', 'E', 'N', 'E'};
+
+    /// Beginning of the file
+    struct Header
+    {
+      char magic[8];
+      unsigned int version;
+      /// Sizes of the stored types, a file being only opened by a build using the same ones
+      unsigned int data_type_size;
+      unsigned int node_size;
+      unsigned int colors;
+      unsigned int material_count;
+      unsigned int primitive_count;
+      unsigned int light_count;
+      unsigned int node_count;
+      unsigned int leaf_primitive_count;
+      /// Bounding box of the scene, the first corner followed by the second one
+      DataType bb[6];
+    };
+
+    /// Kinds of primitives that can be stored
+    enum PrimitiveType
+    {
+      SphereType,
+      BoxType,
+      TriangleType
+    };
+
+    /// An entry of the material table
+    struct MaterialRecord
+    {
+      DataType color[nbColors];
+      DataType reflection;
+      DataType diffuse;
+    };
+
+    /// Flag of a primitive record for a triangle ignoring its back face
+    const unsigned int back_face_culling_flag = 1;
+
+    /// A primitive with the index of its material in the material table
+    struct PrimitiveRecord
+    {
+      unsigned int type;
+      unsigned int material;
+      /// Options of the primitive, as back_face_culling_flag
+      unsigned int flags;
+      /// Center and radius of a sphere, corners of a box or of a triangle
+      DataType geometry[9];
+    };
+
+    struct LightRecord
+    {
+      DataType center[3];
+      DataType color[nbColors];
+    };
+
+    /// Offsets of the sections of a file, each section starting on 8 bytes
+    struct Layout
+    {
+      unsigned long materials;
+      unsigned long primitives;
+      unsigned long lights;
+      unsigned long nodes;
+      unsigned long leaf_primitives;
+      unsigned long size;
+
+      static unsigned long align(unsigned long offset)
+      {
+        return (offset + 7) & ~7UL;
+      }
+
+      Layout(const Header& header)
+      {
+        materials = align(sizeof(Header));
+        primitives = align(materials + header.material_count * sizeof(MaterialRecord));
+        lights = align(primitives + header.primitive_count * sizeof(PrimitiveRecord));
+        nodes = align(lights + header.light_count * sizeof(LightRecord));
+        leaf_primitives = align(nodes + header.node_count * sizeof(KDTreeNode));
+        size = leaf_primitives + header.leaf_primitive_count * sizeof(unsigned int);
+      }
+    };
+
+    MaterialRecord makeRecord(const Material& material)
+    {
+      MaterialRecord record;
+      for(unsigned int i = 0; i < nbColors; ++i)
+      {
+        record.color[i] = material.color(i);
+      }
+      record.reflection = material.reflection;
+      record.diffuse = material.diffuse;
+      return record;
+    }
+
+    PrimitiveRecord makeRecord(const Primitive* primitive)
+    {
+      PrimitiveRecord record;
+      std::memset(&record, 0, sizeof(record));
+
+      const Point3df* points[3] = {NULL, NULL, NULL};
+      if(const Sphere* sphere = dynamic_cast<const Sphere*>(primitive))
+      {
+        record.type = SphereType;
+        points[0] = &sphere->getCenter();
+        record.geometry[3] = sphere->getRadius();
+      }
+      else if(const Box* box = dynamic_cast<const Box*>(primitive))
+      {
+        record.type = BoxType;
+        points[0] = &box->getCorner1();
+        points[1] = &box->getCorner2();
+      }
+      else if(const Triangle* triangle = dynamic_cast<const Triangle*>(primitive))
+      {
+        record.type = TriangleType;
+        points[0] = &triangle->getCorner1();
+        points[1] = &triangle->getCorner2();
+        points[2] = &triangle->getCorner3();
+        if(triangle->getBackFaceCulling())
+        {
+          record.flags |= back_face_culling_flag;
+        }
+      }
+      else
+      {
+        throw std::invalid_argument("Only spheres, boxes and triangles can be saved");
+      }
+
+      for(int i = 0; i < 3 && points[i] != NULL; ++i)
+      {
+        for(int j = 0; j < 3; ++j)
+        {
+          record.geometry[3 * i + j] = (*points[i])(j);
+        }
+      }
+      record.material = primitive->getMaterial();
+      return record;
+    }
+
+    Primitive* createPrimitive(const PrimitiveRecord& record)
+    {
+      const DataType* geometry = record.geometry;
+      Primitive* primitive;
+      switch(record.type)
+      {
+      case SphereType:
+        primitive = new Sphere(Point3df(geometry[0], geometry[1], geometry[2]), geometry[3]);
+        break;
+      case BoxType:
+        primitive = new Box(Point3df(geometry[0], geometry[1], geometry[2]), Point3df(geometry[3], geometry[4], geometry[5]));
+        break;
+      case TriangleType:
+        {
+          Triangle* triangle = new Triangle(Point3df(geometry[0], geometry[1], geometry[2]), Point3df(geometry[3], geometry[4], geometry[5]), Point3df(geometry[6], geometry[7], geometry[8]));
+          triangle->setBackFaceCulling((record.flags & back_face_culling_flag) != 0);
+          primitive = triangle;
+        }
+        break;
+      default:
+        throw std::runtime_error("Unknown primitive type in the scene file");
+      }
+      return primitive;
+    }
+
+    Material createMaterial(const MaterialRecord& record)
+    {
+      Color color;
+      for(unsigned int i = 0; i < nbColors; ++i)
+      {
+        color(i) = record.color[i];
+      }
+      return Material(color, record.reflection, record.diffuse);
+    }
+
+    /// Checks that every child and every leaf range of the nodes is inside the file, and that no leaf is deferred as only built trees are saved
+    void checkNodes(const KDTreeNode* nodes, unsigned long node_count, unsigned long leaf_primitive_count)
+    {
+      for(unsigned long i = 0; i < node_count; ++i)
+      {
+        const KDTreeNode& node = nodes[i];
+        bool valid;
+        if(node.isDeferred())
+        {
+          valid = false;
+        }
+        else if(node.isLeaf())
+        {
+          valid = static_cast<unsigned long>(node.getPrimitivesOffset()) + node.getPrimitivesCount() <= leaf_primitive_count;
+        }
+        else
+        {
+          valid = node.leftNode() > &node && node.rightNode() < nodes + node_count;
+        }
+        if(!valid)
+          throw std::runtime_error("Corrupted kd-tree in the scene file");
+      }
+    }
+
+    template<class T>
+    void write(std::ofstream& stream, const T& value)
+    {
+      stream.write(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    void pad(std::ofstream& stream, unsigned long offset)
+    {
+      static const char zeros[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+      stream.write(zeros, Layout::align(offset) - offset);
+    }
+  }
+
+  void SceneFile::save(SimpleScene* scene, const std::string& filename)
+  {
+    const KDTree<Primitive>& tree = scene->tree;
+    if(tree.hasDeferredLeaves())
+    {
+      throw std::invalid_argument("A kd-tree built lazily cannot be saved");
+    }
+    const std::vector<Primitive*>& leaf_primitives = tree.getAllLeafPrimitives();
+
+    Header header;
+    std::memcpy(header.magic, magic, sizeof(magic));
+    header.version = version;
+    header.data_type_size = sizeof(DataType);
+    header.node_size = sizeof(KDTreeNode);
+    header.colors = nbColors;
+    header.material_count = scene->materials.size();
+    header.primitive_count = scene->primitives.size();
+    header.light_count = scene->lights.size();
+    header.node_count = tree.getNodeCount();
+    header.leaf_primitive_count = leaf_primitives.size();
+    for(int i = 0; i < 3; ++i)
+    {
+      header.bb[i] = scene->bb.corner1(i);
+      header.bb[3 + i] = scene->bb.corner2(i);
+    }
+    Layout layout(header);
+
+    std::vector<PrimitiveRecord> records;
+    records.reserve(scene->primitives.size());
+    std::map<const Primitive*, unsigned int> indices;
+    for(unsigned int i = 0; i < scene->primitives.size(); ++i)
+    {
+      records.push_back(makeRecord(scene->primitives[i]));
+      indices[scene->primitives[i]] = i;
+    }
+
+    std::ofstream stream(filename.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+    if(!stream)
+      throw std::runtime_error("Cannot create " + filename);
+
+    write(stream, header);
+    pad(stream, sizeof(Header));
+
+    for(std::vector<Material>::const_iterator it = scene->materials.begin(); it != scene->materials.end(); ++it)
+    {
+      write(stream, makeRecord(*it));
+    }
+    pad(stream, layout.materials + header.material_count * sizeof(MaterialRecord));
+
+    if(!records.empty())
+    {
+      stream.write(reinterpret_cast<const char*>(&records[0]), records.size() * sizeof(PrimitiveRecord));
+    }
+    pad(stream, layout.primitives + records.size() * sizeof(PrimitiveRecord));
+
+    for(std::vector<Light*>::const_iterator it = scene->lights.begin(); it != scene->lights.end(); ++it)
+    {
+      LightRecord record;
+      for(int i = 0; i < 3; ++i)
+      {
+        record.center[i] = (*it)->getCenter()(i);
+      }
+      for(unsigned int i = 0; i < nbColors; ++i)
+      {
+        record.color[i] = (*it)->getColor()(i);
+      }
+      write(stream, record);
+    }
+    pad(stream, layout.lights + scene->lights.size() * sizeof(LightRecord));
+
+    stream.write(reinterpret_cast<const char*>(tree.getNodeData()), header.node_count * sizeof(KDTreeNode));
+    pad(stream, layout.nodes + header.node_count * sizeof(KDTreeNode));
+
+    for(std::vector<Primitive*>::const_iterator it = leaf_primitives.begin(); it != leaf_primitives.end(); ++it)
+    {
+      write(stream, indices[*it]);
+    }
+
+    if(!stream)
+      throw std::runtime_error("Cannot write " + filename);
+  }
+
+  SimpleScene* SceneFile::load(const std::string& filename)
+  {
+    MappedFile* file = new MappedFile(filename);
+    SimpleScene* scene = new SimpleScene;
+    // From now on, the scene deletes the file if anything goes wrong
+    scene->mapped_file = file;
+
+    try
+    {
+      const char* data = file->getData();
+      if(file->getSize() < sizeof(Header))
+        throw std::runtime_error("Truncated scene file " + filename);
+
+      const Header& header = *reinterpret_cast<const Header*>(data);
+      if(std::memcmp(header.magic, magic, sizeof(magic)) != 0)
+        throw std::runtime_error(filename + " is not a scene file");
+      if(header.version != version || header.data_type_size != sizeof(DataType) || header.node_size != sizeof(KDTreeNode) || header.colors != nbColors)
+        throw std::runtime_error(filename + " was saved with another version or build");
+
+      Layout layout(header);
+      if(file->getSize() < layout.size || header.node_count == 0 || header.material_count == 0)
+        throw std::runtime_error("Truncated scene file " + filename);
+
+      const MaterialRecord* materials = reinterpret_cast<const MaterialRecord*>(data + layout.materials);
+      scene->materials.clear();
+      scene->materials.reserve(header.material_count);
+      for(unsigned int i = 0; i < header.material_count; ++i)
+      {
+        scene->materials.push_back(createMaterial(materials[i]));
+      }
+
+      const PrimitiveRecord* records = reinterpret_cast<const PrimitiveRecord*>(data + layout.primitives);
+      scene->primitives.reserve(header.primitive_count);
+      for(unsigned int i = 0; i < header.primitive_count; ++i)
+      {
+        if(records[i].material >= header.material_count)
+          throw std::runtime_error("Corrupted material index in the scene file");
+        Primitive* primitive = createPrimitive(records[i]);
+        scene->primitives.push_back(primitive);
+        primitive->setMaterial(records[i].material);
+        scene->bounds.push_back(primitive->getBoundingBox());
+      }
+
+      const LightRecord* lights = reinterpret_cast<const LightRecord*>(data + layout.lights);
+      for(unsigned int i = 0; i < header.light_count; ++i)
+      {
+        Color color;
+        for(unsigned int j = 0; j < nbColors; ++j)
+        {
+          color(j) = lights[i].color[j];
+        }
+        scene->lights.push_back(new Light(Vector3df(lights[i].center[0], lights[i].center[1], lights[i].center[2]), color));
+      }
+
+      scene->bb.corner1 = Point3df(header.bb[0], header.bb[1], header.bb[2]);
+      scene->bb.corner2 = Point3df(header.bb[3], header.bb[4], header.bb[5]);
+
+      const KDTreeNode* nodes = reinterpret_cast<const KDTreeNode*>(data + layout.nodes);
+      checkNodes(nodes, header.node_count, header.leaf_primitive_count);
+
+      const unsigned int* indices = reinterpret_cast<const unsigned int*>(data + layout.leaf_primitives);
+      std::vector<Primitive*> leaf_primitives(header.leaf_primitive_count);
+      for(unsigned int i = 0; i < header.leaf_primitive_count; ++i)
+      {
+        if(indices[i] >= header.primitive_count)
+          throw std::runtime_error("Corrupted kd-tree in the scene file");
+        leaf_primitives[i] = scene->primitives[indices[i]];
+      }
+
+      scene->tree.setMappedNodes(nodes, header.node_count, leaf_primitives);
+      scene->tree.resetDegradation(scene->bb);
+      // The hierarchy is only built if it is selected
+      scene->outdated_accelerator = true;
+    }
+    catch(...)
+    {
+      delete scene;
+      throw;
+    }
+
+    return scene;
+  }
+}
@@ -0,0 +1,47 @@
+/**
+ * \file scene_file.h
+ * Describes the binary file of a scene with its kd-tree
+ */
+
+#ifndef SCENEFILE
+#define SCENEFILE
+
+#include <string>
+
+#include "common.h"
+
+namespace IRT
+{
+  class SimpleScene;
+
+  /**
+   * Saves a scene and its kd-tree in a binary file, and opens it by mapping it in memory
+   * The file holds a versioned header, the material table, the primitives with the index of their material and their options, the lights, the nodes of the kd-tree and the indices of the primitives of its leaves.
+   * The nodes are used in place in the mapping, so processes opening the same file share their pages, and no tree is built when a scene is opened.
+   * Only spheres, boxes and triangles can be saved.
+   */
+  struct SceneFile
+  {
+    /// Version of the format, increased each time the layout changes
+    static const unsigned int version = 3;
+
+    /**
+     * Saves a scene with its kd-tree, built or not
+     * @param scene is the scene to save
+     * @param filename is the name of the file to create
+     * @throw std::invalid_argument if the scene holds a primitive that cannot be saved
+     * @throw std::runtime_error if the file cannot be written
+     */
+    _export_tools static void save(SimpleScene* scene, const std::string& filename);
+
+    /**
+     * Opens a scene, its kd-tree being ready to use
+     * @param filename is the name of the file to open
+     * @return the new scene, owning the mapping of the file
+     * @throw std::runtime_error if the file cannot be mapped or is not a valid scene file of this version
+     */
+    _export_tools static SimpleScene* load(const std::string& filename);
+  };
+}
+
+#endif
@@ -0,0 +1,46 @@
+/* -*- C -*-  (not really, but good for syntax highlighting) */
+
+#ifdef SWIGPYTHON
+
+%{
+#include <stdexcept>
+#include "IRT/scene_file.h"
+%}
+
+%include "std_string.i"
+
+%exception IRT::SceneFile::save {
+  try
+  {
+    $action
+  }
+  catch(const std::exception& e)
+  {
+    PyErr_SetString(PyExc_IOError, e.what());
+    SWIG_fail;
+  }
+}
+
+%exception IRT::SceneFile::load {
+  try
+  {
+    $action
+  }
+  catch(const std::exception& e)
+  {
+    PyErr_SetString(PyExc_IOError, e.what());
+    SWIG_fail;
+  }
+}
+
+%newobject IRT::SceneFile::load;
+
+namespace IRT
+{
+  struct SceneFile
+  {
+    static void save(IRT::SimpleScene* scene, const std::string& filename);
+    static IRT::SimpleScene* load(const std::string& filename);
+  };
+}
+#endif /* SWIGPYTHON */
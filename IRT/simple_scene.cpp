@@ -8,24 +8,33 @@
 #include "simple_scene.h"
 #include "primitives.h"
 #include "light.h"
+#include "instance.h"
+#include "triangle_mesh.h"
+#include "mapped_file.h"
 
 #include "build_kdtree.h"
+#include "build_bvh.h"
 
 namespace IRT
 {
   SimpleScene::SimpleScene()
-    :primitives(), lights()
+    :primitives(), accelerator(&tree), outdated_accelerator(false), lights(), prototypes(), meshes(), materials(1), mapped_file(NULL), bb(BoundingBox::empty())
   {
-    bb.corner1 = Point3df::Constant(std::numeric_limits<float>::max());
-    bb.corner2 = Point3df::Constant(std::numeric_limits<float>::min());
   }
 
   SimpleScene::~SimpleScene()
   {
+    // The triangles of the meshes are owned by their mesh
     for(std::vector<Primitive*>::const_iterator it = primitives.begin(); it != primitives.end(); ++it)
-      delete *it;
+      if(dynamic_cast<MeshTriangle*>(*it) == NULL)
+        delete *it;
     for(std::vector<Light*>::const_iterator it = lights.begin(); it != lights.end(); ++it)
       delete *it;
+    for(std::vector<Prototype*>::const_iterator it = prototypes.begin(); it != prototypes.end(); ++it)
+      delete *it;
+    for(std::vector<TriangleMesh*>::const_iterator it = meshes.begin(); it != meshes.end(); ++it)
+      delete *it;
+    delete mapped_file;
   }
 
   Primitive* SimpleScene::getPrimitive(unsigned long index)
@@ -38,7 +47,13 @@ namespace IRT
     std::vector<Primitive*>::iterator it = primitives.begin();
     std::advance(it, index);
     Primitive* primitive = *it;
+    if(dynamic_cast<MeshTriangle*>(primitive) != NULL)
+      throw std::invalid_argument("A triangle of a mesh cannot be removed");
+    BoundingBox primitive_bb = bounds.getBoundingBox(index);
     primitives.erase(it);
+    bounds.erase(index);
+    accelerator->removePrimitive(primitive, primitive_bb, bb);
+    outdated_accelerator = true;
     return primitive;
   }
 
@@ -49,15 +64,45 @@ namespace IRT
 
   void SimpleScene::computeBoundingBox()
   {
-    std::vector<Primitive*>::iterator it = primitives.begin();
-    bb = (*it)->getBoundingBox();
+    bb = bounds.getUnion();
+  }
+
+  const PrimitiveBounds& SimpleScene::getPrimitiveBounds() const
+  {
+    return bounds;
+  }
+
+  void SimpleScene::updatePrimitiveBounds(unsigned long index)
+  {
+    BoundingBox old_bb = bounds.getBoundingBox(index);
+    BoundingBox primitive_bb = primitives[index]->getBoundingBox();
+    bounds.set(index, primitive_bb);
 
-    for(++it; it != primitives.end(); ++it)
+    bb.corner1 = bb.corner1.array().min(primitive_bb.corner1.array());
+    bb.corner2 = bb.corner2.array().max(primitive_bb.corner2.array());
+
+    accelerator->removePrimitive(primitives[index], old_bb, bb);
+    accelerator->insertPrimitive(primitives[index], primitive_bb, bb);
+    outdated_accelerator = true;
+  }
+
+  bool SimpleScene::updateAccelerators(DataType max_degradation)
+  {
+    if(accelerator == &bvh)
     {
-      BoundingBox bb_bis = (*it)->getBoundingBox();
-      bb.corner1 = bb.corner1.array().min(bb_bis.corner1.array());
-      bb.corner2 = bb.corner2.array().max(bb_bis.corner2.array());
+      bvh.refit(primitives, bounds);
+      if(bvh.getDegradation() <= max_degradation)
+        return false;
+      computeBoundingBox();
+      BuildBVH::automatic_build(this);
+      return true;
     }
+
+    if(tree.getNodeCount() == 1 || tree.getDegradation() <= max_degradation)
+      return false;
+    computeBoundingBox();
+    BuildKDTree::automatic_build(this);
+    return true;
   }
 
   Light* SimpleScene::getLight(unsigned long index)
@@ -76,38 +121,54 @@ namespace IRT
   
   Primitive* SimpleScene::getFirstCollision(const Ray& ray, float& dist, float tnear, float tfar)
   {
-    return tree.getFirstCollision<KDTree<Primitive>::DefaultTraversal>(ray, dist, tnear, tfar);
+    return accelerator->getFirstCollision(ray, dist, tnear, tfar);
+  }
+
+  Primitive* SimpleScene::getFirstCollision(const Ray& ray, HitRecord& hit, float tnear, float tfar)
+  {
+    return accelerator->getFirstCollision(ray, hit, tnear, tfar);
   }
   
+  void SimpleScene::getFirstCollisions(const RayPacket& packet, const RayPacket::Array& tnear, const RayPacket::Array& tfar, const RayPacket::Mask& active, HitRecord* hits)
+  {
+    accelerator->getFirstCollisions(packet, tnear, tfar, active, hits);
+  }
+
   long SimpleScene::getHitLevel(const Ray& ray, float tnear, float tfar)
   {
-    float dist;
-    return tree.getFirstCollision<KDTree<Primitive>::HitLevelTraversal>(ray, dist, tnear, tfar);
+    return accelerator->getHitLevel(ray, tnear, tfar);
   }
   
+  TraversalStatistics SimpleScene::getTraversalStatistics(const Ray& ray, float tnear, float tfar)
+  {
+    return accelerator->getTraversalStatistics(ray, tnear, tfar);
+  }
+
   long SimpleScene::getHitDistance(const Ray& ray, float tnear, float tfar)
   {
-    float dist;
-    tree.getFirstCollision<KDTree<Primitive>::HitLevelTraversal>(ray, dist, tnear, tfar);
+    float dist = 0;
+    if(accelerator->getFirstCollision(ray, dist, tnear, tfar) == NULL)
+      return 0;
     return dist;
   }
 
-  const Color SimpleScene::computeColor(const Point3df& center, const MaterialPoint& caracteristics, const Primitive* primitive)
+  const Color SimpleScene::computeColor(const HitRecord& hit)
   {
+    const Material& material = materials[hit.primitive->getMaterial()];
     Color t_color(Color::Zero());
     for(std::vector<Light*>::const_iterator it = lights.begin(); it != lights.end(); ++it)
     {
-      Vector3df path = (*it)->getCenter() - center;
+      Vector3df path = (*it)->getCenter() - hit.point;
       float pathSize = std::sqrt(norm2(path));
       path = path.cwiseProduct(Vector3df::Constant(1/pathSize));
-      Ray ray(center, path);
+      Ray ray(hit.point, path);
       if(testCollision(ray, pathSize))
         continue;
 
-      float cosphi = path.dot(caracteristics.normal) * primitive->getDiffuse();
+      float cosphi = path.dot(hit.normal) * material.diffuse;
       if(cosphi < 0.)
         continue;
-      t_color += (primitive->getColor() * cosphi).cwiseProduct((*it)->computeColor(ray, pathSize));
+      t_color += (material.color * cosphi).cwiseProduct((*it)->computeColor(ray, pathSize));
     }
 
     return t_color;
@@ -115,19 +176,24 @@ namespace IRT
 
   bool SimpleScene::testCollision(const Ray& ray, float dist)
   {
-    return (tree.getFirstCollision<KDTree<Primitive>::DefaultTraversal>(ray, dist, 0, dist) != NULL);
+    return accelerator->testCollision(ray, 0, dist);
   }
 
   unsigned long SimpleScene::addPrimitive(Primitive* primitive)
   {
     if(std::find(primitives.begin(), primitives.end(), primitive) != primitives.end())
       throw std::out_of_range("Primitive already added");
+    if(primitive->getMaterial() >= materials.size())
+      throw std::out_of_range("Material not in the material table");
 
     BoundingBox primitive_bb = primitive->getBoundingBox();
     bb.corner1 = bb.corner1.array().min(primitive_bb.corner1.array());
     bb.corner2 = bb.corner2.array().max(primitive_bb.corner2.array());
 
     primitives.push_back(primitive);
+    bounds.push_back(primitive_bb);
+    accelerator->insertPrimitive(primitive, primitive_bb, bb);
+    outdated_accelerator = true;
     return primitives.size() - 1;
   }
 
@@ -149,6 +215,70 @@ namespace IRT
     return lights.size() - 1;
   }
 
+  unsigned long SimpleScene::addPrototype(Prototype* prototype)
+  {
+    if(std::find(prototypes.begin(), prototypes.end(), prototype) != prototypes.end())
+      throw std::out_of_range("Prototype already added");
+
+    prototypes.push_back(prototype);
+    return prototypes.size() - 1;
+  }
+
+  Prototype* SimpleScene::getPrototype(unsigned long index)
+  {
+    return prototypes[index];
+  }
+
+  unsigned long SimpleScene::addMesh(TriangleMesh* mesh)
+  {
+    if(std::find(meshes.begin(), meshes.end(), mesh) != meshes.end())
+      throw std::out_of_range("Mesh already added");
+    for(unsigned long i = 0; i < mesh->getTriangleCount(); ++i)
+    {
+      if(mesh->getTriangle(i)->getMaterial() >= materials.size())
+        throw std::out_of_range("Material not in the material table");
+    }
+
+    meshes.push_back(mesh);
+    primitives.reserve(primitives.size() + mesh->getTriangleCount());
+    for(unsigned long i = 0; i < mesh->getTriangleCount(); ++i)
+    {
+      Primitive* primitive = mesh->getTriangle(i);
+      BoundingBox primitive_bb = primitive->getBoundingBox();
+      bb.corner1 = bb.corner1.array().min(primitive_bb.corner1.array());
+      bb.corner2 = bb.corner2.array().max(primitive_bb.corner2.array());
+
+      primitives.push_back(primitive);
+      bounds.push_back(primitive_bb);
+      accelerator->insertPrimitive(primitive, primitive_bb, bb);
+    }
+    outdated_accelerator = true;
+    return meshes.size() - 1;
+  }
+
+  TriangleMesh* SimpleScene::getMesh(unsigned long index)
+  {
+    return meshes[index];
+  }
+
+  unsigned int SimpleScene::addMaterial(const Color& color, DataType reflection, DataType diffuse)
+  {
+    materials.push_back(Material(color, reflection, diffuse));
+    return materials.size() - 1;
+  }
+
+  void SimpleScene::setMaterial(unsigned int index, const Color& color, DataType reflection, DataType diffuse)
+  {
+    if(index >= materials.size())
+      throw std::out_of_range("Material not in the material table");
+    materials[index] = Material(color, reflection, diffuse);
+  }
+
+  unsigned int SimpleScene::getMaterialCount() const
+  {
+    return materials.size();
+  }
+
   unsigned long SimpleScene::getLightIndex(Light* light)
   {
     std::vector<Light*>::const_iterator it;
@@ -163,8 +293,49 @@ namespace IRT
     return primitives;
   }
 
+  unsigned long SimpleScene::getAvoidedTests() const
+  {
+    return accelerator->getAvoidedTests();
+  }
+
+  void SimpleScene::resetAvoidedTests()
+  {
+    accelerator->resetAvoidedTests();
+  }
+
   KDTree<Primitive>& SimpleScene::getKDTree()
   {
     return tree;
   }
+
+  BVH<Primitive>& SimpleScene::getBVH()
+  {
+    return bvh;
+  }
+
+  void SimpleScene::setAccelerator(AcceleratorType type, bool built)
+  {
+    Accelerator<Primitive>* selected = &tree;
+    if(type == BoundingVolumeHierarchy)
+      selected = &bvh;
+    if(selected == accelerator)
+      return;
+
+    // The structure that was used followed all the updates
+    bool rebuild = outdated_accelerator && !built;
+    accelerator = selected;
+    outdated_accelerator = false;
+    if(!rebuild)
+      return;
+
+    if(type == BoundingVolumeHierarchy)
+      BuildBVH::automatic_build(this);
+    else
+      BuildKDTree::automatic_build(this);
+  }
+
+  SimpleScene::AcceleratorType SimpleScene::getAccelerator() const
+  {
+    return accelerator == &bvh ? BoundingVolumeHierarchy : KDTreeAccelerator;
+  }
 }
@@ -10,28 +10,62 @@
 
 #include "common.h"
 #include "ray.h"
+#include "ray_packet.h"
 #include "bounding_box.h"
+#include "material.h"
+#include "primitive_bounds.h"
 #include "kdtree.h"
+#include "bvh.h"
 
 namespace IRT
 {
   class Primitive;
+  class Prototype;
+  class TriangleMesh;
   class Light;
-  struct MaterialPoint;
+  class MappedFile;
+  struct HitRecord;
+  struct SceneFile;
 
   /// Description of a simple scene
   class SimpleScene
   {
+  public:
+    /// The structures that can accelerate the ray/primitive lookup
+    enum AcceleratorType
+    {
+      KDTreeAccelerator,
+      BoundingVolumeHierarchy
+    };
+
   private:
     /// Array for the primitives
     std::vector<Primitive*> primitives;
+    /// Cached bounds of the primitives, in the same order
+    PrimitiveBounds bounds;
     /// KD-tree
     KDTree<Primitive> tree;
+    /// Bounding volume hierarchy
+    BVH<Primitive> bvh;
+    /// The structure used by the queries, the kd-tree or the hierarchy, the only one kept up to date by the incremental updates
+    Accelerator<Primitive>* accelerator;
+    /// True when the structure that is not used missed some updates and must be rebuilt before being used
+    bool outdated_accelerator;
     /// Array for the lights
     std::vector<Light*> lights;
+    /// Array for the prototypes shared by the instances
+    std::vector<Prototype*> prototypes;
+    /// Array for the meshes, their triangles being in the primitives array
+    std::vector<TriangleMesh*> meshes;
+    /// Material table, referenced by index by the primitives, the first material being the default one
+    std::vector<Material> materials;
+    /// File whose kd-tree nodes are used in place, else NULL
+    MappedFile* mapped_file;
     
     BoundingBox bb;
 
+    friend struct SceneFile;
+
   public:
     /// Constructor
     _export_tools SimpleScene();
@@ -52,15 +86,36 @@ namespace IRT
      */
     _export_tools const BoundingBox& getBoundingBox() const;
 
-        /**
-     * Recomputes the bounding box
+    /**
+     * Recomputes the bounding box from the cached bounds of the primitives
      */
     _export_tools void computeBoundingBox();
 
     /**
-     * Removes a primitive and returns it
+     * Returns the cached bounds of the primitives
+     * @return the bounds, in the order of the primitives
+     */
+    _export_tools const PrimitiveBounds& getPrimitiveBounds() const;
+
+    /**
+     * Updates the cached bounds of a primitive after it was modified or moved, and moves it in the structure used by the queries without rebuilding it
+     * @param index is the index of the primitive
+     */
+    _export_tools void updatePrimitiveBounds(unsigned long index);
+
+    /**
+     * Rebuilds the structure used by the queries if the incremental updates degraded it too much
+     * The hierarchy is refitted first, the kd-tree is kept as long as the cost of its leaves stays under the threshold.
+     * @param max_degradation is the ratio between the current cost and the cost after the last build above which the structure is rebuilt
+     * @return true if the structure was rebuilt
+     */
+    _export_tools bool updateAccelerators(DataType max_degradation = 1.5f);
+
+    /**
+     * Removes a primitive and returns it, the structure used by the queries being updated without being rebuilt
      * @param index is the index of the primitive to get
      * @return the asked primitive
+     * @throw std::invalid_argument if the primitive is a triangle of a mesh
      */
     _export_tools Primitive* removePrimitive(unsigned long index);
 
@@ -85,7 +140,25 @@ namespace IRT
      * @return the index of the hit primitive, else -1
      */
     _export_tools Primitive* getFirstCollision(const Ray& ray, float& dist, float tfar, float tnear);
+
+    /**
+     * Returns the first primitive that is hit by the ray with the data of the hit
+     * @param ray is the ray to test
+     * @param hit is filled with the primitive, the distance and the data of the hit
+     * @return the hit primitive, else NULL
+     */
+    _export_tools Primitive* getFirstCollision(const Ray& ray, HitRecord& hit, float tnear, float tfar);
     
+    /**
+     * Returns the first primitives hit by a packet of rays
+     * @param packet is the packet of rays to test
+     * @param tnear is the entry distance of each ray
+     * @param tfar is the exit distance of each ray
+     * @param active indicates the rays to trace
+     * @param hits is filled with the record of the hit of each ray, its primitive being NULL if there is none
+     */
+    _export_tools void getFirstCollisions(const RayPacket& packet, const RayPacket::Array& tnear, const RayPacket::Array& tfar, const RayPacket::Mask& active, HitRecord* hits);
+
     /**
      * Returns the hit level in the tree
      * @param ray is the ray to test
@@ -93,6 +166,13 @@ namespace IRT
      */
     _export_tools long getHitLevel(const Ray& ray, float tfar, float tnear);
     
+    /**
+     * Returns the work done in the tree to find the first collision
+     * @param ray is the ray to test
+     * @return the traversal statistics of the ray
+     */
+    _export_tools TraversalStatistics getTraversalStatistics(const Ray& ray, float tnear, float tfar);
+
     /**
      * Returns the hit distance in the tree
      * @param ray is the ray to test
@@ -102,11 +182,10 @@ namespace IRT
 
     /**
      * Computes the color
-     * @param center is the point where the light will hit the primitive
-     * @param caracteristics is the caracteristics to the primitive
+     * @param hit is the record of the hit, with the point where the light will hit the primitive
      * @return the actual color of the point
      */
-    _export_tools const Color computeColor(const Point3df& center, const MaterialPoint& caracteristics, const Primitive* primitive);
+    _export_tools const Color computeColor(const HitRecord& hit);
 
     /**
      * Tests if a ray collides with objects in the scene
@@ -117,10 +196,10 @@ namespace IRT
     _export_tools bool testCollision(const Ray& ray, float dist);
 
     /**
-     * Adds a new primitive to the scene
+     * Adds a new primitive to the scene, the structure used by the queries being updated without being rebuilt
      * @param primitive is the primitive to add
      * @return the index of the primitive
-     * @throw std::out_of_range if the primitive was already added
+     * @throw std::out_of_range if the primitive was already added or if its material is not in the material table
      */
     _export_tools unsigned long addPrimitive(Primitive* primitive);
 
@@ -139,6 +218,68 @@ namespace IRT
      */
     _export_tools unsigned long addLight(Light* light);
 
+    /**
+     * Adds a new prototype to the scene, the scene taking its ownership
+     * @param prototype is the prototype to add
+     * @return the index of the prototype
+     * @throw std::out_of_range if the prototype was already added
+     */
+    _export_tools unsigned long addPrototype(Prototype* prototype);
+
+    /**
+     * Returns a prototype
+     * @param index is the index of the prototype to get
+     * @return the asked prototype
+     */
+    _export_tools Prototype* getPrototype(unsigned long index);
+
+    /**
+     * Adds a new mesh to the scene, the scene taking its ownership and each of its triangles being added as a primitive
+     * @param mesh is the mesh to add
+     * @return the index of the mesh
+     * @throw std::out_of_range if the mesh was already added or if the material of a triangle is not in the material table
+     */
+    _export_tools unsigned long addMesh(TriangleMesh* mesh);
+
+    /**
+     * Returns a mesh
+     * @param index is the index of the mesh to get
+     * @return the asked mesh
+     */
+    _export_tools TriangleMesh* getMesh(unsigned long index);
+
+    /**
+     * Adds a new material to the material table
+     * @param color is the color of the material
+     * @param reflection is the reflection factor
+     * @param diffuse is the diffuse factor
+     * @return the index of the material, to give to the primitives
+     */
+    _export_tools unsigned int addMaterial(const Color& color, DataType reflection, DataType diffuse);
+
+    /**
+     * Changes a material, and thus all the primitives using it
+     * @param index is the index of the material
+     * @param color is the new color
+     * @param reflection is the new reflection factor
+     * @param diffuse is the new diffuse factor
+     * @throw std::out_of_range if there is no such material
+     */
+    _export_tools void setMaterial(unsigned int index, const Color& color, DataType reflection, DataType diffuse);
+
+    /**
+     * Returns a material
+     * @param index is the index of the material
+     * @return the material
+     */
+    const Material& getMaterial(unsigned int index) const
+    {
+      return materials[index];
+    }
+
+    /// Returns the number of materials, the default one included
+    _export_tools unsigned int getMaterialCount() const;
+
     /**
      * Returns the index of the given light
      * @param light is the light to look for
@@ -153,11 +294,42 @@ namespace IRT
      */
     _export_tools const std::vector<Primitive*>& getPrimitives() const;
     
+    /**
+     * Returns the number of intersection tests skipped because the primitive was already tested by the same ray
+     * @return the number of skipped tests since the last reset
+     */
+    _export_tools unsigned long getAvoidedTests() const;
+
+    /**
+     * Resets the number of skipped intersection tests
+     */
+    _export_tools void resetAvoidedTests();
+
     /**
      * Returns the kd-tree
      * @return the kd-tree for modification
      */
     _export_tools KDTree<Primitive>& getKDTree();
+
+    /**
+     * Returns the bounding volume hierarchy
+     * @return the hierarchy for modification
+     */
+    _export_tools BVH<Primitive>& getBVH();
+
+    /**
+     * Selects the structure used by the queries
+     * Only the selected structure follows the primitives that are added, removed or moved, so the other one is rebuilt with its automatic builder when it is selected after such changes.
+     * @param type is the structure to use
+     * @param built is true when the structure was just built from all the primitives, as done by the builders, so that it is never rebuilt
+     */
+    _export_tools void setAccelerator(AcceleratorType type, bool built = false);
+
+    /**
+     * Returns the structure used by the queries
+     * @return the type of the structure
+     */
+    _export_tools AcceleratorType getAccelerator() const;
   };
 }
 
@@ -3,23 +3,72 @@
 #ifdef SWIGPYTHON
 
 %{
+#include <stdexcept>
 #include "IRT/simple_scene.h"
 %}
 
 %apply Pointer NONNULL{IRT::Primitive*};
 
+%exception IRT::SimpleScene::removePrimitive {
+  try
+  {
+    $action
+  }
+  catch(const std::invalid_argument& e)
+  {
+    PyErr_SetString(PyExc_ValueError, e.what());
+    SWIG_fail;
+  }
+}
+
+%define MATERIAL_EXCEPTION(method)
+%exception method {
+  try
+  {
+    $action
+  }
+  catch(const std::out_of_range& e)
+  {
+    PyErr_SetString(PyExc_IndexError, e.what());
+    SWIG_fail;
+  }
+}
+%enddef
+
+MATERIAL_EXCEPTION(IRT::SimpleScene::addPrimitive)
+MATERIAL_EXCEPTION(IRT::SimpleScene::addMesh)
+MATERIAL_EXCEPTION(IRT::SimpleScene::setMaterial)
+
 namespace IRT
 {
   class SimpleScene
   {
   public:
+    enum AcceleratorType
+    {
+      KDTreeAccelerator,
+      BoundingVolumeHierarchy
+    };
+
     SimpleScene();
     ~SimpleScene();
     IRT::Primitive* removePrimitive(unsigned long index);
     unsigned long addPrimitive(IRT::Primitive* primitive);
     IRT::Light* removeLight(unsigned long index);
     unsigned long addLight(IRT::Light* light);
+    unsigned long addPrototype(IRT::Prototype* prototype);
+    unsigned long addMesh(IRT::TriangleMesh* mesh);
+    unsigned int addMaterial(IRT::Color& color, float reflection, float diffuse);
+    void setMaterial(unsigned int index, IRT::Color& color, float reflection, float diffuse);
+    unsigned int getMaterialCount();
     const BoundingBox& getBoundingBox();
+    void updatePrimitiveBounds(unsigned long index);
+    bool updateAccelerators(float max_degradation = 1.5f);
+    unsigned long getAvoidedTests();
+    void resetAvoidedTests();
+    IRT::KDTree<IRT::Primitive>& getKDTree();
+    void setAccelerator(AcceleratorType type, bool built = false);
+    AcceleratorType getAccelerator();
   };
 }
 
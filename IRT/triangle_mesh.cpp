@@ -0,0 +1,96 @@
+/**
+ * \file triangle_mesh.cpp
+ * Implementation of the triangle meshes
+ */
+
+#include <stdexcept>
+
+#include "triangle_mesh.h"
+
+namespace IRT
+{
+  MeshTriangle::MeshTriangle(const TriangleMesh* mesh, unsigned int index)
+  :Primitive(MeshTriangleType), mesh(mesh), index(index)
+  {
+  }
+
+  MeshTriangle::~MeshTriangle()
+  {
+  }
+
+  BoundingBox MeshTriangle::getBoundingBox() const
+  {
+    const Point3df& corner1 = mesh->getCorner(index, 0);
+    const Point3df& corner2 = mesh->getCorner(index, 1);
+    const Point3df& corner3 = mesh->getCorner(index, 2);
+    BoundingBox bb;
+
+    bb.corner1 = corner1.array().min(corner2.array()).min(corner3.array());
+    bb.corner2 = corner1.array().max(corner2.array()).max(corner3.array());
+
+    return bb;
+  }
+
+  BoundingBox MeshTriangle::getClippedBoundingBox(const BoundingBox& box) const
+  {
+    return Triangle::clipTriangle(mesh->getCorner(index, 0), mesh->getCorner(index, 1), mesh->getCorner(index, 2), box);
+  }
+
+  unsigned int MeshTriangle::getIndex() const
+  {
+    return index;
+  }
+
+  TriangleMesh::TriangleMesh(const DataType* vertices, unsigned long vertex_count, const unsigned int* indices, unsigned long triangle_count)
+  :vertices(), indices(indices, indices + 3 * triangle_count), back_face_culling(false), triangles()
+  {
+    for(std::vector<unsigned int>::const_iterator it = this->indices.begin(); it != this->indices.end(); ++it)
+    {
+      if(*it >= vertex_count)
+        throw std::out_of_range("Vertex index out of range");
+    }
+
+    this->vertices.reserve(vertex_count);
+    for(unsigned long i = 0; i < vertex_count; ++i)
+    {
+      this->vertices.push_back(Point3df(vertices[3 * i], vertices[3 * i + 1], vertices[3 * i + 2]));
+    }
+
+    // The triangles are given to the scene by address, the array is never resized afterwards
+    triangles.reserve(triangle_count);
+    for(unsigned long i = 0; i < triangle_count; ++i)
+    {
+      triangles.push_back(MeshTriangle(this, i));
+    }
+  }
+
+  TriangleMesh::~TriangleMesh()
+  {
+  }
+
+  unsigned long TriangleMesh::getVertexCount() const
+  {
+    return vertices.size();
+  }
+
+  unsigned long TriangleMesh::getTriangleCount() const
+  {
+    return triangles.size();
+  }
+
+  MeshTriangle* TriangleMesh::getTriangle(unsigned long index)
+  {
+    return &triangles[index];
+  }
+
+  void TriangleMesh::setBackFaceCulling(bool back_face_culling)
+  {
+    this->back_face_culling = back_face_culling;
+  }
+
+  void TriangleMesh::setMaterial(unsigned int material)
+  {
+    for(std::vector<MeshTriangle>::iterator it = triangles.begin(); it != triangles.end(); ++it)
+      it->setMaterial(material);
+  }
+}
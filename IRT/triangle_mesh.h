@@ -0,0 +1,230 @@
+/**
+ * \file triangle_mesh.h
+ * Describes the meshes of triangles sharing their vertices
+ */
+
+#ifndef TRIANGLEMESH
+#define TRIANGLEMESH
+
+#include <vector>
+
+#include "common.h"
+#include "primitives.h"
+
+namespace IRT
+{
+  class TriangleMesh;
+
+  /// A triangle of a mesh, its corners being read from the vertices of the mesh
+  class MeshTriangle: public Primitive
+  {
+  public:
+    /**
+     * Constructs a new triangle of a mesh
+     * @param mesh is the mesh holding the vertices
+     * @param index is the index of the triangle in the mesh
+     */
+    _export_tools MeshTriangle(const TriangleMesh* mesh, unsigned int index);
+
+    /// Destructor
+    _export_tools ~MeshTriangle();
+
+    /**
+     * Tests if a ray intersects the triangle
+     * @param ray is the ray to test
+     * @param dist is an output argument that will contain the distance between the ray origin and the primitive
+     * @return True or False depending on the result of the test
+     */
+    bool intersect(const Ray& ray, DataType& dist) const;
+
+    /**
+     * Tests if a ray intersects the triangle, recording the barycentric coordinates of the hit
+     * @param ray is the ray to test
+     * @param hit is an output argument that will contain the distance and the barycentric coordinates of the hit
+     * @return True or False depending on the result of the test
+     */
+    bool intersect(const Ray& ray, HitRecord& hit) const;
+
+    /**
+     * Fills the normal of the triangle in the record of a hit
+     * @param ray is the direction ray
+     * @param hit has its distance, its point and its barycentric coordinates set
+     */
+    void computeHit(const Ray& ray, HitRecord& hit) const;
+
+    /**
+     * Returns the bounding box of the primitive
+     * @return the bounding box
+     */
+    _export_tools virtual BoundingBox getBoundingBox() const;
+
+    /**
+     * Returns the bounding box of the part of the primitive inside a box
+     * @param box is the box that clips the primitive
+     * @return the clipped bounding box
+     */
+    _export_tools virtual BoundingBox getClippedBoundingBox(const BoundingBox& box) const;
+
+    /// Returns the index of the triangle in the mesh
+    _export_tools unsigned int getIndex() const;
+
+    /// Returns the mesh holding the vertices
+    const TriangleMesh* getMesh() const;
+
+    /// Returns true if the hits on the back face are ignored
+    bool getBackFaceCulling() const;
+
+  private:
+    /// The mesh holding the vertices
+    const TriangleMesh* mesh;
+    /// Index of the triangle in the mesh
+    unsigned int index;
+  };
+
+  /**
+   * Triangles sharing their vertices, the positions and the corner indices being stored in flat arrays
+   * Each triangle is a MeshTriangle added to the scene as a primitive, but the blocks of the kd-tree leaves only keep a 32-bit reference to it and every intersection reads its corners from the shared arrays, no constant being stored per triangle.
+   */
+  class TriangleMesh
+  {
+  private:
+    /// Positions of the vertices
+    std::vector<Point3df> vertices;
+    /// Indices of the three corners of each triangle in the vertices
+    std::vector<unsigned int> indices;
+    /// Ignores the hits on the back faces of all the triangles
+    bool back_face_culling;
+    /// The triangles, added to the scene as primitives and never moved
+    std::vector<MeshTriangle> triangles;
+
+    TriangleMesh(const TriangleMesh& mesh);
+
+  public:
+    /**
+     * Constructs a new mesh
+     * @param vertices are the coordinates of the vertices, three per vertex
+     * @param vertex_count is the number of vertices
+     * @param indices are the indices of the corners of the triangles, three per triangle
+     * @param triangle_count is the number of triangles
+     * @throw std::out_of_range if an index is not the index of a vertex
+     */
+    _export_tools TriangleMesh(const DataType* vertices, unsigned long vertex_count, const unsigned int* indices, unsigned long triangle_count);
+
+    /// Destructor
+    _export_tools ~TriangleMesh();
+
+    /// Returns the number of vertices
+    _export_tools unsigned long getVertexCount() const;
+
+    /// Returns the number of triangles
+    _export_tools unsigned long getTriangleCount() const;
+
+    /**
+     * Returns a triangle
+     * @param index is the index of the triangle
+     * @return the triangle, owned by the mesh
+     */
+    _export_tools MeshTriangle* getTriangle(unsigned long index);
+
+    /**
+     * Returns a corner of a triangle
+     * @param triangle is the index of the triangle
+     * @param corner is the index of the corner in the triangle
+     * @return the position of the corner
+     */
+    const Point3df& getCorner(unsigned int triangle, int corner) const
+    {
+      return vertices[indices[3 * triangle + corner]];
+    }
+
+    /**
+     * Tests if a ray intersects a triangle, with the Moller-Trumbore test on its corners
+     * @param triangle is the index of the triangle
+     * @param ray is the ray to test
+     * @param dist is an output argument that will contain the distance between the ray origin and the triangle
+     * @param u is an output argument that will contain the barycentric coordinate along the third corner
+     * @param v is an output argument that will contain the barycentric coordinate along the second corner
+     * @return True or False depending on the result of the test
+     */
+    bool intersect(unsigned int triangle, const Ray& ray, DataType& dist, DataType& u, DataType& v) const;
+
+    /// Returns the unit normal of a triangle, the front face being the side where its corners are seen counterclockwise
+    Normal3df getNormal(unsigned int triangle) const;
+
+    /// Returns true if the hits on the back faces are ignored
+    bool getBackFaceCulling() const
+    {
+      return back_face_culling;
+    }
+
+    /**
+     * Ignores the hits on the back faces of all the triangles, the sides where the corners are seen clockwise, for a closed mesh
+     * @param back_face_culling is true to ignore the back faces
+     */
+    _export_tools void setBackFaceCulling(bool back_face_culling);
+
+    /**
+     * Sets the material of all the triangles
+     * @param material is the index of the material in the material table of the scene
+     */
+    _export_tools void setMaterial(unsigned int material);
+  };
+
+  inline bool TriangleMesh::intersect(unsigned int triangle, const Ray& ray, DataType& dist, DataType& u, DataType& v) const
+  {
+    const Point3df& corner1 = getCorner(triangle, 0);
+    Vector3df edge1 = getCorner(triangle, 1) - corner1;
+    Vector3df edge2 = getCorner(triangle, 2) - corner1;
+
+    // The determinant is negative on the back face, null for a ray parallel to the triangle
+    Vector3df p = ray.direction().cross(edge2);
+    DataType det = edge1.dot(p);
+    if(back_face_culling ? !(det > 0) : det == 0)
+      return false;
+    DataType inv_det = 1 / det;
+
+    Vector3df s = ray.origin() - corner1;
+    v = s.dot(p) * inv_det;
+    Vector3df q = s.cross(edge1);
+    u = ray.direction().dot(q) * inv_det;
+    dist = edge2.dot(q) * inv_det;
+
+    return (u >= 0) && (v >= 0) && (u + v < 1);
+  }
+
+  inline Normal3df TriangleMesh::getNormal(unsigned int triangle) const
+  {
+    const Point3df& corner1 = getCorner(triangle, 0);
+    Normal3df normal = (getCorner(triangle, 1) - corner1).cross(getCorner(triangle, 2) - corner1);
+    normalize(normal);
+    return normal;
+  }
+
+  inline bool MeshTriangle::intersect(const Ray& ray, DataType& dist) const
+  {
+    DataType u, v;
+    return mesh->intersect(index, ray, dist, u, v);
+  }
+
+  inline bool MeshTriangle::intersect(const Ray& ray, HitRecord& hit) const
+  {
+    return mesh->intersect(index, ray, hit.dist, hit.u, hit.v);
+  }
+
+  inline void MeshTriangle::computeHit(const Ray& ray, HitRecord& hit) const
+  {
+    hit.normal = mesh->getNormal(index);
+  }
+
+  inline const TriangleMesh* MeshTriangle::getMesh() const
+  {
+    return mesh;
+  }
+
+  inline bool MeshTriangle::getBackFaceCulling() const
+  {
+    return mesh->getBackFaceCulling();
+  }
+}
+
+#endif
@@ -0,0 +1,73 @@
+/* -*- C -*-  (not really, but good for syntax highlighting) */
+
+#ifdef SWIGPYTHON
+
+%{
+#include <stdexcept>
+#include "IRT/triangle_mesh.h"
+%}
+
+%typemap(in)
+    (const IRT::DataType* vertices, unsigned long vertex_count)
+    (PyArrayObject* array=NULL, int is_new_object=0)
+{
+  array = obj_to_array_contiguous_allow_conversion($input, DataTypeKind, &is_new_object);
+  if (!array || !require_dimensions(array, 2) || (array->dimensions[1] != 3)) SWIG_fail;
+
+  $1 = reinterpret_cast<IRT::DataType*>(array->data);
+  $2 = array->dimensions[0];
+}
+%typemap(freearg)
+    (const IRT::DataType* vertices, unsigned long vertex_count)
+{
+  if (is_new_object$argnum && array$argnum) Py_DECREF(array$argnum);
+}
+
+%typemap(in)
+    (const unsigned int* indices, unsigned long triangle_count)
+    (PyArrayObject* array=NULL, int is_new_object=0)
+{
+  array = obj_to_array_contiguous_allow_conversion($input, NPY_UINT, &is_new_object);
+  if (!array || !require_dimensions(array, 2) || (array->dimensions[1] != 3)) SWIG_fail;
+
+  $1 = reinterpret_cast<unsigned int*>(array->data);
+  $2 = array->dimensions[0];
+}
+%typemap(freearg)
+    (const unsigned int* indices, unsigned long triangle_count)
+{
+  if (is_new_object$argnum && array$argnum) Py_DECREF(array$argnum);
+}
+
+%typemap(in) IRT::TriangleMesh*
+{
+  if ((SWIG_ConvertPtr($input,(void **)(&$1),$1_descriptor, SWIG_POINTER_EXCEPTION | SWIG_POINTER_DISOWN)) == -1) SWIG_fail;
+}
+
+%exception IRT::TriangleMesh::TriangleMesh {
+  try
+  {
+    $action
+  }
+  catch(const std::out_of_range& e)
+  {
+    PyErr_SetString(PyExc_IndexError, e.what());
+    SWIG_fail;
+  }
+}
+
+namespace IRT
+{
+  class TriangleMesh
+  {
+  public:
+    TriangleMesh(const IRT::DataType* vertices, unsigned long vertex_count, const unsigned int* indices, unsigned long triangle_count);
+    ~TriangleMesh();
+    unsigned long getVertexCount();
+    unsigned long getTriangleCount();
+    void setBackFaceCulling(bool back_face_culling);
+    void setMaterial(unsigned int material);
+  };
+}
+
+#endif /* SWIGPYTHON */
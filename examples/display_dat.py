@@ -198,20 +198,34 @@ class ParserDat(object):
       light = IRT.Light(object['CENTER'], 20 * object['COLOR'])
       scene.addLight(light)
 
+  def populate_materials(self, scene):
+    # Each TEXDEF becomes one material of the scene, shared by all the objects using it
+    materials = {}
+    for name, texture in self.textures.items():
+      materials[name] = scene.addMaterial(texture['COLOR'], texture['SPECULAR'], texture['DIFFUSE'])
+    return materials
+
   def populate_objects(self, scene):
+    # The triangles sharing a texture are gathered in one mesh, their common corners being stored once
+    meshes = {}
+    materials = self.populate_materials(scene)
     for object in self.objects:
       if object['type'] == 'SPHERE':
         sphere = IRT.Sphere(object['CENTER'], object['RAD'])
-        sphere.setColor(self.textures[object['TEXTURE']]['COLOR'])
-        sphere.setReflection(self.textures[object['TEXTURE']]['SPECULAR'])
-        sphere.setDiffuse(self.textures[object['TEXTURE']]['DIFFUSE'])
+        sphere.setMaterial(materials[object['TEXTURE']])
         scene.addPrimitive(sphere)
       if object['type'] == 'TRI':
-        triangle = IRT.Triangle(object['V0'], object['V1'], object['V2'])
-        triangle.setColor(self.textures[object['TEXTURE']]['COLOR'])
-        triangle.setReflection(self.textures[object['TEXTURE']]['SPECULAR'])
-        triangle.setDiffuse(self.textures[object['TEXTURE']]['DIFFUSE'])
-        scene.addPrimitive(triangle)
+        vertices, indices = meshes.setdefault(object['TEXTURE'], ({}, []))
+        for corner in ('V0', 'V1', 'V2'):
+          indices.append(vertices.setdefault(tuple(object[corner]), len(vertices)))
+
+    for texture, (vertices, indices) in meshes.items():
+      positions = numpy.zeros((len(vertices), 3), dtype=numpy.float32)
+      for vertex, index in vertices.items():
+        positions[index] = vertex
+      mesh = IRT.TriangleMesh(positions, numpy.array(indices, dtype=numpy.uint32).reshape(-1, 3))
+      mesh.setMaterial(materials[texture])
+      scene.addMesh(mesh)
 
   def create(self, Raytracer, scene):
     raytracer = Raytracer(*self.raytracer_params['RESOLUTION'])
@@ -252,6 +266,14 @@ class ParserDat(object):
     print "Elapsed %f" % (time.time() - current)
     return screen
 
+  def create_statistics(self, raytracer, type):
+    import time
+    screen = numpy.zeros((self.raytracer_params['RESOLUTION'][1], self.raytracer_params['RESOLUTION'][0]), dtype=numpy.int32)
+    current = time.time()
+    raytracer.checkDraw(screen, type)
+    print "Elapsed %f" % (time.time() - current)
+    return screen
+
 def parse_dat(file):
   scene = IRT.SimpleScene()
 
@@ -285,6 +307,21 @@ def hitdistance_dat(file):
   im = parser.create_hitdistance(raytracer)
   return im
 
+def statistics_dat(file):
+  scene = IRT.SimpleScene()
+
+  parser = ParserDat(file)
+  parser.parse()
+  parser.populate(scene)
+  raytracer = parser.create(IRT.Raytracer_Jittered, scene)
+
+  ims = []
+  for type in range(2, 6):
+    ims.append(parser.create_statistics(raytracer, type))
+  statistics = raytracer.getStatistics()
+  print "Inner nodes %d, leaves %d, intersection tests %d, pushes %d" % (statistics.inner_nodes, statistics.leaves, statistics.intersection_tests, statistics.pushes)
+  return ims
+
 if __name__ == "__main__":
   import sys
   import matplotlib.pyplot as plt
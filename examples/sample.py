@@ -9,31 +9,28 @@ class Sample(object):
     self.width = width
     self.height = height
 
+    blue = self.scene.addMaterial(numpy.array((0., 0., 1.), dtype=numpy.float32), .5, 1.)
+    red = self.scene.addMaterial(numpy.array((1., 0., 0.), dtype=numpy.float32), .5, 1.)
+    green = self.scene.addMaterial(numpy.array((.0, 1., .0), dtype=numpy.float32), .5, 1.)
+    grey = self.scene.addMaterial(numpy.array((.95, .95, .95), dtype=numpy.float32), .25, 0.)
+    white = self.scene.addMaterial(numpy.array((1., 1., 1.), dtype=numpy.float32), .1, .4)
+
     sphere = IRT.Sphere(numpy.array((0., 0., 20.), dtype=numpy.float32), 2.)
-    sphere.setColor(numpy.array((0., 0., 1.), dtype=numpy.float32))
-    sphere.setDiffuse(1.)
-    sphere.setReflection(.5)
+    sphere.setMaterial(blue)
     self.scene.addPrimitive(sphere)
     sphere = IRT.Sphere(numpy.array((2., 1., 15.), dtype=numpy.float32), 1.)
-    sphere.setColor(numpy.array((1., 0., 0.), dtype=numpy.float32))
-    sphere.setDiffuse(1.)
-    sphere.setReflection(.5)
+    sphere.setMaterial(red)
     self.scene.addPrimitive(sphere)
     sphere = IRT.Sphere(numpy.array((-2., -1., 15.), dtype=numpy.float32), 1.)
-    sphere.setColor(numpy.array((.0, 1., .0), dtype=numpy.float32))
-    sphere.setReflection(.5)
-    sphere.setDiffuse(1.)
+    sphere.setMaterial(green)
     self.scene.addPrimitive(sphere)
 
     box = IRT.Box(numpy.array((-8., 4., 26.), dtype=numpy.float32), numpy.array((8., 10., 1000.), dtype=numpy.float32))
-    box.setColor(numpy.array((.95, .95, .95), dtype=numpy.float32))
-    box.setReflection(.25)
+    box.setMaterial(grey)
     #self.scene.addPrimitive(box)
     
     triangle = IRT.Triangle(numpy.array((-6., 0., 30.), dtype=numpy.float32), numpy.array((6., 6., 28.), dtype=numpy.float32), numpy.array((0., -6., 28.), dtype=numpy.float32))
-    triangle.setColor(numpy.array((1., 1., 1.), dtype=numpy.float32))
-    triangle.setReflection(.1)
-    triangle.setDiffuse(.4)
+    triangle.setMaterial(white)
     self.scene.addPrimitive(triangle)
 
     light = IRT.Light(1e6 * numpy.array((-2., 2., 1.), dtype=numpy.float32), 49 * 1e12 * numpy.array((.0, .2, .2), dtype=numpy.float32))
@@ -0,0 +1,17 @@
+#!/usr/bin/env python
+
+import matplotlib.pyplot as plt
+
+if __name__ == "__main__":
+  import sys
+  from display_dat import statistics_dat
+
+  ims = statistics_dat(sys.argv[1])
+
+  titles = ("Inner nodes", "Leaves", "Intersection tests", "Stack pushes")
+  for i, (im, title) in enumerate(zip(ims, titles)):
+    plt.subplot(2, 2, i + 1)
+    plt.imshow(im)
+    plt.title(title)
+    plt.colorbar()
+  plt.show()
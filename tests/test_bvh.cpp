@@ -0,0 +1,87 @@
+/**
+ * \file test_bvh.cpp
+ * Bounding volume hierarchy file for the test suit
+ */
+
+#include <boost/test/unit_test.hpp>
+
+#include "../IRT/simple_scene.h"
+#include "../IRT/primitives.h"
+#include "../IRT/build_kdtree.h"
+#include "../IRT/build_bvh.h"
+
+using namespace IRT;
+
+BOOST_AUTO_TEST_SUITE( irt_bvh_suite )
+
+BOOST_AUTO_TEST_CASE( test_IRT_BVH_leaves )
+{
+  SimpleScene* scene = new SimpleScene;
+  for(int i = 0; i < 20; ++i)
+  {
+    scene->addPrimitive(new Sphere(Vector3df::Constant(3.f * i), 1.f));
+  }
+  BuildBVH::custom_build(scene, 2);
+  BOOST_CHECK_EQUAL(scene->getAccelerator(), SimpleScene::BoundingVolumeHierarchy);
+
+  const std::vector<BVH<Primitive>::BVHNode>& nodes = scene->getBVH().getNodes();
+  BOOST_CHECK_GT(nodes.size(), 1U);
+  BOOST_CHECK(!nodes[0].isLeaf());
+
+  unsigned long primitives = 0;
+  for(std::vector<BVH<Primitive>::BVHNode>::const_iterator it = nodes.begin(); it != nodes.end(); ++it)
+  {
+    if(it->isLeaf())
+    {
+      BOOST_CHECK_LE(it->getPrimitivesCount(), 2U);
+      primitives += it->getPrimitivesCount();
+    }
+  }
+  BOOST_CHECK_EQUAL(primitives, 20U);
+
+  delete scene;
+}
+
+BOOST_AUTO_TEST_CASE( test_IRT_BVH_closest )
+{
+  SimpleScene* scene = new SimpleScene;
+  for(int i = 0; i < 10; ++i)
+  {
+    scene->addPrimitive(new Sphere(Vector3df::Constant(3.f * i), 1.f));
+    scene->addPrimitive(new Sphere(Vector3df(3.f * i + 1.5f, 0.f, 3.f * i), 1.f));
+  }
+  BuildBVH::automatic_build(scene);
+
+  const std::vector<Primitive*>& primitives = scene->getPrimitives();
+  for(int i = 0; i < 10; ++i)
+  {
+    Vector3df direction = Vector3df::Constant(1.f);
+    direction(1) -= .1f * i;
+    normalize(direction);
+    Ray ray(Vector3df::Constant(-5.f), direction);
+
+    Primitive* closest = NULL;
+    float closest_dist = std::numeric_limits<float>::max();
+    for(std::vector<Primitive*>::const_iterator it = primitives.begin(); it != primitives.end(); ++it)
+    {
+      float dist;
+      if((*it)->intersect(ray, dist) && dist > 0.0001f && dist < closest_dist)
+      {
+        closest = *it;
+        closest_dist = dist;
+      }
+    }
+
+    float dist = 0;
+    BOOST_CHECK_EQUAL(scene->getFirstCollision(ray, dist, 0, std::numeric_limits<float>::max()), closest);
+    if(closest != NULL)
+    {
+      BOOST_CHECK_EQUAL(dist, closest_dist);
+    }
+    BOOST_CHECK_EQUAL(scene->testCollision(ray, 100.f), closest != NULL && closest_dist < 100.f);
+  }
+
+  delete scene;
+}
+
+BOOST_AUTO_TEST_SUITE_END()
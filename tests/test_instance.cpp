@@ -0,0 +1,71 @@
+/**
+ * \file test_instance.cpp
+ * Instance file for the test suit
+ */
+
+#include <boost/test/unit_test.hpp>
+
+#include "../IRT/simple_scene.h"
+#include "../IRT/primitives.h"
+#include "../IRT/instance.h"
+#include "../IRT/primitive_dispatch.h"
+#include "../IRT/build_kdtree.h"
+
+using namespace IRT;
+
+BOOST_AUTO_TEST_SUITE( irt_instance_suite )
+
+BOOST_AUTO_TEST_CASE( test_IRT_Instance_intersect )
+{
+  SimpleScene* scene = new SimpleScene;
+  Prototype* prototype = new Prototype;
+  prototype->addPrimitive(new Sphere(Vector3df::Zero(), 1.f));
+  prototype->addPrimitive(new Sphere(Vector3df(3.f, 0.f, 0.f), 1.f));
+  prototype->build(1);
+  scene->addPrototype(prototype);
+
+  Primitive* reference = new Sphere(Vector3df(10.f, 0.f, 0.f), 2.f);
+  Primitive* instance = new Instance(prototype, Vector3df(10.f, 0.f, 0.f), 2.f);
+  scene->addPrimitive(instance);
+
+  BoundingBox bb = instance->getBoundingBox();
+  BOOST_CHECK_EQUAL(bb.corner1, Vector3df(8.f, -2.f, -2.f));
+  BOOST_CHECK_EQUAL(bb.corner2, Vector3df(18.f, 2.f, 2.f));
+
+  Vector3df direction(1.f, .1f, .05f);
+  normalize(direction);
+  Ray ray(Vector3df::Zero(), direction);
+
+  float reference_dist = 0, instance_dist = 0;
+  BOOST_CHECK(reference->intersect(ray, reference_dist));
+  BOOST_CHECK(instance->intersect(ray, instance_dist));
+  BOOST_CHECK_CLOSE(reference_dist, instance_dist, 1e-3);
+
+  HitRecord reference_hit, instance_hit;
+  BOOST_REQUIRE(reference->intersect(ray, reference_hit));
+  BOOST_REQUIRE(instance->intersect(ray, instance_hit));
+  reference_hit.primitive = reference;
+  instance_hit.primitive = instance;
+  PrimitiveDispatch<Primitive>::computeHit(ray, reference_hit);
+  PrimitiveDispatch<Primitive>::computeHit(ray, instance_hit);
+  BOOST_CHECK_SMALL(norm2(Vector3df(reference_hit.normal - instance_hit.normal)), 1e-6f);
+
+  BuildKDTree::automatic_build(scene);
+  float dist = 0;
+  BOOST_CHECK_EQUAL(scene->getFirstCollision(ray, dist, 0, std::numeric_limits<float>::max()), instance);
+  BOOST_CHECK(!scene->testCollision(Ray(Vector3df::Zero(), Vector3df(0.f, 1.f, 0.f)), 100.f));
+
+  // The traversal records the primitive of the prototype, the shading does not trace the prototype again
+  HitRecord hit;
+  BOOST_REQUIRE_EQUAL(scene->getFirstCollision(ray, hit, 0, std::numeric_limits<float>::max()), instance);
+  BOOST_CHECK(hit.prototype_primitive != NULL);
+  PrimitiveDispatch<Primitive>::computeHit(ray, hit);
+  BOOST_CHECK_SMALL(norm2(Vector3df(reference_hit.normal - hit.normal)), 1e-6f);
+
+  BOOST_CHECK_THROW(prototype->addPrimitive(instance), std::invalid_argument);
+
+  delete reference;
+  delete scene;
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,771 @@
+/**
+ * \file test_kdtree.cpp
+ * KD-tree file for the test suit
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <boost/test/unit_test.hpp>
+
+#ifdef USE_TBB
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#endif
+
+#include "../IRT/simple_scene.h"
+#include "../IRT/primitives.h"
+#include "../IRT/triangle_mesh.h"
+#include "../IRT/build_kdtree.h"
+
+using namespace IRT;
+
+/// Checks that two subtrees have the same splits and the same primitives in their leaves
+void checkSameSubtree(const KDTree<Primitive>& tree, const KDTree<Primitive>::KDTreeNode* node, const KDTree<Primitive>& other_tree, const KDTree<Primitive>::KDTreeNode* other_node)
+{
+  BOOST_REQUIRE_EQUAL(node->isLeaf(), other_node->isLeaf());
+  if(node->isLeaf())
+  {
+    std::vector<Primitive*> primitives(tree.getAllLeafPrimitives().begin() + node->getPrimitivesOffset(), tree.getAllLeafPrimitives().begin() + node->getPrimitivesOffset() + node->getPrimitivesCount());
+    std::vector<Primitive*> other_primitives(other_tree.getAllLeafPrimitives().begin() + other_node->getPrimitivesOffset(), other_tree.getAllLeafPrimitives().begin() + other_node->getPrimitivesOffset() + other_node->getPrimitivesCount());
+    std::sort(primitives.begin(), primitives.end());
+    std::sort(other_primitives.begin(), other_primitives.end());
+    BOOST_CHECK(primitives == other_primitives);
+    return;
+  }
+  BOOST_REQUIRE_EQUAL(node->getAxis(), other_node->getAxis());
+  BOOST_REQUIRE_EQUAL(node->getSplitPosition(), other_node->getSplitPosition());
+  checkSameSubtree(tree, node->leftNode(), other_tree, other_node->leftNode());
+  checkSameSubtree(tree, node->rightNode(), other_tree, other_node->rightNode());
+}
+
+/**
+ * Exact build done as before the event sweep, each candidate plane being evaluated by going through all the primitives of the node
+ * The sides, the clipping, the cost and the stopping rules are the ones of BuildKDTree::subdivide().
+ */
+struct ReferenceBuild
+{
+  /// A node of the reference tree, the children of an inner node being at left and left + 1
+  struct Node
+  {
+    int axis;
+    DataType position;
+    unsigned int left;
+    std::vector<Primitive*> primitives;
+  };
+
+  const std::vector<Primitive*>& primitives;
+  KDTreeCostModel cost_model;
+  DataType enhancement_ratio_failure;
+  std::vector<Node> nodes;
+
+  ReferenceBuild(const std::vector<Primitive*>& primitives, DataType enhancement_ratio_failure)
+  :primitives(primitives), enhancement_ratio_failure(enhancement_ratio_failure), nodes(1)
+  {
+    nodes[0].axis = -1;
+  }
+
+  void subdivide(unsigned int node, const BoundingBox& bb, const std::vector<unsigned int>& indices, const std::vector<BoundingBox>& bbs, int remaining_depth, int remaining_failures)
+  {
+    for(unsigned long i = 0; i < indices.size(); ++i)
+    {
+      nodes[node].primitives.push_back(primitives[indices[i]]);
+    }
+
+    DataType lowest_cost = std::numeric_limits<DataType>::max();
+    int lowest_axis = -1;
+    DataType lowest_position = 0;
+    for(int axis = 0; axis < 3; ++axis)
+    {
+      std::vector<DataType> candidates;
+      for(unsigned long i = 0; i < bbs.size(); ++i)
+      {
+        candidates.push_back(bbs[i].corner1(axis));
+        candidates.push_back(bbs[i].corner2(axis));
+      }
+      std::sort(candidates.begin(), candidates.end());
+      candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+      for(std::vector<DataType>::const_iterator it = candidates.begin(); it != candidates.end(); ++it)
+      {
+        if(*it < bb.corner1(axis) || *it > bb.corner2(axis))
+        {
+          continue;
+        }
+        unsigned long left_count = 0, right_count = 0;
+        for(unsigned long i = 0; i < bbs.size(); ++i)
+        {
+          bool planar = bbs[i].corner1(axis) == *it && bbs[i].corner2(axis) == *it;
+          left_count += planar || bbs[i].corner1(axis) < *it;
+          right_count += planar || bbs[i].corner2(axis) > *it;
+        }
+        DataType cost = cost_model.computeRelativeCost(axis, *it, bb, bbs.size(), right_count, left_count);
+        if(cost < lowest_cost)
+        {
+          lowest_cost = cost;
+          lowest_axis = axis;
+          lowest_position = *it;
+        }
+      }
+    }
+
+    if(lowest_axis == -1 || !(lowest_cost < enhancement_ratio_failure || --remaining_failures >= 0))
+    {
+      return;
+    }
+
+    BoundingBox bb_left = bb, bb_right = bb;
+    bb_left.corner2(lowest_axis) = lowest_position;
+    bb_right.corner1(lowest_axis) = lowest_position;
+    std::vector<unsigned int> left_indices, right_indices;
+    std::vector<BoundingBox> left_bbs, right_bbs;
+    for(unsigned long i = 0; i < indices.size(); ++i)
+    {
+      const BoundingBox& primitive_bb = bbs[i];
+      bool planar = primitive_bb.corner1(lowest_axis) == lowest_position && primitive_bb.corner2(lowest_axis) == lowest_position;
+      bool left = planar || primitive_bb.corner1(lowest_axis) < lowest_position;
+      bool right = planar || primitive_bb.corner2(lowest_axis) > lowest_position;
+      BoundingBox left_bb = primitive_bb, right_bb = primitive_bb;
+      if(left && right && !planar)
+      {
+        left_bb = primitives[indices[i]]->getClippedBoundingBox(bb_left).clip(primitive_bb);
+        right_bb = primitives[indices[i]]->getClippedBoundingBox(bb_right).clip(primitive_bb);
+        if(left_bb.isEmpty() && right_bb.isEmpty())
+        {
+          left_bb = primitive_bb.clip(bb_left);
+          right_bb = primitive_bb.clip(bb_right);
+        }
+        left = !left_bb.isEmpty() || right_bb.isEmpty();
+        right = !right_bb.isEmpty() || left_bb.isEmpty();
+      }
+      if(left)
+      {
+        left_indices.push_back(indices[i]);
+        left_bbs.push_back(left_bb);
+      }
+      if(right)
+      {
+        right_indices.push_back(indices[i]);
+        right_bbs.push_back(right_bb);
+      }
+    }
+
+    nodes[node].axis = lowest_axis;
+    nodes[node].position = lowest_position;
+    nodes[node].left = nodes.size();
+    nodes[node].primitives.clear();
+    nodes.resize(nodes.size() + 2);
+    unsigned int left_node = nodes[node].left;
+    nodes[left_node].axis = nodes[left_node + 1].axis = -1;
+
+    if(remaining_depth > 0 && left_indices.size() > 1)
+    {
+      subdivide(left_node, bb_left, left_indices, left_bbs, remaining_depth - 1, remaining_failures);
+    }
+    else
+    {
+      for(unsigned long i = 0; i < left_indices.size(); ++i)
+        nodes[left_node].primitives.push_back(primitives[left_indices[i]]);
+    }
+    if(remaining_depth > 0 && right_indices.size() > 1)
+    {
+      subdivide(left_node + 1, bb_right, right_indices, right_bbs, remaining_depth - 1, remaining_failures);
+    }
+    else
+    {
+      for(unsigned long i = 0; i < right_indices.size(); ++i)
+        nodes[left_node + 1].primitives.push_back(primitives[right_indices[i]]);
+    }
+  }
+
+  /// Checks that a subtree of a kd-tree matches a node of the reference tree
+  void check(const KDTree<Primitive>& tree, const KDTree<Primitive>::KDTreeNode* tree_node, unsigned int node) const
+  {
+    BOOST_REQUIRE_EQUAL(tree_node->isLeaf(), nodes[node].axis == -1);
+    if(tree_node->isLeaf())
+    {
+      std::vector<Primitive*> leaf(tree.getAllLeafPrimitives().begin() + tree_node->getPrimitivesOffset(), tree.getAllLeafPrimitives().begin() + tree_node->getPrimitivesOffset() + tree_node->getPrimitivesCount());
+      std::vector<Primitive*> expected = nodes[node].primitives;
+      std::sort(leaf.begin(), leaf.end());
+      std::sort(expected.begin(), expected.end());
+      BOOST_CHECK(leaf == expected);
+      return;
+    }
+    BOOST_REQUIRE_EQUAL(tree_node->getAxis(), nodes[node].axis);
+    BOOST_REQUIRE_EQUAL(tree_node->getSplitPosition(), nodes[node].position);
+    check(tree, tree_node->leftNode(), nodes[node].left);
+    check(tree, tree_node->rightNode(), nodes[node].left + 1);
+  }
+};
+
+/// Adds spheres, boxes and triangles at fixed places, some of them sharing their bounds
+void addFixedScene(SimpleScene* scene, int count)
+{
+  for(int i = 0; i < count; ++i)
+  {
+    Vector3df center((i * 7) % 13 * 1.5f, (i * 5) % 11 * 1.3f, (i * 3) % 7 * 1.7f);
+    if(i % 4 == 3)
+    {
+      scene->addPrimitive(new Box(center, center + Vector3df(1.f, .5f, .25f)));
+    }
+    else if(i % 4 == 2)
+    {
+      scene->addPrimitive(new Triangle(center, center + Vector3df(1.f, 0.f, .5f), center + Vector3df(0.f, 1.5f, 0.f)));
+    }
+    else
+    {
+      scene->addPrimitive(new Sphere(center, .3f + (i % 5) * .2f));
+    }
+  }
+}
+
+BOOST_AUTO_TEST_SUITE( irt_kdtree_suite )
+
+BOOST_AUTO_TEST_CASE( test_IRT_KDTree_node_size )
+{
+  BOOST_CHECK_EQUAL(sizeof(KDTree<Primitive>::KDTreeNode), 8U);
+}
+
+BOOST_AUTO_TEST_CASE( test_IRT_KDTree_node_limits )
+{
+  typedef KDTree<Primitive>::KDTreeNode Node;
+  Node node;
+
+  node.setLeaf(5, Node::max_primitives_count);
+  BOOST_CHECK_EQUAL(node.getPrimitivesCount(), Node::max_primitives_count);
+  BOOST_CHECK(!node.isDeferred());
+  BOOST_CHECK_THROW(node.setLeaf(5, Node::max_primitives_count + 1), std::out_of_range);
+
+  node.setInner(2, 1.f, Node::max_left_offset);
+  BOOST_CHECK_EQUAL(node.getAxis(), 2);
+  BOOST_CHECK_THROW(node.setInner(2, 1.f, Node::max_left_offset + 1), std::out_of_range);
+}
+
+BOOST_AUTO_TEST_CASE( test_IRT_KDTree_leaves )
+{
+  SimpleScene* scene = new SimpleScene;
+  for(int i = 0; i < 10; ++i)
+  {
+    scene->addPrimitive(new Sphere(Vector3df::Constant(3.f * i), 1.f));
+  }
+  BuildKDTree::automatic_build(scene);
+
+  const std::vector<KDTree<Primitive>::KDTreeNode>& nodes = scene->getKDTree().getNodes();
+  BOOST_CHECK_GT(nodes.size(), 1U);
+  BOOST_CHECK(!nodes[0].isLeaf());
+
+  unsigned long primitives = 0;
+  for(std::vector<KDTree<Primitive>::KDTreeNode>::const_iterator it = nodes.begin(); it != nodes.end(); ++it)
+  {
+    if(it->isLeaf())
+    {
+      primitives += it->getPrimitivesCount();
+    }
+  }
+  BOOST_CHECK_GE(primitives, 10U);
+
+  float dist = 0;
+  Vector3df direction = Vector3df::Constant(1.f);
+  normalize(direction);
+  BOOST_CHECK(scene->getFirstCollision(Ray(Vector3df::Constant(-5.f), direction), dist, 0, std::numeric_limits<float>::max()) != NULL);
+
+  delete scene;
+}
+
+BOOST_AUTO_TEST_CASE( test_IRT_KDTree_binned )
+{
+  SimpleScene* scene = new SimpleScene;
+  for(int i = 0; i < 10; ++i)
+  {
+    scene->addPrimitive(new Sphere(Vector3df::Constant(3.f * i), 1.f));
+  }
+  BuildKDTree::automatic_binned_build(scene, 8);
+
+  const std::vector<KDTree<Primitive>::KDTreeNode>& nodes = scene->getKDTree().getNodes();
+  BOOST_CHECK_GT(nodes.size(), 1U);
+  BOOST_CHECK(!nodes[0].isLeaf());
+
+  Vector3df direction = Vector3df::Constant(1.f);
+  normalize(direction);
+  float dist = 0;
+  BOOST_CHECK(scene->getFirstCollision(Ray(Vector3df::Constant(-5.f), direction), dist, 0, std::numeric_limits<float>::max()) != NULL);
+  BOOST_CHECK(scene->getFirstCollision(Ray(Vector3df::Constant(-5.f), Vector3df(0.f, 1.f, 0.f)), dist, 0, std::numeric_limits<float>::max()) == NULL);
+
+  unsigned long primitives = 0;
+  for(std::vector<KDTree<Primitive>::KDTreeNode>::const_iterator it = nodes.begin(); it != nodes.end(); ++it)
+  {
+    if(it->isLeaf())
+    {
+      primitives += it->getPrimitivesCount();
+    }
+  }
+  BOOST_CHECK_GE(primitives, 10U);
+
+  delete scene;
+}
+
+BOOST_AUTO_TEST_CASE( test_IRT_KDTree_cost_model )
+{
+  BoundingBox bb;
+  bb.corner2 = Vector3df::Constant(2.f);
+  KDTreeCostModel bonus(.3f, 1.f, .2f, false);
+  KDTreeCostModel no_bonus(.3f, 1.f, 0.f, false);
+  BOOST_CHECK_LT(bonus.computeRelativeCost(0, 1.f, bb, 10, 10, 0), no_bonus.computeRelativeCost(0, 1.f, bb, 10, 10, 0));
+  BOOST_CHECK_EQUAL(bonus.computeRelativeCost(0, 0.f, bb, 10, 10, 0), no_bonus.computeRelativeCost(0, 0.f, bb, 10, 10, 0));
+
+  SimpleScene* scene = new SimpleScene;
+  for(int i = 0; i < 10; ++i)
+  {
+    scene->addPrimitive(new Sphere(Vector3df::Constant(3.f * i), 1.f));
+  }
+  BuildKDTree::automatic_build(scene, KDTreeCostModel(10.f, 1.f, 0.f, true));
+  BOOST_CHECK(scene->getKDTree().getNodes()[0].isLeaf());
+
+  BuildKDTree::automatic_build(scene, KDTreeCostModel(10.f, 1.f, 0.f, false));
+  BOOST_CHECK(!scene->getKDTree().getNodes()[0].isLeaf());
+
+  delete scene;
+}
+
+BOOST_AUTO_TEST_CASE( test_IRT_KDTree_packet )
+{
+  SimpleScene* scene = new SimpleScene;
+  for(int i = 0; i < 10; ++i)
+  {
+    scene->addPrimitive(new Sphere(Vector3df::Constant(3.f * i), 1.f));
+  }
+  BuildKDTree::automatic_build(scene);
+
+  RayPacket packet(Ray(Vector3df::Constant(-5.f), Vector3df::Zero()));
+  for(unsigned int i = 0; i < RayPacket::size; ++i)
+  {
+    Vector3df direction = Vector3df::Constant(1.f);
+    direction(0) += .1f * i;
+    normalize(direction);
+    packet.next().setDirection(direction);
+  }
+
+  RayPacket::Array tnear = RayPacket::Array::Zero();
+  RayPacket::Array tfar = RayPacket::Array::Constant(std::numeric_limits<float>::max());
+  HitRecord hits[RayPacket::size];
+  scene->getFirstCollisions(packet, tnear, tfar, RayPacket::Mask::Constant(true), hits);
+
+  for(unsigned int i = 0; i < RayPacket::size; ++i)
+  {
+    float dist = 0;
+    BOOST_CHECK_EQUAL(hits[i].primitive, scene->getFirstCollision(packet[i], dist, 0, std::numeric_limits<float>::max()));
+    if(hits[i].primitive != NULL)
+    {
+      BOOST_CHECK_EQUAL(hits[i].dist, dist);
+    }
+  }
+
+  delete scene;
+}
+
+BOOST_AUTO_TEST_CASE( test_IRT_KDTree_mailbox )
+{
+  SimpleScene* scene = new SimpleScene;
+  Primitive* primitive = new Sphere(Vector3df::Zero(), 1.f);
+  scene->addPrimitive(primitive);
+
+  Vector3df direction = Vector3df::Constant(1.f);
+  normalize(direction);
+  Ray ray(Vector3df::Constant(-5.f), direction);
+
+  Mailbox<Primitive> mailbox;
+  unsigned int ray_id = mailbox.newRay();
+  float dist1 = 0, dist2 = 0;
+  BOOST_CHECK(mailbox.intersect(primitive, ray, ray_id, dist1));
+  BOOST_CHECK_EQUAL(mailbox.getAvoidedTests(), 0U);
+  BOOST_CHECK(mailbox.intersect(primitive, ray, ray_id, dist2));
+  BOOST_CHECK_EQUAL(mailbox.getAvoidedTests(), 1U);
+  BOOST_CHECK_EQUAL(dist1, dist2);
+
+  mailbox.intersect(primitive, ray, mailbox.newRay(), dist2);
+  BOOST_CHECK_EQUAL(mailbox.getAvoidedTests(), 1U);
+
+  delete scene;
+}
+
+BOOST_AUTO_TEST_CASE( test_IRT_KDTree_statistics )
+{
+  SimpleScene* scene = new SimpleScene;
+  for(int i = 0; i < 10; ++i)
+  {
+    scene->addPrimitive(new Sphere(Vector3df::Constant(3.f * i), 1.f));
+  }
+  BuildKDTree::automatic_build(scene);
+
+  Vector3df direction = Vector3df::Constant(1.f);
+  normalize(direction);
+  TraversalStatistics statistics = scene->getTraversalStatistics(Ray(Vector3df::Constant(-5.f), direction), 0, std::numeric_limits<float>::max());
+
+  BOOST_CHECK_GT(statistics.inner_nodes, 0);
+  BOOST_CHECK_GT(statistics.leaves, 0);
+  BOOST_CHECK_GT(statistics.intersection_tests, 0);
+
+  delete scene;
+}
+
+BOOST_AUTO_TEST_CASE( test_IRT_KDTree_quality )
+{
+  SimpleScene* scene = new SimpleScene;
+  for(int i = 0; i < 10; ++i)
+  {
+    scene->addPrimitive(new Sphere(Vector3df::Constant(3.f * i), 1.f));
+  }
+
+  KDTreeQuality flat = scene->getKDTree().getQuality(scene->getBoundingBox());
+  BOOST_CHECK_EQUAL(flat.nodes, 1U);
+  BOOST_CHECK_EQUAL(flat.leaf_sizes.size(), 11U);
+  BOOST_CHECK_CLOSE(flat.sah_cost, 10.f, 0.001f);
+
+  BuildKDTree::automatic_build(scene);
+  KDTreeQuality quality = scene->getKDTree().getQuality(scene->getBoundingBox());
+  BOOST_CHECK_EQUAL(quality.nodes, scene->getKDTree().getNodeCount());
+  BOOST_CHECK_EQUAL(2 * quality.leaves - 1, quality.nodes);
+  BOOST_CHECK_GT(quality.max_depth, 0U);
+  BOOST_CHECK_LE(quality.average_depth, quality.max_depth);
+
+  unsigned long leaves = 0;
+  for(unsigned int i = 0; i < quality.leaf_sizes.size(); ++i)
+  {
+    leaves += quality.leaf_sizes[i];
+  }
+  BOOST_CHECK_EQUAL(leaves, quality.leaves);
+  BOOST_CHECK_EQUAL(quality.leaf_sizes[0], quality.empty_leaves);
+  BOOST_CHECK_GE(quality.duplication, 1.f);
+  BOOST_CHECK_LT(quality.sah_cost, flat.sah_cost);
+  BOOST_CHECK_EQUAL(quality.node_bytes, quality.nodes * 8);
+
+  delete scene;
+}
+
+BOOST_AUTO_TEST_CASE( test_IRT_KDTree_lazy )
+{
+  SimpleScene* scene = new SimpleScene;
+  for(int i = 0; i < 10; ++i)
+  {
+    scene->addPrimitive(new Sphere(Vector3df::Constant(3.f * i), 1.f));
+  }
+  BuildKDTree::lazy_build(scene, 1);
+
+  const KDTree<Primitive>& tree = scene->getKDTree();
+  BOOST_CHECK(tree.hasDeferredLeaves());
+  BOOST_CHECK_EQUAL(tree.getRefinedLeaves(), 0U);
+
+  for(int i = 0; i < 10; ++i)
+  {
+    float dist = 0;
+    Ray ray(Vector3df(3.f * i, 3.f * i, -5.f), Vector3df(0.f, 0.f, 1.f));
+    Primitive* primitive = scene->getFirstCollision(ray, dist, 0, std::numeric_limits<float>::max());
+    BOOST_REQUIRE(primitive != NULL);
+    BOOST_CHECK_EQUAL(scene->getPrimitiveIndex(primitive), static_cast<unsigned long>(i));
+    BOOST_CHECK_CLOSE(dist, 4.f + 3.f * i, 0.001f);
+    BOOST_CHECK(scene->testCollision(ray, 100.f));
+  }
+  BOOST_CHECK_GT(tree.getRefinedLeaves(), 0U);
+
+  float dist = 0;
+  BOOST_CHECK(scene->getFirstCollision(Ray(Vector3df::Constant(-5.f), Vector3df(0.f, 1.f, 0.f)), dist, 0, std::numeric_limits<float>::max()) == NULL);
+
+  KDTreeQuality quality = tree.getQuality(scene->getBoundingBox());
+  unsigned long primitives = 0;
+  for(unsigned int i = 0; i < quality.leaf_sizes.size(); ++i)
+  {
+    primitives += i * quality.leaf_sizes[i];
+  }
+  BOOST_CHECK_GE(primitives, 10U);
+
+  delete scene;
+}
+
+BOOST_AUTO_TEST_CASE( test_IRT_KDTree_sweep )
+{
+  SimpleScene* scene = new SimpleScene;
+  addFixedScene(scene, 60);
+  BuildKDTree::automatic_build(scene);
+  BOOST_REQUIRE_GT(scene->getKDTree().getNodeCount(), 20U);
+
+  int remaining_depth, remaining_failures;
+  DataType enhancement_ratio_failure;
+  BuildKDTree::getAutomaticParameters(scene, remaining_depth, remaining_failures, enhancement_ratio_failure);
+  std::vector<unsigned int> indices;
+  std::vector<BoundingBox> bbs;
+  BuildKDTree::getRootPrimitives(scene->getPrimitiveBounds(), indices, bbs);
+
+  ReferenceBuild reference(scene->getPrimitives(), enhancement_ratio_failure);
+  reference.subdivide(0, scene->getBoundingBox(), indices, bbs, remaining_depth, remaining_failures);
+  BOOST_CHECK_EQUAL(reference.nodes.size(), scene->getKDTree().getNodeCount());
+  reference.check(scene->getKDTree(), scene->getKDTree().getNodeData(), 0);
+
+  delete scene;
+}
+
+#ifdef USE_TBB
+BOOST_AUTO_TEST_CASE( test_IRT_KDTree_parallel_build )
+{
+  SimpleScene* scene = new SimpleScene;
+  addFixedScene(scene, 4 * BuildKDTree::parallelThreshold());
+
+  int remaining_depth, remaining_failures;
+  DataType enhancement_ratio_failure;
+  BuildKDTree::getAutomaticParameters(scene, remaining_depth, remaining_failures, enhancement_ratio_failure);
+  std::vector<unsigned int> indices;
+  std::vector<BoundingBox> bbs;
+  BuildKDTree::getRootPrimitives(scene->getPrimitiveBounds(), indices, bbs);
+
+  // The nodes are allocated in another order, so the trees are compared from their roots
+  KDTree<Primitive> serial, parallel;
+  BuildKDTree::build(serial, scene->getPrimitives(), bbs, scene->getBoundingBox(), remaining_depth, remaining_failures, enhancement_ratio_failure, KDTreeCostModel(), 0, -1, false);
+  BuildKDTree::build(parallel, scene->getPrimitives(), bbs, scene->getBoundingBox(), remaining_depth, remaining_failures, enhancement_ratio_failure, KDTreeCostModel(), 0, -1, true);
+  BOOST_CHECK_EQUAL(parallel.getNodeCount(), serial.getNodeCount());
+  checkSameSubtree(serial, serial.getNodeData(), parallel, parallel.getNodeData());
+
+  delete scene;
+}
+#endif
+
+BOOST_AUTO_TEST_CASE( test_IRT_KDTree_occlusion )
+{
+  SimpleScene* scene = new SimpleScene;
+  for(int i = 0; i < 10; ++i)
+  {
+    scene->addPrimitive(new Sphere(Vector3df(3.f * i, 0.f, 0.f), 1.f));
+  }
+  Primitive* box = new Box(Vector3df(-1.f, -.1f, .5f), Vector3df(28.f, .1f, .7f));
+  scene->addPrimitive(box);
+
+  for(int build = 0; build < 2; ++build)
+  {
+    if(build == 0)
+    {
+      BuildKDTree::automatic_build(scene);
+      // The box must be referenced by several leaves for the last checks
+      const std::vector<Primitive*>& leaf_primitives = scene->getKDTree().getAllLeafPrimitives();
+      BOOST_REQUIRE_GT(std::count(leaf_primitives.begin(), leaf_primitives.end(), box), 1);
+    }
+    else
+    {
+      BuildKDTree::lazy_build(scene, 1);
+    }
+    const KDTree<Primitive>& tree = scene->getKDTree();
+
+    // A sphere between the origin and the light
+    Ray ray(Vector3df(-5.f, 0.f, 0.f), Vector3df(1.f, 0.f, 0.f));
+    BOOST_CHECK(tree.testCollision(ray, 0.f, 10.f));
+    BOOST_CHECK(scene->testCollision(ray, 10.f));
+
+    // The first sphere is beyond tfar, and so are the others of its leaf
+    BOOST_CHECK(!tree.testCollision(ray, 0.f, 3.9f));
+    BOOST_CHECK(!scene->testCollision(ray, 3.9f));
+    Ray between(Vector3df(1.5f, 0.f, 0.f), Vector3df(1.f, 0.f, 0.f));
+    BOOST_CHECK(!tree.testCollision(between, 0.f, .4f));
+    BOOST_CHECK(tree.testCollision(between, 0.f, .6f));
+
+    // The box straddles several leaves, and is found from each of them
+    for(int i = 0; i < 9; ++i)
+    {
+      Ray down(Vector3df(3.f * i + 1.5f, 0.f, 5.f), Vector3df(0.f, 0.f, -1.f));
+      BOOST_CHECK(tree.testCollision(down, 0.f, 4.4f));
+      BOOST_CHECK(!tree.testCollision(down, 0.f, 4.2f));
+    }
+    Ray along(Vector3df(-5.f, 0.f, .6f), Vector3df(1.f, 0.f, 0.f));
+    BOOST_CHECK(tree.testCollision(along, 0.f, 100.f));
+    BOOST_CHECK(!tree.testCollision(along, 0.f, 3.9f));
+  }
+
+  delete scene;
+}
+
+#ifdef USE_TBB
+/// Traces rays from several threads, storing the index of the hit primitive of each ray
+struct ParallelTracer
+{
+  SimpleScene* scene;
+  long* hits;
+
+  void operator()(const tbb::blocked_range<int>& range) const
+  {
+    for(int i = range.begin(); i != range.end(); ++i)
+    {
+      float dist = 0;
+      int sphere = i % 10;
+      Primitive* primitive = scene->getFirstCollision(Ray(Vector3df(3.f * sphere, 3.f * sphere, -5.f), Vector3df(0.f, 0.f, 1.f)), dist, 0, std::numeric_limits<float>::max());
+      hits[i] = primitive != NULL ? static_cast<long>(scene->getPrimitiveIndex(primitive)) : -1;
+    }
+  }
+};
+
+BOOST_AUTO_TEST_CASE( test_IRT_KDTree_lazy_parallel )
+{
+  SimpleScene* scene = new SimpleScene;
+  for(int i = 0; i < 10; ++i)
+  {
+    scene->addPrimitive(new Sphere(Vector3df::Constant(3.f * i), 1.f));
+  }
+
+  const int rays = 256;
+  long hits[rays];
+  for(int build = 0; build < 20; ++build)
+  {
+    // Every ray starts in the same deferred leaf, which the threads race to build
+    BuildKDTree::lazy_build(scene, 0);
+    BOOST_REQUIRE_EQUAL(scene->getKDTree().getRefinedLeaves(), 0U);
+
+    ParallelTracer tracer = {scene, hits};
+    tbb::parallel_for(tbb::blocked_range<int>(0, rays, 1), tracer);
+    for(int i = 0; i < rays; ++i)
+    {
+      BOOST_CHECK_EQUAL(hits[i], i % 10);
+    }
+  }
+
+  delete scene;
+}
+#endif
+
+BOOST_AUTO_TEST_CASE( test_IRT_KDTree_leaf_types )
+{
+  SimpleScene* scene = new SimpleScene;
+  Primitive* triangle = new Triangle(Vector3df(-4.f, -4.f, 3.f), Vector3df(4.f, -4.f, 3.f), Vector3df(0.f, 4.f, 3.f));
+  Primitive* sphere = new Sphere(Vector3df::Zero(), 2.f);
+  Primitive* box = new Box(Vector3df::Constant(-1.f), Vector3df::Constant(1.f));
+  scene->addPrimitive(box);
+  scene->addPrimitive(triangle);
+  scene->addPrimitive(new Box(Vector3df::Constant(-.5f), Vector3df::Constant(.5f)));
+  scene->addPrimitive(sphere);
+  BuildKDTree::automatic_build(scene);
+
+  float dist = 0;
+  BOOST_CHECK_EQUAL(scene->getFirstCollision(Ray(Vector3df(0.f, 0.f, 10.f), Vector3df(0.f, 0.f, -1.f)), dist, 0, std::numeric_limits<float>::max()), triangle);
+  BOOST_CHECK_CLOSE(dist, 7.f, 1e-3);
+  BOOST_CHECK_EQUAL(scene->getFirstCollision(Ray(Vector3df(0.f, 0.f, -10.f), Vector3df(0.f, 0.f, 1.f)), dist, 0, std::numeric_limits<float>::max()), sphere);
+  BOOST_CHECK_CLOSE(dist, 8.f, 1e-3);
+  BOOST_CHECK_EQUAL(scene->getFirstCollision(Ray(Vector3df(10.f, .8f, .8f), Vector3df(-1.f, 0.f, 0.f)), dist, 0, std::numeric_limits<float>::max()), sphere);
+  BOOST_CHECK(scene->testCollision(Ray(Vector3df(0.f, 0.f, -10.f), Vector3df(0.f, 0.f, 1.f)), 9.f));
+  BOOST_CHECK(!scene->testCollision(Ray(Vector3df(0.f, 0.f, -10.f), Vector3df(0.f, 0.f, 1.f)), 7.f));
+
+  delete scene;
+}
+
+BOOST_AUTO_TEST_CASE( test_IRT_KDTree_leaf_blocks )
+{
+  SimpleScene* scene = new SimpleScene;
+  std::vector<Primitive*> primitives;
+  for(int i = 0; i < 40; ++i)
+  {
+    Vector3df position(static_cast<float>(i % 4), static_cast<float>((i / 4) % 3), static_cast<float>(i % 5));
+    if(i % 2)
+    {
+      primitives.push_back(new Sphere(position, 1.5f));
+    }
+    else
+    {
+      Triangle* triangle = new Triangle(position, position + Vector3df(2.f, 0.f, .5f), position + Vector3df(0.f, 2.f, -.5f));
+      triangle->setBackFaceCulling(i % 4 == 0);
+      primitives.push_back(triangle);
+    }
+    scene->addPrimitive(primitives.back());
+  }
+  BuildKDTree::automatic_build(scene);
+
+  for(int step = 0; step < 2; ++step)
+  {
+    for(int i = 0; i < 50; ++i)
+    {
+      Vector3df direction(std::cos(.3f * i), std::sin(.3f * i), .2f * (i % 7) - .6f);
+      normalize(direction);
+      Ray ray(Vector3df(1.5f, 1.f, 2.f) - 10.f * direction, direction);
+
+      float closest = std::numeric_limits<float>::max();
+      for(std::vector<Primitive*>::const_iterator it = primitives.begin(); it != primitives.end(); ++it)
+      {
+        float cur_dist;
+        if((*it)->intersect(ray, cur_dist) && (0.0001f < cur_dist) && (cur_dist < closest))
+        {
+          closest = cur_dist;
+        }
+      }
+
+      float dist = 0;
+      BOOST_REQUIRE(scene->getFirstCollision(ray, dist, 0, std::numeric_limits<float>::max()) != NULL);
+      BOOST_CHECK_CLOSE(dist, closest, 1e-3);
+      BOOST_CHECK(scene->testCollision(ray, closest + .01f));
+    }
+
+    // The leaves changed by the removal are tested one primitive at a time
+    primitives.erase(std::find(primitives.begin(), primitives.end(), scene->getPrimitives()[1]));
+    delete scene->removePrimitive(1);
+  }
+
+  delete scene;
+}
+
+BOOST_AUTO_TEST_CASE( test_IRT_KDTree_leaf_blocks_culling )
+{
+  SimpleScene* scene = new SimpleScene;
+  std::vector<Triangle*> triangles;
+  for(int i = 0; i < 8; ++i)
+  {
+    triangles.push_back(new Triangle(Vector3df::Zero(), Vector3df(2.f, 0.f, 0.f), Vector3df(0.f, 2.f, 0.f)));
+    scene->addPrimitive(triangles.back());
+  }
+  const float vertices[] = {4.f, 0.f, 0.f, 6.f, 0.f, 0.f, 4.f, 2.f, 0.f};
+  const unsigned int indices[] = {0, 1, 2, 0, 1, 2, 0, 1, 2, 0, 1, 2, 0, 1, 2, 0, 1, 2, 0, 1, 2, 0, 1, 2};
+  TriangleMesh* mesh = new TriangleMesh(vertices, 3, indices, 8);
+  scene->addMesh(mesh);
+  BuildKDTree::automatic_build(scene);
+
+  // The flags change after the build, the runs of eight triangles being tested by blocks
+  Ray triangle_ray(Vector3df(.5f, .5f, -5.f), Vector3df(0.f, 0.f, 1.f));
+  Ray mesh_ray(Vector3df(4.5f, .5f, -5.f), Vector3df(0.f, 0.f, 1.f));
+  for(int step = 0; step < 3; ++step)
+  {
+    bool culling = step == 1;
+    for(std::vector<Triangle*>::const_iterator it = triangles.begin(); it != triangles.end(); ++it)
+    {
+      (*it)->setBackFaceCulling(culling);
+    }
+    mesh->setBackFaceCulling(culling);
+
+    float dist = 0;
+    BOOST_CHECK_EQUAL(scene->getFirstCollision(triangle_ray, dist, 0, std::numeric_limits<float>::max()) == NULL, culling);
+    BOOST_CHECK_EQUAL(scene->getFirstCollision(mesh_ray, dist, 0, std::numeric_limits<float>::max()) == NULL, culling);
+    BOOST_CHECK_EQUAL(scene->testCollision(triangle_ray, 10.f), !culling);
+    BOOST_CHECK_EQUAL(scene->testCollision(mesh_ray, 10.f), !culling);
+  }
+
+  delete scene;
+}
+
+BOOST_AUTO_TEST_CASE( test_IRT_KDTree_leaf_blocks_mailbox )
+{
+  SimpleScene* scene = new SimpleScene;
+  for(int i = 0; i < 8; ++i)
+  {
+    scene->addPrimitive(new Sphere(Vector3df::Zero(), 2.f));
+  }
+  for(int i = 0; i < 17; ++i)
+  {
+    for(int j = 0; j < 16; ++j)
+    {
+      scene->addPrimitive(new Sphere(Vector3df(.25f * i - 2.f, .5f * (j % 4) - .75f, .5f * (j / 4) - .75f), .05f));
+    }
+  }
+  BuildKDTree::automatic_build(scene);
+
+  // The big spheres straddle the leaves crossed before their exit point, their runs being tested by blocks
+  scene->resetAvoidedTests();
+  Ray ray(Vector3df::Zero(), Vector3df(1.f, 0.f, 0.f));
+  float dist = 0;
+  BOOST_REQUIRE(scene->getFirstCollision(ray, dist, 0, std::numeric_limits<float>::max()) != NULL);
+  BOOST_CHECK_CLOSE(dist, 2.f, 1e-3);
+  BOOST_CHECK_GT(scene->getAvoidedTests(), 0U);
+
+  delete scene;
+}
+
+BOOST_AUTO_TEST_SUITE_END()
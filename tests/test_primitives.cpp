@@ -6,6 +6,7 @@
 #include <boost/test/unit_test.hpp>
 
 #include "../IRT/primitives.h"
+#include "../IRT/primitive_dispatch.h"
 
 using namespace IRT;
 
@@ -23,4 +24,103 @@ BOOST_AUTO_TEST_CASE( test_IRT_primitive_bb )
   delete primitive;
 }
 
+BOOST_AUTO_TEST_CASE( test_IRT_primitive_clipped_bb )
+{
+  Primitive* sphere = new IRT::Sphere(Vector3df::Zero(), 1);
+  BoundingBox box;
+  box.corner1 = Vector3df(.8f, -2.f, -2.f);
+  box.corner2 = Vector3df::Constant(2.f);
+
+  BoundingBox bb = sphere->getClippedBoundingBox(box);
+  BOOST_CHECK_CLOSE(bb.corner1(0), .8f, 1e-4);
+  BOOST_CHECK_CLOSE(bb.corner2(0), 1.f, 1e-4);
+  BOOST_CHECK_CLOSE(bb.corner1(1), -.6f, 1e-4);
+  BOOST_CHECK_CLOSE(bb.corner2(2), .6f, 1e-4);
+
+  Primitive* triangle = new IRT::Triangle(Vector3df::Zero(), Vector3df(2.f, 0.f, 0.f), Vector3df(0.f, 2.f, 0.f));
+  box.corner1 = Vector3df(1.f, 0.f, -1.f);
+  box.corner2 = Vector3df(2.f, 2.f, 1.f);
+  bb = triangle->getClippedBoundingBox(box);
+  BOOST_CHECK(!bb.isEmpty());
+  BOOST_CHECK_CLOSE(bb.corner2(1), 1.f, 1e-4);
+
+  box.corner1 = Vector3df(1.5f, 1.5f, -1.f);
+  BOOST_CHECK(triangle->getClippedBoundingBox(box).isEmpty());
+
+  delete sphere;
+  delete triangle;
+}
+
+BOOST_AUTO_TEST_CASE( test_IRT_triangle_intersect )
+{
+  IRT::Triangle* triangle = new IRT::Triangle(Vector3df::Zero(), Vector3df(2.f, 0.f, 0.f), Vector3df(0.f, 2.f, 0.f));
+  Ray front(Vector3df(.5f, .5f, 5.f), Vector3df(0.f, 0.f, -1.f));
+  Ray back(Vector3df(.5f, .5f, -5.f), Vector3df(0.f, 0.f, 1.f));
+
+  float dist = 0;
+  BOOST_CHECK(triangle->intersect(front, dist));
+  BOOST_CHECK_CLOSE(dist, 5.f, 1e-4);
+  BOOST_CHECK(triangle->intersect(back, dist));
+  BOOST_CHECK_CLOSE(dist, 5.f, 1e-4);
+  BOOST_CHECK(!triangle->intersect(Ray(Vector3df(1.5f, 1.5f, 5.f), Vector3df(0.f, 0.f, -1.f)), dist));
+
+  triangle->setBackFaceCulling(true);
+  BOOST_CHECK(triangle->intersect(front, dist));
+  BOOST_CHECK(!triangle->intersect(back, dist));
+
+  HitRecord hit;
+  BOOST_REQUIRE(triangle->intersect(front, hit));
+  hit.primitive = triangle;
+  PrimitiveDispatch<Primitive>::computeHit(front, hit);
+  BOOST_CHECK_CLOSE(hit.normal(2), 1.f, 1e-4);
+  BOOST_CHECK_CLOSE(hit.u, .25f, 1e-3);
+  BOOST_CHECK_CLOSE(hit.v, .25f, 1e-3);
+
+  delete triangle;
+}
+
+BOOST_AUTO_TEST_CASE( test_IRT_primitive_computeHit )
+{
+  Primitive* sphere = new IRT::Sphere(Vector3df(0.f, 0.f, 20.f), 2.f);
+  Primitive* box = new IRT::Box(Vector3df(-8.f, 4.f, 26.f), Vector3df(8.f, 10.f, 1000.f));
+  HitRecord hit;
+
+  Ray ray(Vector3df::Zero(), Vector3df(0.f, 0.f, 1.f));
+  BOOST_REQUIRE(sphere->intersect(ray, hit));
+  hit.primitive = sphere;
+  PrimitiveDispatch<Primitive>::computeHit(ray, hit);
+  BOOST_CHECK_CLOSE(hit.point(2), 18.f, 1e-4);
+  BOOST_CHECK_CLOSE(hit.normal(2), -1.f, 1e-4);
+
+  // The hit points of the faces far from the origin are not exactly on the faces
+  for(int i = 0; i < 20; ++i)
+  {
+    Vector3df direction(-.25f + i * .025f, .3f, 1.f);
+    normalize(direction);
+    Ray box_ray(Vector3df::Zero(), direction);
+    BOOST_REQUIRE(box->intersect(box_ray, hit));
+    hit.primitive = box;
+    PrimitiveDispatch<Primitive>::computeHit(box_ray, hit);
+    BOOST_CHECK_EQUAL(hit.face, 4U);
+    BOOST_CHECK_EQUAL(hit.normal, Normal3df(0.f, 0.f, -1.f));
+  }
+
+  Ray side(Vector3df(20.f, 5.f, 30.f), Vector3df(-1.f, 0.f, 0.f));
+  BOOST_REQUIRE(box->intersect(side, hit));
+  PrimitiveDispatch<Primitive>::computeHit(side, hit);
+  BOOST_CHECK_EQUAL(hit.face, 1U);
+  BOOST_CHECK_EQUAL(hit.normal, Normal3df(1.f, 0.f, 0.f));
+
+  // From inside, the box is hit where the ray leaves it
+  Ray inside(Vector3df(0.f, 5.f, 30.f), Vector3df(0.f, 1.f, 0.f));
+  BOOST_REQUIRE(box->intersect(inside, hit));
+  PrimitiveDispatch<Primitive>::computeHit(inside, hit);
+  BOOST_CHECK_CLOSE(hit.dist, 5.f, 1e-4);
+  BOOST_CHECK_EQUAL(hit.face, 3U);
+  BOOST_CHECK_EQUAL(hit.normal, Normal3df(0.f, 1.f, 0.f));
+
+  delete sphere;
+  delete box;
+}
+
 BOOST_AUTO_TEST_SUITE_END()
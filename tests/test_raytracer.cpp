@@ -7,7 +7,9 @@
 
 #include "../IRT/simple_scene.h"
 #include "../IRT/primitives.h"
+#include "../IRT/light.h"
 #include "../IRT/raytracer.h"
+#include "../IRT/build_kdtree.h"
 
 #include "../IRT/samplers/uniform_sampler.h"
 
@@ -107,6 +109,58 @@ BOOST_AUTO_TEST_CASE( test_IRT_Raytracer_draw )
   delete scene;
 }
 
+BOOST_AUTO_TEST_CASE( test_IRT_Raytracer_draw_packets )
+{
+  // An odd resolution, so that the last row and column are not in squares of 2x2 pixels
+  const unsigned int width = 33;
+  const unsigned int height = 25;
+  Raytracer<UniformSampler<float> >* raytracer = new Raytracer<UniformSampler<float> >(width, height);
+  SimpleScene* scene = new SimpleScene;
+  unsigned int material = scene->addMaterial(Color::Constant(1.f), .5f, 1.f);
+  for(int i = 0; i < 5; ++i)
+  {
+    for(int j = 0; j < 4; ++j)
+    {
+      Primitive* primitive = new Sphere(Vector3df(-8.f + 4.f * i, -6.f + 4.f * j, 30.f + i), 1.5f);
+      primitive->setMaterial(material);
+      scene->addPrimitive(primitive);
+    }
+  }
+  scene->addLight(new Light(Vector3df(0.f, 20.f, 0.f), Color::Constant(400.f)));
+  BuildKDTree::automatic_build(scene);
+
+  raytracer->setScene(scene);
+  raytracer->setSize(16.5f, 12.5f);
+  raytracer->setViewer(Point3df::Zero(), Vector3df(0.f, 0.f, 20.f));
+  raytracer->setOrientation(Vector3df(0.f, 1.f, 0.f));
+  raytracer->setOversampling(1);
+
+  float* screen = new float[width * height * 3];
+  raytracer->draw(screen);
+
+  unsigned int lit = 0;
+  for(unsigned int j = 0; j < height; ++j)
+  {
+    for(unsigned int i = 0; i < width; ++i)
+    {
+      Ray ray(Point3df::Zero(), Vector3df(0.f, 0.f, 1.f));
+      raytracer->generateRay(i, j, ray);
+      Color color = Color::Zero();
+      raytracer->computeColor(ray, color);
+      for(unsigned int k = 0; k < 3; ++k)
+      {
+        BOOST_CHECK_SMALL(screen[3 * (j * width + i) + k] - color(k), 1e-5f);
+      }
+      lit += color(0) > 0;
+    }
+  }
+  BOOST_CHECK(lit > 0);
+
+  delete[] screen;
+  delete raytracer;
+  delete scene;
+}
+
 // BOOST_AUTO_TEST_CASE( test_IRT_Raytracer_computeColor )
 // {
 //   Raytracer* raytracer = new Raytracer(640, 480);
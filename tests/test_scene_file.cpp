@@ -0,0 +1,162 @@
+/**
+ * \file test_scene_file.cpp
+ * Scene file file for the test suit
+ */
+
+#include <cstdio>
+#include <limits>
+#include <stdexcept>
+#include <boost/test/unit_test.hpp>
+
+#include "../IRT/simple_scene.h"
+#include "../IRT/primitives.h"
+#include "../IRT/light.h"
+#include "../IRT/build_kdtree.h"
+#include "../IRT/scene_file.h"
+
+using namespace IRT;
+
+BOOST_AUTO_TEST_SUITE( irt_scenefile_suite )
+
+BOOST_AUTO_TEST_CASE( test_IRT_SceneFile_saveLoad )
+{
+  SimpleScene* scene = new SimpleScene;
+  for(int i = 0; i < 10; ++i)
+  {
+    scene->addPrimitive(new Sphere(Vector3df::Constant(3.f * i), 1.f));
+  }
+  scene->addPrimitive(new Box(Vector3df(-2.f, 10.f, -2.f), Vector3df(2.f, 12.f, 2.f)));
+  scene->addPrimitive(new Triangle(Vector3df(-1.f, -1.f, 40.f), Vector3df(1.f, -1.f, 40.f), Vector3df(0.f, 1.f, 40.f)));
+  scene->addLight(new Light(Vector3df(0.f, 20.f, 0.f), Color::Constant(1.f)));
+  BuildKDTree::automatic_build(scene);
+
+  const std::string filename = "test_scene_file.irt";
+  BOOST_REQUIRE_NO_THROW(SceneFile::save(scene, filename));
+
+  SimpleScene* loaded = NULL;
+  BOOST_REQUIRE_NO_THROW(loaded = SceneFile::load(filename));
+  BOOST_CHECK_EQUAL(loaded->getKDTree().getNodeCount(), scene->getKDTree().getNodeCount());
+  BOOST_CHECK_EQUAL(loaded->getLight(0)->getCenter()(1), 20.f);
+
+  Vector3df directions[3] = {Vector3df::Constant(1.f), Vector3df(0.f, 1.f, 0.f), Vector3df(0.f, 0.f, 1.f)};
+  for(int i = 0; i < 3; ++i)
+  {
+    normalize(directions[i]);
+    Ray ray(Vector3df::Constant(-5.f), directions[i]);
+    if(i == 2)
+    {
+      ray = Ray(Vector3df::Zero(), directions[i]);
+    }
+    float dist = 0, loaded_dist = 0;
+    Primitive* primitive = scene->getFirstCollision(ray, dist, 0, std::numeric_limits<float>::max());
+    Primitive* loaded_primitive = loaded->getFirstCollision(ray, loaded_dist, 0, std::numeric_limits<float>::max());
+    BOOST_CHECK_EQUAL(primitive == NULL, loaded_primitive == NULL);
+    if(primitive != NULL && loaded_primitive != NULL)
+    {
+      BOOST_CHECK_EQUAL(scene->getPrimitiveIndex(primitive), loaded->getPrimitiveIndex(loaded_primitive));
+      BOOST_CHECK_CLOSE(dist, loaded_dist, 0.001f);
+    }
+  }
+
+  delete loaded;
+  delete scene;
+  std::remove(filename.c_str());
+
+  BOOST_CHECK_THROW(SceneFile::load(filename), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE( test_IRT_SceneFile_materials )
+{
+  SimpleScene* scene = new SimpleScene;
+  unsigned int red = scene->addMaterial(Color(1.f, 0.f, 0.f), .5f, .2f);
+  unsigned int other_red = scene->addMaterial(Color(1.f, 0.f, 0.f), .5f, .2f);
+  scene->addMaterial(Color(0.f, 1.f, 0.f), 0.f, 1.f);
+  unsigned int blue = scene->addMaterial(Color(0.f, 0.f, 1.f), .1f, .9f);
+
+  Primitive* sphere = new Sphere(Vector3df::Zero(), 1.f);
+  sphere->setMaterial(blue);
+  scene->addPrimitive(sphere);
+  Primitive* box = new Box(Vector3df::Constant(2.f), Vector3df::Constant(3.f));
+  box->setMaterial(other_red);
+  scene->addPrimitive(box);
+  Primitive* triangle = new Triangle(Vector3df(-1.f, -1.f, 5.f), Vector3df(1.f, -1.f, 5.f), Vector3df(0.f, 1.f, 5.f));
+  triangle->setMaterial(red);
+  scene->addPrimitive(triangle);
+  BuildKDTree::automatic_build(scene);
+
+  const std::string filename = "test_scene_file_materials.irt";
+  BOOST_REQUIRE_NO_THROW(SceneFile::save(scene, filename));
+  SimpleScene* loaded = NULL;
+  BOOST_REQUIRE_NO_THROW(loaded = SceneFile::load(filename));
+
+  // The table is kept as is, with its unused and its equal materials
+  BOOST_REQUIRE_EQUAL(loaded->getMaterialCount(), scene->getMaterialCount());
+  for(unsigned int i = 0; i < scene->getMaterialCount(); ++i)
+  {
+    BOOST_CHECK(loaded->getMaterial(i).color == scene->getMaterial(i).color);
+    BOOST_CHECK_EQUAL(loaded->getMaterial(i).reflection, scene->getMaterial(i).reflection);
+    BOOST_CHECK_EQUAL(loaded->getMaterial(i).diffuse, scene->getMaterial(i).diffuse);
+  }
+  for(unsigned int i = 0; i < 3; ++i)
+  {
+    BOOST_CHECK_EQUAL(loaded->getPrimitive(i)->getMaterial(), scene->getPrimitive(i)->getMaterial());
+  }
+
+  // Editing a material only changes the primitives that use it
+  loaded->setMaterial(other_red, Color(1.f, 1.f, 0.f), .5f, .2f);
+  BOOST_CHECK(loaded->getMaterial(loaded->getPrimitive(2)->getMaterial()).color == Color(1.f, 0.f, 0.f));
+
+  delete loaded;
+  delete scene;
+  std::remove(filename.c_str());
+}
+
+BOOST_AUTO_TEST_CASE( test_IRT_SceneFile_culling )
+{
+  SimpleScene* scene = new SimpleScene;
+  Triangle* culled = new Triangle(Vector3df(-1.f, -1.f, 5.f), Vector3df(1.f, -1.f, 5.f), Vector3df(0.f, 1.f, 5.f));
+  culled->setBackFaceCulling(true);
+  scene->addPrimitive(culled);
+  scene->addPrimitive(new Triangle(Vector3df(-1.f, -1.f, 8.f), Vector3df(1.f, -1.f, 8.f), Vector3df(0.f, 1.f, 8.f)));
+  BuildKDTree::automatic_build(scene);
+
+  const std::string filename = "test_scene_file_culling.irt";
+  BOOST_REQUIRE_NO_THROW(SceneFile::save(scene, filename));
+  SimpleScene* loaded = NULL;
+  BOOST_REQUIRE_NO_THROW(loaded = SceneFile::load(filename));
+
+  BOOST_CHECK(static_cast<Triangle*>(loaded->getPrimitive(0))->getBackFaceCulling());
+  BOOST_CHECK(!static_cast<Triangle*>(loaded->getPrimitive(1))->getBackFaceCulling());
+
+  delete loaded;
+  delete scene;
+  std::remove(filename.c_str());
+}
+
+BOOST_AUTO_TEST_CASE( test_IRT_SceneFile_deferred )
+{
+  SimpleScene* scene = new SimpleScene;
+  scene->addPrimitive(new Sphere(Vector3df::Zero(), 1.f));
+  BOOST_REQUIRE_EQUAL(scene->getKDTree().getNodeCount(), 1U);
+
+  const std::string filename = "test_scene_file_deferred.irt";
+  BOOST_REQUIRE_NO_THROW(SceneFile::save(scene, filename));
+
+  // The only node is just before the index of the only leaf primitive, its flags being its second half
+  std::FILE* file = std::fopen(filename.c_str(), "r+b");
+  BOOST_REQUIRE(file != NULL);
+  std::fseek(file, -static_cast<long>(sizeof(unsigned int) + sizeof(KDTree<Primitive>::KDTreeNode) / 2), SEEK_END);
+  unsigned int flags = 0;
+  BOOST_REQUIRE_EQUAL(std::fread(&flags, sizeof(flags), 1, file), 1U);
+  flags |= 1U << 31;
+  std::fseek(file, -static_cast<long>(sizeof(unsigned int) + sizeof(KDTree<Primitive>::KDTreeNode) / 2), SEEK_END);
+  BOOST_REQUIRE_EQUAL(std::fwrite(&flags, sizeof(flags), 1, file), 1U);
+  std::fclose(file);
+
+  BOOST_CHECK_THROW(SceneFile::load(filename), std::runtime_error);
+
+  delete scene;
+  std::remove(filename.c_str());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -4,6 +4,7 @@
  */
 
 #include <limits>
+#include <stdexcept>
 #include <boost/test/unit_test.hpp>
 
 #include "../IRT/simple_scene.h"
@@ -11,6 +12,7 @@
 #include "../IRT/light.h"
 
 #include "../IRT/build_kdtree.h"
+#include "../IRT/build_bvh.h"
 
 using namespace IRT;
 
@@ -118,6 +120,25 @@ BOOST_AUTO_TEST_CASE( test_IRT_SimpleScene_computeBoundingBox )
   BOOST_CHECK((bb.corner2 == scene_bb.corner2));
 }
 
+BOOST_AUTO_TEST_CASE( test_IRT_SimpleScene_primitiveBounds )
+{
+  SimpleScene* scene = new SimpleScene;
+  scene->addPrimitive(new Sphere(Vector3df::Zero(), 3.f));
+  scene->addPrimitive(new Sphere(Vector3df::Constant(10.f), 1.f));
+  BOOST_CHECK_EQUAL(scene->getPrimitiveBounds().size(), 2U);
+  BOOST_CHECK_EQUAL(scene->getPrimitiveBounds().getLower(0)[1], 9.f);
+  BOOST_CHECK_EQUAL(scene->getPrimitiveBounds().getCentroids(2)[1], 10.f);
+
+  delete scene->removePrimitive(0);
+  BOOST_CHECK_EQUAL(scene->getPrimitiveBounds().size(), 1U);
+  BOOST_CHECK((scene->getPrimitiveBounds().getBoundingBox(0).corner2 == Point3df::Constant(11.f)));
+
+  scene->computeBoundingBox();
+  BOOST_CHECK((scene->getBoundingBox().corner1 == Point3df::Constant(9.f)));
+
+  delete scene;
+}
+
 BOOST_AUTO_TEST_CASE( test_IRT_SimpleScene_removePrimitive )
 {
   Primitive* primitive = new Sphere(Vector3df::Zero(), 3.f);
@@ -137,6 +158,83 @@ BOOST_AUTO_TEST_CASE( test_IRT_SimpleScene_removePrimitive )
   delete scene;
 }
 
+BOOST_AUTO_TEST_CASE( test_IRT_SimpleScene_incrementalUpdate )
+{
+  SimpleScene* scene = new SimpleScene;
+  for(int i = 0; i < 20; ++i)
+  {
+    scene->addPrimitive(new Sphere(Vector3df(3.f * i, 0.f, 0.f), 1.f));
+  }
+
+  Ray ray(Vector3df(-5.f, 0.f, 0.f), Vector3df(1.f, 0.f, 0.f));
+  float tnear = 0; float tfar = std::numeric_limits<float>::max();
+  for(int type = 0; type < 2; ++type)
+  {
+    if(type == 0)
+      BuildKDTree::automatic_build(scene);
+    else
+      BuildBVH::automatic_build(scene);
+    unsigned long nodes = type == 0 ? scene->getKDTree().getNodeCount() : scene->getBVH().getNodes().size();
+
+    float dist = 0;
+    Primitive* first = scene->getFirstCollision(ray, dist, tnear, tfar);
+    BOOST_REQUIRE(first != NULL);
+    scene->removePrimitive(scene->getPrimitiveIndex(first));
+    BOOST_CHECK(scene->getFirstCollision(ray, dist, tnear, tfar) != first);
+    BOOST_CHECK_CLOSE(dist, 7.f, 0.001f);
+
+    scene->addPrimitive(first);
+    BOOST_CHECK_EQUAL(scene->getFirstCollision(ray, dist, tnear, tfar), first);
+    BOOST_CHECK_CLOSE(dist, 4.f, 0.001f);
+
+    Primitive* added = new Sphere(Vector3df(-3.f, 0.f, 0.f), .5f);
+    scene->addPrimitive(added);
+    BOOST_CHECK_EQUAL(scene->getFirstCollision(ray, dist, tnear, tfar), added);
+    BOOST_CHECK_EQUAL(type == 0 ? scene->getKDTree().getNodeCount() : scene->getBVH().getNodes().size(), nodes);
+
+    BOOST_CHECK(!scene->updateAccelerators(1000.f));
+    BOOST_CHECK(scene->updateAccelerators(0.f));
+    BOOST_CHECK_EQUAL(scene->getFirstCollision(ray, dist, tnear, tfar), added);
+    delete scene->removePrimitive(scene->getPrimitiveIndex(added));
+  }
+
+  delete scene;
+}
+
+BOOST_AUTO_TEST_CASE( test_IRT_SimpleScene_setAccelerator )
+{
+  SimpleScene* scene = new SimpleScene;
+  for(int i = 0; i < 20; ++i)
+  {
+    scene->addPrimitive(new Sphere(Vector3df(3.f * i, 0.f, 0.f), 1.f));
+  }
+  BuildBVH::automatic_build(scene);
+  BuildKDTree::automatic_build(scene);
+  unsigned long nodes = scene->getBVH().getNodes().size();
+
+  // Only the kd-tree follows the new primitive, the hierarchy being rebuilt when it is selected again
+  Primitive* added = new Sphere(Vector3df(-3.f, 0.f, 0.f), .5f);
+  scene->addPrimitive(added);
+  BOOST_CHECK_EQUAL(scene->getBVH().getNodes().size(), nodes);
+  BOOST_CHECK(scene->getBVH().getNodes()[0].getBoundingBox().corner1(0) > -3.f);
+
+  scene->setAccelerator(SimpleScene::BoundingVolumeHierarchy);
+  BOOST_CHECK_EQUAL(scene->getAccelerator(), SimpleScene::BoundingVolumeHierarchy);
+  BOOST_CHECK_CLOSE(scene->getBVH().getNodes()[0].getBoundingBox().corner1(0), -3.5f, 0.001f);
+
+  Ray ray(Vector3df(-5.f, 0.f, 0.f), Vector3df(1.f, 0.f, 0.f));
+  float dist = 0;
+  BOOST_CHECK_EQUAL(scene->getFirstCollision(ray, dist, 0.f, std::numeric_limits<float>::max()), added);
+  BOOST_CHECK_CLOSE(dist, 1.5f, 0.001f);
+
+  // The refit shrinks the boxes to the cached bounds of the remaining primitives
+  delete scene->removePrimitive(scene->getPrimitiveIndex(added));
+  BOOST_CHECK(!scene->updateAccelerators(1000.f));
+  BOOST_CHECK_CLOSE(scene->getBVH().getNodes()[0].getBoundingBox().corner1(0), -1.f, 0.001f);
+
+  delete scene;
+}
+
 BOOST_AUTO_TEST_CASE( test_IRT_SimpleScene_addLight )
 {
   Light* light = new Light(Vector3df::Zero(), Vector3df(1.));
@@ -232,23 +330,52 @@ BOOST_AUTO_TEST_CASE( test_IRT_SimpleScene_testCollision )
 BOOST_AUTO_TEST_CASE( test_IRT_SimpleScene_computeColor )
 {
   Primitive* primitive = new Sphere(Vector3df::Zero(), 3.f);
-  primitive->setDiffuse(1);
   Light* light = new Light(Vector3df::Constant(5.), Vector3df::Constant(1.));
   SimpleScene* scene = new SimpleScene;
+  primitive->setMaterial(scene->addMaterial(Color::Constant(1.f), 0.f, 1.f));
   IRT::BuildKDTree::automatic_build(scene);
 
   unsigned long index = 0;
   BOOST_CHECK_NO_THROW(index = scene->addLight(light));
   BOOST_CHECK_NO_THROW(index = scene->addPrimitive(primitive));
 
-  MaterialPoint material;
-  material.normal = Normal3df::Constant(1.);
-  material.normal.normalize();
+  HitRecord hit;
+  hit.primitive = primitive;
+  hit.normal = Normal3df::Constant(1.);
+  hit.normal.normalize();
+
+  hit.point = Vector3df::Constant(4.);
+  BOOST_CHECK((scene->computeColor(hit) != Normal3df::Constant(0.f)));
+  std::cout << scene->computeColor(hit) << std::endl;
+  hit.point = Vector3df::Constant(-4.);
+  std::cout << scene->computeColor(hit) << std::endl;
+  BOOST_CHECK((scene->computeColor(hit) == Normal3df::Constant(0.f)));
+
+  delete scene;
+}
 
-  BOOST_CHECK((scene->computeColor(Vector3df::Constant(4.), material, primitive) != Normal3df::Constant(0.f)));
-  std::cout << scene->computeColor(Vector3df::Constant(4.), material, primitive) << std::endl;
-  std::cout << scene->computeColor(Vector3df::Constant(-4.), material, primitive) << std::endl;
-  BOOST_CHECK((scene->computeColor(Vector3df::Constant(-4.), material, primitive) == Normal3df::Constant(0.f)));
+BOOST_AUTO_TEST_CASE( test_IRT_SimpleScene_materials )
+{
+  SimpleScene* scene = new SimpleScene;
+  BOOST_CHECK_EQUAL(scene->getMaterialCount(), 1U);
+  unsigned int red = scene->addMaterial(Color(1.f, 0.f, 0.f), .5f, 1.f);
+  BOOST_CHECK_EQUAL(red, 1U);
+
+  Primitive* sphere1 = new Sphere(Vector3df::Zero(), 1.f);
+  Primitive* sphere2 = new Sphere(Vector3df::Constant(3.f), 1.f);
+  Primitive* sphere3 = new Sphere(Vector3df::Constant(6.f), 1.f);
+  sphere1->setMaterial(red);
+  sphere2->setMaterial(red);
+  sphere3->setMaterial(2);
+  scene->addPrimitive(sphere1);
+  scene->addPrimitive(sphere2);
+  BOOST_CHECK_THROW(scene->addPrimitive(sphere3), std::out_of_range);
+  delete sphere3;
+
+  scene->setMaterial(red, Color(0.f, 0.f, 1.f), .25f, 1.f);
+  BOOST_CHECK_EQUAL(scene->getMaterial(sphere1->getMaterial()).color, Color(0.f, 0.f, 1.f));
+  BOOST_CHECK_EQUAL(scene->getMaterial(sphere2->getMaterial()).reflection, .25f);
+  BOOST_CHECK_THROW(scene->setMaterial(2, Color::Zero(), 0.f, 0.f), std::out_of_range);
 
   delete scene;
 }
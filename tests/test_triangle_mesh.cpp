@@ -0,0 +1,145 @@
+/**
+ * \file test_triangle_mesh.cpp
+ * Triangle mesh file for the test suit
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <boost/test/unit_test.hpp>
+
+#include "../IRT/simple_scene.h"
+#include "../IRT/primitives.h"
+#include "../IRT/triangle_mesh.h"
+#include "../IRT/primitive_dispatch.h"
+#include "../IRT/build_kdtree.h"
+
+using namespace IRT;
+
+BOOST_AUTO_TEST_SUITE( irt_trianglemesh_suite )
+
+BOOST_AUTO_TEST_CASE( test_IRT_TriangleMesh_intersect )
+{
+  const float vertices[] = {0.f, 0.f, 0.f, 2.f, 0.f, 0.f, 2.f, 2.f, 0.f, 0.f, 2.f, 0.f};
+  const unsigned int indices[] = {0, 1, 2, 0, 2, 3};
+
+  SimpleScene* scene = new SimpleScene;
+  TriangleMesh* mesh = new TriangleMesh(vertices, 4, indices, 2);
+  BOOST_CHECK_EQUAL(mesh->getVertexCount(), 4U);
+  BOOST_CHECK_EQUAL(mesh->getTriangleCount(), 2U);
+  scene->addMesh(mesh);
+  BOOST_CHECK_EQUAL(scene->getPrimitives().size(), 2U);
+
+  Primitive* reference = new Triangle(Vector3df::Zero(), Vector3df(2.f, 0.f, 0.f), Vector3df(2.f, 2.f, 0.f));
+  Primitive* triangle = mesh->getTriangle(0);
+
+  BoundingBox bb = triangle->getBoundingBox();
+  BOOST_CHECK_EQUAL(bb.corner1, Vector3df(0.f, 0.f, 0.f));
+  BOOST_CHECK_EQUAL(bb.corner2, Vector3df(2.f, 2.f, 0.f));
+
+  Ray ray(Vector3df(1.5f, .5f, 5.f), Vector3df(0.f, 0.f, -1.f));
+  float reference_dist = 0, triangle_dist = 0;
+  BOOST_CHECK(reference->intersect(ray, reference_dist));
+  BOOST_CHECK(triangle->intersect(ray, triangle_dist));
+  BOOST_CHECK_CLOSE(reference_dist, triangle_dist, 1e-3);
+  BOOST_CHECK(!mesh->getTriangle(1)->intersect(ray, triangle_dist));
+
+  HitRecord reference_hit, triangle_hit;
+  BOOST_REQUIRE(reference->intersect(ray, reference_hit));
+  BOOST_REQUIRE(triangle->intersect(ray, triangle_hit));
+  reference_hit.primitive = reference;
+  triangle_hit.primitive = triangle;
+  PrimitiveDispatch<Primitive>::computeHit(ray, reference_hit);
+  PrimitiveDispatch<Primitive>::computeHit(ray, triangle_hit);
+  BOOST_CHECK_SMALL(norm2(Vector3df(reference_hit.normal - triangle_hit.normal)), 1e-6f);
+  BOOST_CHECK_CLOSE(reference_hit.u, triangle_hit.u, 1e-3);
+  BOOST_CHECK_CLOSE(reference_hit.v, triangle_hit.v, 1e-3);
+
+  BuildKDTree::automatic_build(scene);
+  float dist = 0;
+  BOOST_CHECK_EQUAL(scene->getFirstCollision(Ray(Vector3df(.5f, 1.5f, 5.f), Vector3df(0.f, 0.f, -1.f)), dist, 0, std::numeric_limits<float>::max()), mesh->getTriangle(1));
+  BOOST_CHECK_CLOSE(dist, 5.f, 1e-3);
+  BOOST_CHECK_THROW(scene->removePrimitive(0), std::invalid_argument);
+
+  delete reference;
+  delete scene;
+}
+
+BOOST_AUTO_TEST_CASE( test_IRT_TriangleMesh_leaf_blocks )
+{
+  // A folded strip, the triangles alternating their winding so that half of them are seen from the back
+  std::vector<float> vertices;
+  for(int k = 0; k < 22; ++k)
+  {
+    vertices.push_back(.1f * (k / 2));
+    vertices.push_back(2.f * (k % 2));
+    vertices.push_back(std::sin(static_cast<float>(k)));
+  }
+  std::vector<unsigned int> indices;
+  for(unsigned int t = 0; t < 20; ++t)
+  {
+    indices.push_back(t);
+    indices.push_back(t + 1);
+    indices.push_back(t + 2);
+  }
+
+  SimpleScene* mesh_scene = new SimpleScene;
+  TriangleMesh* mesh = new TriangleMesh(&vertices[0], 22, &indices[0], 20);
+  mesh_scene->addMesh(mesh);
+  SimpleScene* triangle_scene = new SimpleScene;
+  std::vector<Triangle*> triangles;
+  for(unsigned int t = 0; t < 20; ++t)
+  {
+    triangles.push_back(new Triangle(mesh->getCorner(t, 0), mesh->getCorner(t, 1), mesh->getCorner(t, 2)));
+    triangle_scene->addPrimitive(triangles.back());
+  }
+  BuildKDTree::automatic_build(mesh_scene);
+  BuildKDTree::automatic_build(triangle_scene);
+
+  for(int step = 0; step < 2; ++step)
+  {
+    bool culling = step == 1;
+    mesh->setBackFaceCulling(culling);
+    for(std::vector<Triangle*>::const_iterator it = triangles.begin(); it != triangles.end(); ++it)
+    {
+      (*it)->setBackFaceCulling(culling);
+    }
+
+    int hits = 0;
+    for(int i = 0; i < 50; ++i)
+    {
+      Vector3df direction(std::cos(.3f * i), .2f * (i % 7) - .6f, std::sin(.3f * i));
+      normalize(direction);
+      Ray ray(Vector3df(.5f, 1.f, 0.f) - 10.f * direction, direction);
+
+      HitRecord mesh_hit, triangle_hit;
+      Primitive* mesh_primitive = mesh_scene->getFirstCollision(ray, mesh_hit, 0, std::numeric_limits<float>::max());
+      Primitive* triangle_primitive = triangle_scene->getFirstCollision(ray, triangle_hit, 0, std::numeric_limits<float>::max());
+      BOOST_REQUIRE_EQUAL(mesh_primitive == NULL, triangle_primitive == NULL);
+      if(mesh_primitive == NULL)
+      {
+        continue;
+      }
+      ++hits;
+      BOOST_CHECK_EQUAL(static_cast<MeshTriangle*>(mesh_primitive)->getIndex(), static_cast<unsigned int>(std::find(triangles.begin(), triangles.end(), triangle_primitive) - triangles.begin()));
+      BOOST_CHECK_CLOSE(mesh_hit.dist, triangle_hit.dist, 1e-3);
+      BOOST_CHECK_SMALL(mesh_hit.u - triangle_hit.u, 1e-4f);
+      BOOST_CHECK_SMALL(mesh_hit.v - triangle_hit.v, 1e-4f);
+      BOOST_CHECK(mesh_scene->testCollision(ray, mesh_hit.dist + .01f));
+    }
+    BOOST_CHECK(hits > 10);
+  }
+
+  delete mesh_scene;
+  delete triangle_scene;
+}
+
+BOOST_AUTO_TEST_CASE( test_IRT_TriangleMesh_indices )
+{
+  const float vertices[] = {0.f, 0.f, 0.f, 1.f, 0.f, 0.f, 0.f, 1.f, 0.f};
+  const unsigned int indices[] = {0, 1, 3};
+
+  BOOST_CHECK_THROW(TriangleMesh(vertices, 3, indices, 1), std::out_of_range);
+}
+
+BOOST_AUTO_TEST_SUITE_END()